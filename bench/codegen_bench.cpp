@@ -0,0 +1,131 @@
+/**
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2015 Eric Halère
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * \file codegen_bench.cpp
+ * Compares the code generated by fsm_codegen with the interpreted FSM::Fsm,
+ * on the machine of turnstile.fsm. turnstile_fsm.h is generated with
+ * `fsm_codegen turnstile.fsm turnstile_fsm.h` (see README.md).
+ */
+
+#include <benchmark/benchmark.h>
+#include <string>
+#include <vector>
+#include "../include/fsm.h"
+#include "../include/fsm_dsl.h"
+#include "turnstile_fsm.h"
+
+namespace {
+
+    // The same event sequence is sent to both implementations. It goes
+    // through all the states and comes back to Locked.
+    const char * const sequence[] = {
+        "Coin", "Coin", "Push", "Push", "Ticket", "Valid", "Push",
+        "Ticket", "Invalid", "Ticket", "Valid", "Repair",
+    };
+    const size_t sequence_size = sizeof(sequence) / sizeof(sequence[0]);
+
+    struct Hooks {
+        int count;
+        bool ticketOk() { return count % 2 == 0; }
+        void unlock(Turnstile::Event) { count++; }
+        void alarm(Turnstile::Event) { count++; }
+        void lock(Turnstile::Event) { count++; }
+        void refund(Turnstile::Event) { count++; }
+    };
+
+    Turnstile::Event generated_event(const std::string & name) {
+        const char * const names[] = { "Coin", "Push", "Ticket", "Valid", "Invalid", "Repair", "Stop" };
+        for(int i = 0; i < 7; i++) {
+            if(name == names[i]) return static_cast<Turnstile::Event>(i);
+        }
+        return Turnstile::Event::Stop;
+    }
+
+    // The interpreted machine, built from the same text definition.
+    struct Interpreted {
+        FSM::Registry registry;
+        std::vector<FSM::State *> states;
+        std::vector<FSM::Event *> events;
+        FSM::Fsm fsm;
+        int count;
+
+        explicit Interpreted(bool frozen) : count(0) {
+            FSM::Description description;
+            std::string error;
+            FSM::load_description("turnstile.fsm", description, error);
+            for(auto& name : description.states) {
+                if(registry.state(name)) continue;
+                states.push_back(new FSM::State());
+                registry.add_state(name, states.back());
+            }
+            for(auto& name : description.events) {
+                events.push_back(new FSM::Event());
+                registry.add_event(name, events.back());
+            }
+            registry.add_guard("ticketOk", [this]{ return count % 2 == 0; });
+            for(auto& name : description.actions) {
+                registry.add_action(name, [this](FSM::Event *){ count++; });
+            }
+            std::vector<FSM::Trans> transitions;
+            FSM::bind_description(description, registry, transitions, error);
+            fsm.add_transitions(transitions);
+            if(frozen) fsm.freeze();
+            fsm.init();
+        }
+        ~Interpreted() {
+            for(auto state : states) delete state;
+            for(auto event : events) delete event;
+        }
+    };
+
+    void BM_Generated(benchmark::State & state) {
+        Hooks hooks = { 0 };
+        Turnstile::Fsm<Hooks> fsm(hooks);
+        fsm.init();
+        fsm.execute(Turnstile::Event::Push);
+        std::vector<Turnstile::Event> events;
+        for(size_t i = 0; i < sequence_size; i++) events.push_back(generated_event(sequence[i]));
+        for(auto _ : state) {
+            for(auto event : events) benchmark::DoNotOptimize(fsm.execute(event));
+        }
+        state.SetItemsProcessed(state.iterations() * sequence_size);
+    }
+
+    void BM_Interpreted(benchmark::State & state, bool frozen) {
+        Interpreted machine(frozen);
+        machine.fsm.execute(machine.registry.event("Push"));
+        std::vector<FSM::Event *> events;
+        for(size_t i = 0; i < sequence_size; i++) events.push_back(machine.registry.event(sequence[i]));
+        for(auto _ : state) {
+            for(auto event : events) benchmark::DoNotOptimize(machine.fsm.execute(event));
+        }
+        state.SetItemsProcessed(state.iterations() * sequence_size);
+    }
+
+} // end anonymous namespace
+
+BENCHMARK(BM_Generated);
+BENCHMARK_CAPTURE(BM_Interpreted, map, false);
+BENCHMARK_CAPTURE(BM_Interpreted, frozen, true);
+
+BENCHMARK_MAIN();
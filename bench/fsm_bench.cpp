@@ -0,0 +1,373 @@
+/**
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2015 Eric Halère
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * \file fsm_bench.cpp
+ * Benchmarks of the execute and construction paths of FSM::Fsm.
+ *
+ * The machines are generated: `states` states, each with `fanout` outgoing
+ * transitions on distinct triggers picked from an alphabet of `alphabet`
+ * events. Before each matching transition, `guards` transitions on the same
+ * trigger have a guard that returns false. Each benchmark runs with the map
+ * dispatch and with the frozen definition, in the dense, rows and hash
+ * layouts. `BM_Bytes` compares execute_bytes() with one execute() per byte
+ * on the same frozen machine, and `BM_ParallelRun` runs a long stream with FSM::ParallelRunner.
+ */
+
+#include <benchmark/benchmark.h>
+#include <algorithm>
+#include <atomic>
+#include <new>
+#include <random>
+#include <stdlib.h>
+#include <vector>
+#if defined(__GLIBC__)
+#include <malloc.h>
+#elif defined(__APPLE__)
+#include <malloc/malloc.h>
+#endif
+#include "../include/fsm.h"
+#include "../include/fsm_parallel.h"
+#include "../include/fsm_pool.h"
+
+// Count the live allocated bytes, to measure the memory footprint of
+// instances. Updated by the worker threads of BM_ParallelRun too.
+namespace {
+    std::atomic<size_t> allocated_bytes(0);
+
+    // Size of an allocated block, 0 where the C library cannot tell it (the
+    // footprints are then not measured).
+    size_t usable_size(void * p) {
+#if defined(__GLIBC__)
+        return malloc_usable_size(p);
+#elif defined(__APPLE__)
+        return malloc_size(p);
+#else
+        return 0;
+#endif
+    }
+}
+
+// Not inlined, so that the compiler does not pair the calls of malloc() and
+// free() with new and delete.
+__attribute__((noinline)) void * operator new(size_t size) {
+    void * p = malloc(size ? size : 1);
+    if(p == nullptr) throw std::bad_alloc();
+    allocated_bytes.fetch_add(usable_size(p), std::memory_order_relaxed);
+    return p;
+}
+
+__attribute__((noinline)) void operator delete(void * p) noexcept {
+    if(p) allocated_bytes.fetch_sub(usable_size(p), std::memory_order_relaxed);
+    free(p);
+}
+
+__attribute__((noinline)) void operator delete(void * p, size_t) noexcept {
+    operator delete(p);
+}
+
+namespace {
+
+    struct Shape {
+        int states;
+        int fanout;
+        int guards;
+        int alphabet;
+    };
+
+    // A generated machine, and a random walk through it.
+    struct Machine {
+        std::vector<FSM::State *> states;
+        std::vector<FSM::Event *> events;
+        std::vector<FSM::Trans> transitions;
+        std::vector<FSM::Event *> walk;
+
+        explicit Machine(const Shape & shape) {
+            std::mt19937 rng(42);
+            for(int i = 0; i < shape.states; i++) states.push_back(new FSM::State());
+            for(int i = 0; i < shape.alphabet; i++) events.push_back(new FSM::Event());
+
+            // Triggers of each state, to build the walk.
+            std::vector<std::vector<FSM::Event *> > triggers(shape.states);
+            transitions.push_back({ FSM::Fsm::Fsm_Initial, states[0], events[0], nullptr, nullptr });
+            std::vector<int> alphabet(shape.alphabet);
+            for(int i = 0; i < shape.alphabet; i++) alphabet[i] = i;
+            for(int s = 0; s < shape.states; s++) {
+                std::shuffle(alphabet.begin(), alphabet.end(), rng);
+                for(int t = 0; t < shape.fanout && t < shape.alphabet; t++) {
+                    FSM::Event * trigger = events[alphabet[t]];
+                    FSM::State * to = states[rng() % shape.states];
+                    for(int g = 0; g < shape.guards; g++) {
+                        transitions.push_back({ states[s], to, trigger, []{ return false; }, nullptr });
+                    }
+                    transitions.push_back({ states[s], to, trigger, nullptr, [](FSM::Event *){} });
+                    triggers[s].push_back(trigger);
+                }
+            }
+
+            // Walk the machine, starting from states[0].
+            int s = 0;
+            for(int i = 0; i < 4096; i++) {
+                FSM::Event * trigger = triggers[s][rng() % triggers[s].size()];
+                walk.push_back(trigger);
+                for(auto& transition : transitions) {
+                    if(transition.from_state == states[s] && transition.trigger == trigger) {
+                        s = static_cast<int>(std::find(states.begin(), states.end(), transition.to_state) - states.begin());
+                        break;
+                    }
+                }
+            }
+        }
+
+        ~Machine() {
+            for(auto state : states) delete state;
+            for(auto event : events) delete event;
+        }
+    };
+
+    // Dispatch of the machine: map, or frozen with a given layout.
+    enum Dispatch { Map, Dense, Rows, Hash };
+
+    void prepare(FSM::Fsm & fsm, Dispatch dispatch) {
+        if(dispatch == Dense) fsm.freeze(FSM::Definition::Layout_Dense);
+        if(dispatch == Rows) fsm.freeze(FSM::Definition::Layout_Rows);
+        if(dispatch == Hash) fsm.freeze(FSM::Definition::Layout_Hash);
+    }
+
+    Shape shape_of(const benchmark::State & state) {
+        Shape shape = {
+            static_cast<int>(state.range(0)),
+            static_cast<int>(state.range(1)),
+            static_cast<int>(state.range(2)),
+            static_cast<int>(state.range(3)),
+        };
+        return shape;
+    }
+
+    void BM_Execute(benchmark::State & state, Dispatch dispatch) {
+        Machine machine(shape_of(state));
+        FSM::Fsm fsm;
+        fsm.add_transitions(machine.transitions);
+        prepare(fsm, dispatch);
+        fsm.init();
+        fsm.execute(machine.events[0]);
+        size_t i = 0;
+        for(auto _ : state) {
+            benchmark::DoNotOptimize(fsm.execute(machine.walk[i]));
+            i = (i + 1) % machine.walk.size();
+        }
+        state.SetItemsProcessed(state.iterations());
+    }
+
+    void BM_AddTransitions(benchmark::State & state, Dispatch dispatch) {
+        Machine machine(shape_of(state));
+        for(auto _ : state) {
+            FSM::Fsm fsm;
+            fsm.add_transitions(machine.transitions);
+            prepare(fsm, dispatch);
+            // The first event also pays for lazy work.
+            fsm.init();
+            benchmark::DoNotOptimize(fsm.execute(machine.events[0]));
+        }
+        state.SetItemsProcessed(state.iterations() * machine.transitions.size());
+        state.counters["transitions"] = static_cast<double>(machine.transitions.size());
+    }
+
+    void BM_Footprint(benchmark::State & state, Dispatch dispatch) {
+        Machine machine(shape_of(state));
+        size_t bytes = 0;
+        for(auto _ : state) {
+            const size_t before = allocated_bytes.load(std::memory_order_relaxed);
+            FSM::Fsm * fsm = new FSM::Fsm();
+            fsm->add_transitions(machine.transitions);
+            prepare(*fsm, dispatch);
+            bytes = allocated_bytes.load(std::memory_order_relaxed) - before;
+            delete fsm;
+        }
+        state.counters["bytes"] = static_cast<double>(bytes);
+        state.counters["bytes_per_transition"] = static_cast<double>(bytes) / machine.transitions.size();
+    }
+
+    void BM_Lifecycle(benchmark::State & state) {
+        // Construction registers an atexit() handler, which is part of the
+        // measured cost.
+        for(auto _ : state) {
+            FSM::Fsm * fsm = new FSM::Fsm();
+            benchmark::DoNotOptimize(fsm);
+            delete fsm;
+        }
+        state.SetItemsProcessed(state.iterations());
+    }
+
+    void BM_SharedLifecycle(benchmark::State & state) {
+        Machine machine(shape_of(state));
+        FSM::Fsm prototype;
+        prototype.add_transitions(machine.transitions);
+        prototype.freeze();
+        std::shared_ptr<const FSM::Definition> def = prototype.definition();
+        size_t bytes = 0;
+        for(auto _ : state) {
+            const size_t before = allocated_bytes.load(std::memory_order_relaxed);
+            FSM::Fsm * fsm = new FSM::Fsm(def);
+            fsm->init();
+            bytes = allocated_bytes.load(std::memory_order_relaxed) - before;
+            benchmark::DoNotOptimize(fsm);
+            delete fsm;
+        }
+        state.SetItemsProcessed(state.iterations());
+        // Memory of an instance that shares its definition.
+        state.counters["bytes"] = static_cast<double>(bytes);
+    }
+
+    struct PayloadEvent : public FSM::Event {
+        PayloadEvent(int value) : FSM::Event(), value(value) {}
+        PayloadEvent(unsigned int id, int value) : FSM::Event(id), value(value) {}
+        int value;
+    };
+
+    void BM_CreateEvent(benchmark::State & state) {
+        for(auto _ : state) {
+            PayloadEvent * event = new PayloadEvent(1);
+            benchmark::DoNotOptimize(event);
+            delete event;
+        }
+        state.SetItemsProcessed(state.iterations());
+    }
+
+    void BM_CreatePooledEvent(benchmark::State & state) {
+        FSM::Event kind;
+        FSM::EventPool<PayloadEvent> pool;
+        for(auto _ : state) {
+            PayloadEvent * event = pool.create_as(&kind, 1);
+            benchmark::DoNotOptimize(event);
+            pool.release(event);
+        }
+        state.SetItemsProcessed(state.iterations());
+    }
+
+    // A stream of 4M events run with FSM::ParallelRunner on `threads`
+    // threads (1 is the serial table walk).
+    void BM_ParallelRun(benchmark::State & state) {
+        Machine machine({ 64, 4, 0, 16 });
+        FSM::Fsm fsm;
+        fsm.add_transitions(machine.transitions);
+        fsm.freeze();
+        std::vector<FSM::Event *> stream;
+        while(stream.size() < (1u << 22)) stream.insert(stream.end(), machine.walk.begin(), machine.walk.end());
+        FSM::ParallelRunner runner(fsm.definition(), static_cast<unsigned int>(state.range(0)));
+        FSM::State * end = nullptr;
+        for(auto _ : state) {
+            runner.run(stream.data(), stream.size(), FSM::Fsm::Fsm_Initial, end);
+            benchmark::DoNotOptimize(end);
+        }
+        state.SetItemsProcessed(state.iterations() * stream.size());
+    }
+
+    // A lexer of numbers and words over 1 MB of input, with one trigger
+    // execute()d per byte, or with execute_bytes().
+    void BM_Bytes(benchmark::State & state) {
+        FSM::State idle, number, word;
+        FSM::Event digit, letter, separator;
+        FSM::Fsm fsm;
+        fsm.add_transitions({
+            { FSM::Fsm::Fsm_Initial, &idle, &separator, nullptr, nullptr },
+            { &idle, &number, &digit, nullptr, nullptr },
+            { &idle, &word, &letter, nullptr, nullptr },
+            { &number, &number, &digit, nullptr, nullptr },
+            { &number, &idle, &separator, nullptr, [](FSM::Event *) {} },
+            { &word, &word, &letter, nullptr, nullptr },
+            { &word, &idle, &separator, nullptr, nullptr },
+        });
+        std::vector<FSM::Event *> triggers(256, &separator);
+        for(int c = '0'; c <= '9'; c++) triggers[c] = &digit;
+        for(int c = 'a'; c <= 'z'; c++) triggers[c] = &letter;
+        fsm.set_byte_triggers(triggers);
+        // Frozen in both runs, as execute_bytes() does, so that only the
+        // byte table is compared.
+        fsm.freeze();
+        fsm.init();
+        std::mt19937 rng(42);
+        const char alphabet[] = "0123456789abcdefghijklmnopqrstuvwxyz  ";
+        std::vector<uint8_t> input(1 << 20);
+        for(auto& c : input) c = static_cast<uint8_t>(alphabet[rng() % (sizeof(alphabet) - 1)]);
+        for(auto _ : state) {
+            if(state.range(0)) {
+                fsm.execute_bytes(input.data(), input.size());
+            } else {
+                for(uint8_t c : input) fsm.execute(triggers[c]);
+            }
+            benchmark::DoNotOptimize(fsm.state());
+        }
+        state.SetBytesProcessed(state.iterations() * input.size());
+    }
+
+    // states, fanout, guards, alphabet
+    void StateCounts(benchmark::internal::Benchmark * b) {
+        for(int states : { 4, 64, 1024, 8192 }) b->Args({ states, 4, 0, 16 });
+    }
+    void Fanouts(benchmark::internal::Benchmark * b) {
+        for(int fanout : { 1, 4, 16, 64 }) b->Args({ 64, fanout, 0, 64 });
+    }
+    void GuardCounts(benchmark::internal::Benchmark * b) {
+        for(int guards : { 0, 1, 4, 16 }) b->Args({ 64, 4, guards, 16 });
+    }
+    void AlphabetSizes(benchmark::internal::Benchmark * b) {
+        for(int alphabet : { 4, 64, 1024 }) b->Args({ 64, 4, 0, alphabet });
+    }
+    void BuildSizes(benchmark::internal::Benchmark * b) {
+        for(int states : { 16, 256, 2500 }) b->Args({ states, 4, 0, 64 });
+    }
+
+} // end anonymous namespace
+
+BENCHMARK_CAPTURE(BM_Execute, map_states, Map)->Apply(StateCounts);
+BENCHMARK_CAPTURE(BM_Execute, dense_states, Dense)->Apply(StateCounts);
+BENCHMARK_CAPTURE(BM_Execute, rows_states, Rows)->Apply(StateCounts);
+BENCHMARK_CAPTURE(BM_Execute, hash_states, Hash)->Apply(StateCounts);
+BENCHMARK_CAPTURE(BM_Execute, map_fanout, Map)->Apply(Fanouts);
+BENCHMARK_CAPTURE(BM_Execute, dense_fanout, Dense)->Apply(Fanouts);
+BENCHMARK_CAPTURE(BM_Execute, rows_fanout, Rows)->Apply(Fanouts);
+BENCHMARK_CAPTURE(BM_Execute, hash_fanout, Hash)->Apply(Fanouts);
+BENCHMARK_CAPTURE(BM_Execute, map_guards, Map)->Apply(GuardCounts);
+BENCHMARK_CAPTURE(BM_Execute, dense_guards, Dense)->Apply(GuardCounts);
+BENCHMARK_CAPTURE(BM_Execute, rows_guards, Rows)->Apply(GuardCounts);
+BENCHMARK_CAPTURE(BM_Execute, hash_guards, Hash)->Apply(GuardCounts);
+BENCHMARK_CAPTURE(BM_Execute, map_alphabet, Map)->Apply(AlphabetSizes);
+BENCHMARK_CAPTURE(BM_Execute, dense_alphabet, Dense)->Apply(AlphabetSizes);
+BENCHMARK_CAPTURE(BM_Execute, rows_alphabet, Rows)->Apply(AlphabetSizes);
+BENCHMARK_CAPTURE(BM_Execute, hash_alphabet, Hash)->Apply(AlphabetSizes);
+BENCHMARK_CAPTURE(BM_AddTransitions, map, Map)->Apply(BuildSizes);
+BENCHMARK_CAPTURE(BM_AddTransitions, dense, Dense)->Apply(BuildSizes);
+BENCHMARK_CAPTURE(BM_AddTransitions, rows, Rows)->Apply(BuildSizes);
+BENCHMARK_CAPTURE(BM_AddTransitions, hash, Hash)->Apply(BuildSizes);
+BENCHMARK_CAPTURE(BM_Footprint, map, Map)->Apply(BuildSizes)->Iterations(1);
+BENCHMARK_CAPTURE(BM_Footprint, dense, Dense)->Apply(BuildSizes)->Iterations(1);
+BENCHMARK_CAPTURE(BM_Footprint, rows, Rows)->Apply(BuildSizes)->Iterations(1);
+BENCHMARK_CAPTURE(BM_Footprint, hash, Hash)->Apply(BuildSizes)->Iterations(1);
+BENCHMARK(BM_Lifecycle);
+BENCHMARK(BM_SharedLifecycle)->Args({ 64, 4, 0, 16 });
+BENCHMARK(BM_CreateEvent);
+BENCHMARK(BM_CreatePooledEvent);
+BENCHMARK(BM_Bytes)->ArgName("execute_bytes")->Arg(0)->Arg(1);
+BENCHMARK(BM_ParallelRun)->Arg(1)->Arg(2)->Arg(4)->Arg(8)->UseRealTime();
+
+BENCHMARK_MAIN();
@@ -0,0 +1,344 @@
+/**
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2015 Eric Halère
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * \file scaling_bench.cpp
+ * Multi-core scaling of the execute path.
+ *
+ * M producer threads drive N machines, under three models:
+ *
+ * - `independent`: each thread owns N / M instances, each with its own
+ *   frozen definition.
+ * - `shared`: the same, but all instances share one frozen definition.
+ * - `locked`: all threads drive all N instances, each behind a mutex. With
+ *   N = 1 this is a single contended instance.
+ *
+ * All models run the frozen execute path, so that they only differ by the
+ * sharing of the definition. With `--mutable`, the `independent` and `locked`
+ * instances run on their own transitions instead, and `shared`, which needs
+ * a frozen definition, is not run.
+ *
+ * For each model and thread count, the harness prints the throughput, the
+ * p50/p99/p999 latency of single calls to execute() (one call out of
+ * `sample` is timed) and the cache misses per event, when the perf counters
+ * are available (Linux, perf_event_paranoid permitting).
+ *
+ * ~~~
+ * scaling_bench [--machines N] [--threads M[,M...]] [--events E]
+ *               [--model independent|shared|locked|all] [--mutable]
+ * ~~~
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+#include "fsm.h"
+
+namespace {
+
+    using Clock = std::chrono::steady_clock;
+
+    enum Model { Independent, Shared, Locked };
+    const char * const model_names[] = { "independent", "shared", "locked" };
+
+    struct Options {
+        int machines = 64;
+        std::vector<int> threads;
+        long events = 2000000;
+        int sample = 8;
+        int model = -1;
+        bool frozen = true;
+    };
+
+    // A complete machine: every state accepts every event, so that any stream
+    // of events is valid, whatever the interleaving of the threads.
+    struct Machine {
+        std::vector<FSM::State *> states;
+        std::vector<FSM::Event *> events;
+        std::vector<FSM::Trans> transitions;
+
+        Machine(int state_count, int event_count) {
+            std::mt19937 rng(42);
+            for(int i = 0; i < state_count; i++) states.push_back(new FSM::State());
+            for(int i = 0; i < event_count; i++) events.push_back(new FSM::Event());
+            for(auto event : events) {
+                transitions.push_back({ FSM::Fsm::Fsm_Initial, states[0], event, nullptr, nullptr });
+            }
+            for(auto from : states) {
+                for(auto event : events) {
+                    transitions.push_back({ from, states[rng() % states.size()], event, nullptr, [](FSM::Event *){} });
+                }
+            }
+        }
+
+        ~Machine() {
+            for(auto state : states) delete state;
+            for(auto event : events) delete event;
+        }
+    };
+
+    // A machine instance, with the lock of the `locked` model.
+    struct Instance {
+        std::unique_ptr<FSM::Fsm> fsm;
+        std::mutex mutex;
+    };
+
+    // Counts the cache misses of this process and of the threads it creates
+    // while the counter is open.
+    class CacheMisses {
+        int m_fd;
+
+    public:
+        CacheMisses() : m_fd(-1) {
+#ifdef __linux__
+            struct perf_event_attr attr;
+            memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = PERF_COUNT_HW_CACHE_MISSES;
+            attr.disabled = 1;
+            attr.inherit = 1;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            m_fd = static_cast<int>(syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0));
+#endif
+        }
+
+        ~CacheMisses() {
+#ifdef __linux__
+            if(m_fd >= 0) close(m_fd);
+#endif
+        }
+
+        bool available() const { return m_fd >= 0; }
+
+        void start() {
+#ifdef __linux__
+            if(m_fd >= 0) {
+                ioctl(m_fd, PERF_EVENT_IOC_RESET, 0);
+                ioctl(m_fd, PERF_EVENT_IOC_ENABLE, 0);
+            }
+#endif
+        }
+
+        // Returns the count since start().
+        uint64_t stop() {
+            uint64_t count = 0;
+#ifdef __linux__
+            if(m_fd >= 0) {
+                ioctl(m_fd, PERF_EVENT_IOC_DISABLE, 0);
+                if(read(m_fd, &count, sizeof(count)) != sizeof(count)) count = 0;
+            }
+#endif
+            return count;
+        }
+    };
+
+    struct Result {
+        double events_per_second;
+        double p50;
+        double p99;
+        double p999;
+        double misses_per_event;
+    };
+
+    double percentile(const std::vector<uint32_t> & sorted, double p) {
+        if(sorted.empty()) return 0;
+        size_t i = static_cast<size_t>(p * (sorted.size() - 1));
+        return sorted[i];
+    }
+
+    Result run(const Options & options, Model model, int thread_count, Machine & machine) {
+        // Build the instances.
+        std::vector<std::unique_ptr<Instance> > instances;
+        std::shared_ptr<const FSM::Definition> def;
+        if(model == Shared) {
+            FSM::Fsm prototype;
+            prototype.add_transitions(machine.transitions);
+            prototype.freeze();
+            def = prototype.definition();
+        }
+        for(int i = 0; i < options.machines; i++) {
+            std::unique_ptr<Instance> instance(new Instance());
+            if(model == Shared) {
+                instance->fsm.reset(new FSM::Fsm(def));
+            } else {
+                instance->fsm.reset(new FSM::Fsm());
+                instance->fsm->add_transitions(machine.transitions);
+                if(options.frozen) instance->fsm->freeze();
+            }
+            instance->fsm->init();
+            instances.push_back(std::move(instance));
+        }
+
+        const long per_thread = options.events / thread_count;
+        std::vector<std::vector<uint32_t> > latencies(thread_count);
+        // Events executed by each thread: none by a thread without machine.
+        std::vector<long> executed(thread_count, 0);
+        std::atomic<int> ready(0);
+        std::atomic<bool> go(false);
+
+        auto producer = [&](int t) {
+            // The machines of this thread: its share in the independent
+            // models, all of them in the locked model.
+            std::vector<Instance *> mine;
+            for(int i = 0; i < options.machines; i++) {
+                if(model == Locked || i % thread_count == t) mine.push_back(instances[i].get());
+            }
+            std::mt19937 rng(t + 1);
+            std::vector<FSM::Event *> stream;
+            for(int i = 0; i < 4096; i++) stream.push_back(machine.events[rng() % machine.events.size()]);
+            std::vector<uint32_t> & samples = latencies[t];
+            samples.reserve(per_thread / options.sample + 1);
+
+            ready++;
+            while(not go.load(std::memory_order_acquire)) {}
+            if(mine.empty()) return;
+
+            size_t m = 0;
+            for(long i = 0; i < per_thread; i++) {
+                Instance & instance = *mine[m];
+                FSM::Event * event = stream[i & 4095];
+                const bool timed = (i % options.sample) == 0;
+                Clock::time_point start;
+                if(timed) start = Clock::now();
+                if(model == Locked) {
+                    std::lock_guard<std::mutex> lock(instance.mutex);
+                    instance.fsm->execute(event);
+                } else {
+                    instance.fsm->execute(event);
+                }
+                if(timed) {
+                    samples.push_back(static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count()));
+                }
+                if(++m == mine.size()) m = 0;
+            }
+            executed[t] = per_thread;
+        };
+
+        std::vector<std::thread> threads;
+        CacheMisses misses;
+        misses.start();
+        for(int t = 0; t < thread_count; t++) threads.push_back(std::thread(producer, t));
+        while(ready.load() != thread_count) {}
+        const Clock::time_point start = Clock::now();
+        go.store(true, std::memory_order_release);
+        for(auto& thread : threads) thread.join();
+        const double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+        const uint64_t miss_count = misses.stop();
+
+        std::vector<uint32_t> all;
+        for(auto& samples : latencies) all.insert(all.end(), samples.begin(), samples.end());
+        std::sort(all.begin(), all.end());
+        double events = 0;
+        for(long count : executed) events += static_cast<double>(count);
+        Result result = {
+            events / seconds,
+            percentile(all, 0.50),
+            percentile(all, 0.99),
+            percentile(all, 0.999),
+            misses.available() ? miss_count / events : -1,
+        };
+        return result;
+    }
+
+    std::vector<int> parse_list(const char * text) {
+        std::vector<int> values;
+        std::stringstream in(text);
+        std::string item;
+        while(std::getline(in, item, ',')) values.push_back(atoi(item.c_str()));
+        return values;
+    }
+
+    int usage(const char * name) {
+        std::cerr << "usage: " << name << " [--machines N] [--threads M[,M...]] [--events E]"
+                  << " [--sample S] [--model independent|shared|locked|all] [--mutable]\n";
+        return 2;
+    }
+
+} // end anonymous namespace
+
+int main(int argc, char ** argv) {
+    Options options;
+    for(int i = 1; i < argc; i++) {
+        const std::string arg = argv[i];
+        const bool has_value = i + 1 < argc;
+        if(arg == "--machines" && has_value) options.machines = atoi(argv[++i]);
+        else if(arg == "--threads" && has_value) options.threads = parse_list(argv[++i]);
+        else if(arg == "--events" && has_value) options.events = atol(argv[++i]);
+        else if(arg == "--sample" && has_value) options.sample = atoi(argv[++i]);
+        else if(arg == "--mutable") options.frozen = false;
+        else if(arg == "--model" && has_value) {
+            const std::string name = argv[++i];
+            options.model = -1;
+            for(int m = 0; m < 3; m++) {
+                if(name == model_names[m]) options.model = m;
+            }
+            if(options.model < 0 && name != "all") return usage(argv[0]);
+        }
+        else return usage(argv[0]);
+    }
+    if(options.machines < 1 || options.events < 1 || options.sample < 1) return usage(argv[0]);
+    if(options.model == Shared && not options.frozen) return usage(argv[0]);
+    if(options.threads.empty()) {
+        const int cores = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+        for(int t = 1; t < cores; t *= 2) options.threads.push_back(t);
+        options.threads.push_back(cores);
+    }
+    for(int t : options.threads) {
+        if(t < 1) return usage(argv[0]);
+    }
+
+    Machine machine(16, 8);
+    printf("%-12s %7s %8s %14s %8s %8s %8s %12s\n",
+           "model", "threads", "machines", "events/s", "p50 ns", "p99 ns", "p999 ns", "misses/event");
+    for(int m = 0; m < 3; m++) {
+        if(options.model >= 0 && options.model != m) continue;
+        if(m == Shared && not options.frozen) continue;
+        for(int t : options.threads) {
+            Result r = run(options, static_cast<Model>(m), t, machine);
+            char misses[32] = "n/a";
+            if(r.misses_per_event >= 0) snprintf(misses, sizeof(misses), "%.3f", r.misses_per_event);
+            printf("%-12s %7d %8d %14.0f %8.0f %8.0f %8.0f %12s\n",
+                   model_names[m], t, options.machines, r.events_per_second, r.p50, r.p99, r.p999, misses);
+            fflush(stdout);
+        }
+    }
+    return 0;
+}
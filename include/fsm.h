@@ -97,7 +97,6 @@
  * definitions of state machines (notably the UML definition). Some parts that
  * are omitted are.
  *
- * - do actions
  * - hierarchical nested states
  * - orthogonal regions
  *
@@ -136,14 +135,266 @@
  * fsm.add_debug_fn(nullptr);
  * ~~~
  *
+ * Journal
+ * -------
+ *
+ * A journal function of type `journalFn` can be added with
+ * `add_journal_fn()`. It is invoked with every trigger delivered to
+ * `execute()` and on `init()` and `reset()`, before the machine acts on it.
+ * `FSM::Journal` (fsm_journal.h) persists these records to a file and
+ * `FSM::Replayer` rebuilds the instance states from it after a crash.
+ *
+ * Trigger sets
+ * ------------
+ *
+ * A transition taken on any of several triggers is defined once, with a
+ * `TriggerSet` instead of a trigger (see FSM::Trans). Checking whether a
+ * trigger is in the set is a single bit test, and a frozen definition gives
+ * the triggers of the set that are handled the same way elsewhere a single
+ * equivalence class.
+ *
+ * Wildcards
+ * ---------
+ *
+ * A transition from `Fsm::Fsm_AnyState` is a transition from every state
+ * other than the pseudo states, and a transition on `Fsm::Fsm_AnyTrigger` is
+ * taken on any trigger. They are fallbacks: the transitions of the current
+ * state on the trigger are tried first, then those from any state on the
+ * trigger, then those of the current state on any trigger, then those from
+ * any state on any trigger. A fallback is also tried when the guards of all
+ * the transitions before it are false.
+ *
+ * ~~~
+ * fsm.add_transitions({
+ *   { FSM::Fsm::Fsm_AnyState, FSM::Fsm::Fsm_Final, shutdown, nullptr, nullptr },
+ * });
+ * ~~~
+ *
+ * A frozen definition merges the transitions from any state into the
+ * candidate rows of each state and class, and keeps those on any trigger
+ * once per state, tried when the candidates of the class are not taken.
+ *
+ * Eventless transitions
+ * ---------------------
+ *
+ * A transition with neither a trigger nor a trigger set (`trigger` is
+ * nullptr) is eventless: it is tried as soon as a transition enters its
+ * state, and taken if its guard is true. Chains of decision states are thus
+ * resolved by a single call to execute(). Their actions and the debug
+ * function get `Fsm::Fsm_Completion` as trigger.
+ *
+ * ~~~
+ * fsm.add_transitions({
+ *   { idle, check, start, nullptr, nullptr },
+ *   { check, ok, nullptr, []{ return valid(); }, nullptr },
+ *   { check, failed, nullptr, nullptr, nullptr },
+ * });
+ * ~~~
+ *
+ * To stop cycles, execute() returns Fsm_CompletionLimit when more than
+ * `set_max_completion_steps()` eventless transitions are taken in a row. The
+ * machine stays in the state reached.
+ *
+ * History
+ * -------
+ *
+ * There are no nested states, but states can be grouped with
+ * `add_history()`: the group stands for a composite state, and a history
+ * pseudo state is given, which is used as the `to_state` of the transitions
+ * that resume the composite. Such a transition goes to the state of the group
+ * that was entered last, or to the default state of the group the first time
+ * (shallow history; with one level of states, deep history is the same).
+ *
+ * ~~~
+ * fsm.add_history(resume, { washing, rinsing, spinning }, washing);
+ * fsm.add_transitions({
+ *   { washing, paused, pause, nullptr, nullptr },
+ *   { rinsing, paused, pause, nullptr, nullptr },
+ *   { spinning, paused, pause, nullptr, nullptr },
+ *   { paused, resume, start, nullptr, nullptr },
+ * });
+ * ~~~
+ *
+ * Each instance keeps the last state of each group in an array of slots, so
+ * resuming is one read. The slots are cleared by reset(), and can be saved
+ * and restored with `history()` and `restore_history()` (FSM::Journal
+ * snapshots include them).
+ *
+ * Deferred triggers
+ * -----------------
+ *
+ * A state can defer a set of triggers (see `add_deferrals()`). A trigger that
+ * has no transition from the current state and is deferred by it is kept in
+ * a small queue inside the instance, and executed again, in order, once the
+ * machine enters a state that does not defer it. The queue is only looked at
+ * after a transition that enters a state, and the events must stay valid
+ * until then.
+ *
+ * ~~~
+ * fsm.add_deferrals(connecting, FSM::TriggerSet::make({ data }));
+ * fsm.execute(data);    // Fsm_Deferred
+ * fsm.execute(ready);   // connecting -> connected, then data is executed
+ * ~~~
+ *
+ * Asynchronous actions
+ * --------------------
+ *
+ * An action that waits for I/O calls `Fsm::begin_async()` and returns at
+ * once. The machine then exits the source state and is transitioning: it
+ * queues the triggers given to execute(), which returns Fsm_Transitioning,
+ * until the action completes the returned `AsyncToken`. The transition is
+ * then finished (the target state is entered, eventless transitions and
+ * deferred triggers are taken) and the queued triggers are executed in
+ * order.
+ *
+ * ~~~
+ * fsm.add_transitions({
+ *   { idle, sent, send, nullptr, [&](FSM::Event * e) {
+ *       FSM::AsyncToken token = FSM::Fsm::begin_async();
+ *       socket.async_write(e, [token]() mutable { token.complete(); });
+ *   } },
+ * });
+ * ~~~
+ *
+ * With `set_executor()`, the token can be completed from any thread: the
+ * rest of the transition is posted to the executor, which must run it on a
+ * thread that owns the machine (e.g. its event loop or strand). Without one,
+ * it runs inside complete(), which must then be called by the thread that
+ * owns the machine. An action written as a C++20 coroutine can be
+ * adapted with `coroutine_action()` (see fsm_coroutine.h).
+ *
+ * Do-activities
+ * -------------
+ *
+ * A state can have a do-activity (see `State::setDoActivity()`), which a
+ * machine starts after the enter function of the state, on the executor set
+ * with `set_activity_executor()` (a thread pool, say; without one, on a new
+ * thread). It is cancelled when the machine exits the state, before the exit
+ * function: the activity checks `Activity::cancelled()` and returns. It can
+ * post events to the machine, e.g. to signal that it is done; they are
+ * executed on the executor of the machine (see "Asynchronous actions"), and
+ * dropped once the activity is cancelled. Without executor, they are queued
+ * until the thread of the machine calls `run_posted()`.
+ *
+ * ~~~
+ * loading->setDoActivity([](const FSM::Activity & activity) {
+ *     while(not activity.cancelled() && load_chunk()) {}
+ *     activity.post(loaded);
+ * });
+ * fsm.set_activity_executor([&](std::function<void()> fn) { pool.submit(fn); });
+ * fsm.set_executor([&](std::function<void()> fn) { loop.post(fn); });
+ * ~~~
+ *
+ * A machine runs one activity at a time, the one of its current state.
+ * The task runs a copy of the function of the state, but cancelling does not
+ * wait for it to return: `wait_activities()` does, before the machine or
+ * the objects the activities use are destroyed.
+ *
+ * Typed events
+ * ------------
+ *
+ * A `TypedEvent<T>` refers to a payload of type `T` without copying it. The
+ * trigger used in the transitions is a TypedEvent constructed without payload;
+ * events with a payload are constructed from it (on the stack, or over a
+ * receive buffer) and take its ID, so that they trigger the same transitions.
+ * `typed_action()` adapts a function taking the payload to an `actionFn`.
+ *
+ * ~~~
+ * FSM::TypedEvent<Coin> coin;
+ * fsm.add_transitions({
+ *   { locked, unlocked, &coin, nullptr, FSM::typed_action<Coin>([](const Coin & c) { ... }) },
+ * });
+ * Coin c = { 50 };
+ * fsm.execute(coin, c);
+ * ~~~
+ *
+ * The payload is only referenced during the call to execute().
+ *
+ * Byte streams
+ * ------------
+ *
+ * A machine whose events are input bytes (a protocol lexer, say) maps each
+ * byte value to a trigger with `set_byte_triggers()`, and runs buffers with
+ * `execute_bytes()`. The machine is frozen, and the state reached from each
+ * state on each byte is compiled into a table of 256 columns per state.
+ * Bytes that take a plain transition cost one lookup in the table. The
+ * transitions with a guard or an action, those that leave a state with an
+ * exit function or enter one with an enter function, a do-activity or
+ * eventless transitions are marked, and executed as by execute().
+ *
+ * ~~~
+ * std::vector<FSM::Event *> bytes(256, other);
+ * for(int c = '0'; c <= '9'; c++) bytes[c] = digit;
+ * bytes[';'] = end;   // { number, idle, end, nullptr, emit_number }
+ * fsm.set_byte_triggers(bytes);
+ * fsm.execute_bytes(buffer, size);
+ * ~~~
+ *
+ * State functions must be set before set_byte_triggers(). With a journal or
+ * debug function, deferrals or history, every byte is executed as by
+ * execute().
+ *
+ * Frozen definition
+ * -----------------
+ *
+ * Once all transitions have been added, `freeze()` compiles them into an
+ * immutable `FSM::Definition`. States and triggers get dense indexes, triggers
+ * that behave the same in every state are merged into equivalence classes,
+ * and `execute()` finds the candidate transitions with a single table lookup
+ * instead of a scan over all outgoing transitions of the state. Large
+ * sparse machines use a compact layout of the table instead (see
+ * FSM::Definition::Layout). A definition can be shared by many instances,
+ * and saved to and loaded from a binary file (see fsm_binary.h).
+ *
+ * Updating a definition
+ * ---------------------
+ *
+ * A definition is immutable, so machines that share it cannot have
+ * transitions added while they run. They can follow an `FSM::DefinitionSlot`
+ * instead, which holds the current definition of the group:
+ *
+ * ~~~
+ * auto slot = std::make_shared<FSM::DefinitionSlot>(prototype.definition());
+ * fsm.set_definition_slot(slot);
+ * // From any thread:
+ * slot->add_transitions_async({ { stateB, stateC, c, nullptr, nullptr } });
+ * ~~~
+ *
+ * add_transitions() copies the transitions of the current definition, adds
+ * the new ones, builds a new definition and publishes it; publish() replaces
+ * the definition outright. Writers are serialized. A following machine
+ * compares the epoch of the slot, an atomic counter, with its own at the
+ * start of execute() and, when a new definition was published, takes it
+ * and looks its current state up in it. Only taking it may wait: the
+ * shared_ptr is read with std::atomic_load(), which briefly locks in the
+ * common standard libraries (a lock shared with the writer). A state that the new definition
+ * does not have matches no trigger, until reset(). The old definition is
+ * freed when the last machine has moved on.
+ *
+ * A definition can be published with an `FSM::StateMapping`, for the
+ * machines whose current state was renamed or removed: they are moved to
+ * the state it gives, without calling exit or enter functions (the
+ * do-activity of the old state is cancelled).
+ *
+ * A machine does not change definition while it waits for an asynchronous
+ * action, nor in an execute() called by one of its actions. Adding
+ * transitions to the machine itself unfreezes it and stops following.
+ *
  */
 
 // Includes
+#include <algorithm>
+#include <atomic>
+#include <deque>
 #include <limits>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <vector>
 #include <functional>
 #include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
 
 // Forward declarations
 
@@ -184,6 +435,38 @@ namespace FSM {
         // Errors
         // The state machine has not been initialized. Call init().
         Fsm_NotInitialized,
+        // The state or trigger is not part of this state machine.
+        Fsm_UnknownId,
+        // A file could not be written or read back, or is not valid.
+        Fsm_IOError,
+        // A text definition could not be parsed.
+        Fsm_ParseError,
+        // The trigger could not be deferred, the queue is full.
+        Fsm_QueueFull,
+        // More eventless transitions than the maximum were taken in a row.
+        Fsm_CompletionLimit,
+        // The definition uses a feature the operation does not support.
+        Fsm_Unsupported,
+        // A machine would have more states than the maximum.
+        Fsm_StateLimit,
+        
+        // Warnings added later, at the end so that the values do not change.
+        // The current state defers the trigger (see add_deferrals()).
+        Fsm_Deferred,
+        // An asynchronous action is running, the trigger is queued.
+        Fsm_Transitioning,
+    };
+    
+    // Kinds of records written to a journal function (see add_journal_fn()).
+    enum Fsm_JournalKind {
+        // A trigger was delivered to execute().
+        Journal_Event = 1,
+        // init() was called.
+        Journal_Init,
+        // reset() was called.
+        Journal_Reset,
+        // The current state of an instance was saved.
+        Journal_Snapshot,
     };
     
     // EricHal added: an event class instead of a char
@@ -194,16 +477,65 @@ namespace FSM {
         Event();
         // get the Event ID
         unsigned int getID();
+        // reserve `count` consecutive IDs, returns the first one (thread safe,
+        // as the constructor)
+        static unsigned int reserveIDs(unsigned int count);
+    protected:
+        // Constructs an event with a given ID, without taking a new one: either
+        // the ID of a trigger (the event is then handled as this trigger), or an
+        // ID from reserveIDs(). Used by EventPool (see fsm_pool.h).
+        explicit Event(unsigned int id) : m_id(id) {}
     private:
-        static unsigned int __current_id;
+        static std::atomic<unsigned int> __current_id;
         unsigned int m_id;
     };
     
+    /**
+     * An event that refers to a payload of type T (see "Typed events").
+     */
+    template<typename T>
+    class TypedEvent : public Event {
+        public :
+        // Constructs a trigger, without payload.
+        TypedEvent() : Event(), m_payload(nullptr) {}
+        // Constructs an event of the `kind` trigger, referring to `payload`.
+        TypedEvent(TypedEvent & kind, const T & payload) : Event(kind.getID()), m_payload(&payload) {}
+        
+        bool hasPayload() const { return m_payload != nullptr; }
+        const T & payload() const { assert(m_payload != nullptr); return *m_payload; }
+    private:
+        const T * m_payload;
+    };
+    
+    class Fsm;
+    
+    /**
+     * A running do-activity, as seen by its function (see "Do-activities").
+     */
+    class Activity {
+        public :
+        // Returns whether the machine exited the state. The activity should
+        // then return.
+        bool cancelled() const;
+        // Executes `event` on the machine, on its executor, or queues it for
+        // Fsm::run_posted() without executor. Has no effect once the
+        // activity is cancelled.
+        void post(Event * event) const;
+        
+    private:
+        friend class Fsm;
+        struct Operation;
+        explicit Activity(std::shared_ptr<Operation> op) : m_op(op) {}
+        std::shared_ptr<Operation> m_op;
+    };
+    
     // EricHal added: an state class instead of an int
     // this class should be derived to include information about state
     
     // Defines the function prototype for enter and exit function.
     using stateFn = std::function<void()>;
+    // Defines the function prototype for a do-activity.
+    using activityFn = std::function<void(const Activity &)>;
     
     class State {
         public :
@@ -215,16 +547,28 @@ namespace FSM {
         // set the enter and exit functions (set to nullptr to unset it)
         void setEnterFunction(stateFn iFn);
         void setExitFunction(stateFn iFn);
+        // set the do-activity (set to nullptr to unset it)
+        void setDoActivity(activityFn iFn);
         
         // invoke the enter or exit function.
         void invokeEnterFunction();
         void invokeExitFunction();
+        // invoke the do-activity, called on the activity executor.
+        void invokeDoActivity(const Activity & activity);
+        // get the do-activity.
+        activityFn getDoActivity() const { return m_doFn; }
+        
+        // whether the functions are set.
+        bool hasEnterFunction() const { return static_cast<bool>(m_enterFn); }
+        bool hasExitFunction() const { return static_cast<bool>(m_exitFn); }
+        bool hasDoActivity() const { return static_cast<bool>(m_doFn); }
         
     private:
         static unsigned int __current_id;
         unsigned int m_id;
         stateFn m_enterFn;
         stateFn m_exitFn;
+        activityFn m_doFn;
     };
     
     // Defines the function prototype for a guard function.
@@ -232,12 +576,103 @@ namespace FSM {
     // Defines the function prototype for an action function.
     // EricHal added: a event pointer to pass information to action
     using actionFn = std::function<void(Event *)>;
+    
+    // Adapts an action taking the payload of a TypedEvent<T>. The action must
+    // only be used on transitions triggered by TypedEvent<T> events with a
+    // payload.
+    template<typename T>
+    actionFn typed_action(std::function<void(const T &)> fn)
+    {
+        return [fn](Event * trigger) {
+            fn(static_cast<TypedEvent<T> *>(trigger)->payload());
+        };
+    }
     // Defines the function prototype for a debug function.
     // Parameters are: from_state, to_state, trigger
     using debugFn = std::function<void(State *,State *,Event *)>;
+    // Defines the function prototype for a journal function.
+    // Parameters are: record kind, trigger (nullptr unless kind is Journal_Event)
+    using journalFn = std::function<void(Fsm_JournalKind,Event *)>;
+    // Defines the function prototype for an executor, which runs the given
+    // function on a thread that owns the machine.
+    using executorFn = std::function<void(std::function<void()>)>;
+    
+    /**
+     * Completes an asynchronous action (see "Asynchronous actions"). Copies
+     * refer to the same action.
+     */
+    class AsyncToken {
+        public :
+        AsyncToken() : m_op() {}
+        
+        // Marks the action as done, and lets the machine finish the
+        // transition. Can be called from any thread if the machine has an
+        // executor, else only from the thread that owns the machine, since
+        // the transition is finished inside the call. Calls after the first
+        // have no effect.
+        void complete();
+        // Returns whether complete() was called.
+        bool done() const;
+        
+    private:
+        friend class Fsm;
+        struct Operation;
+        explicit AsyncToken(std::shared_ptr<Operation> op) : m_op(op) {}
+        std::shared_ptr<Operation> m_op;
+    };
+    
+    /**
+     * A set of triggers, for a transition taken on any of them (see Trans).
+     *
+     * The set is a bitset over the IDs of its triggers, starting at the
+     * lowest one, so that membership is one test whatever the size of the set.
+     */
+    class TriggerSet {
+        public :
+        template<typename InputIt>
+        TriggerSet(InputIt first, InputIt last) : m_triggers(first, last), m_base(std::numeric_limits<unsigned int>::max()), m_bits()
+        {
+            for(Event * trigger : m_triggers) {
+                m_base = std::min(m_base, trigger->getID());
+            }
+            for(Event * trigger : m_triggers) {
+                const unsigned int i = trigger->getID() - m_base;
+                if(i / 64 >= m_bits.size()) m_bits.resize(i / 64 + 1, 0);
+                m_bits[i / 64] |= uint64_t(1) << (i % 64);
+            }
+        }
+        
+        // Returns a shared set, to be referenced by transitions.
+        static std::shared_ptr<const TriggerSet> make(std::initializer_list<Event *> triggers)
+        {
+            return std::make_shared<const TriggerSet>(triggers.begin(), triggers.end());
+        }
+        
+        bool contains(unsigned int event_id) const
+        {
+            const unsigned int i = event_id - m_base;
+            return i / 64 < m_bits.size() && ((m_bits[i / 64] >> (i % 64)) & 1);
+        }
+        // The triggers, in the order they were given.
+        const std::vector<Event *> & triggers() const { return m_triggers; }
+    private:
+        std::vector<Event *> m_triggers;
+        unsigned int m_base;
+        std::vector<uint64_t> m_bits;
+    };
     
     /**
      * Defines a transition between two states.
+     *
+     * A transition taken on any of several triggers has a `triggers` set and
+     * a nullptr `trigger`:
+     *
+     * ~~~
+     * auto errors = FSM::TriggerSet::make({ &err_a, &err_b, &err_c });
+     * fsm.add_transitions({
+     *   { running, failed, nullptr, nullptr, nullptr, errors },
+     * });
+     * ~~~
      */
     struct Trans {
         State * from_state;
@@ -245,6 +680,437 @@ namespace FSM {
         Event * trigger;
         guardFn guard;
         actionFn action;
+        // Set of triggers, used instead of `trigger` if not nullptr. If both
+        // are nullptr, the transition is eventless (`Fsm::Fsm_Completion`).
+        std::shared_ptr<const TriggerSet> triggers;
+        
+        // Returns whether the transition is taken on the trigger with this ID.
+        bool has_trigger(unsigned int event_id) const
+        {
+            return triggers ? triggers->contains(event_id) : trigger->getID() == event_id;
+        }
+    };
+    
+    /**
+     * A frozen state machine definition.
+     *
+     * The tables of a definition are stored in a single relocatable blob (only
+     * offsets, no pointers), so that it can be written to a file and mapped
+     * back into memory as is. The blob holds:
+     *
+     * - the equivalence class of each trigger,
+     * - an index of the candidate transitions (rows) of each state and class,
+     *   in one of the layouts below,
+     * - the rows, grouped by `from_state` and class, in insertion order,
+     * - optionally, the names of the states, triggers, guards and actions.
+     *
+     * Layouts of the index:
+     *
+     * - Layout_Dense: a `states x classes` table of cells. Each cell is the
+     *   start of the rows of a state for a class, the next cell is the end.
+     *   One lookup, but the table grows with states x classes.
+     * - Layout_Rows: for each state, the runs of rows of the same class. The
+     *   classes of the runs (16 bits each) are packed in a hot array, apart
+     *   from the start of the runs, so that finding the class of a trigger in
+     *   a state scans a few contiguous bytes. The size grows with the number of
+     *   transitions.
+     * - Layout_Hash: a minimal perfect hash of the (state, class) pairs that
+     *   have rows (hash and displace: the pairs are hashed into buckets, and
+     *   each bucket has a displacement that sends its pairs to free slots).
+     *   A lookup is three multiplies and one probe, whatever the number of
+     *   runs of the state, and the size grows with the number of transitions.
+     *
+     * The rows of a state for a class end with the rows from Fsm_AnyState
+     * for the class (their `from` is the index of Fsm_AnyState). The rows on
+     * any trigger are only in the run of the class of Fsm_AnyTrigger, the
+     * fallbacks of the other classes (see fallbacks()). Fsm_AnyTrigger is
+     * alone in its class, which is also the class of the triggers that are
+     * not in the definition.
+     *
+     * The objects the blob refers to by index (states, triggers, guards and
+     * actions) are bound when the definition is constructed.
+     *
+     * State 0 is always Fsm_Initial and state 1 is always Fsm_Final.
+     */
+    class Definition {
+    public:
+        // Index of a state, trigger, class, row, guard or action.
+        using index_t = uint32_t;
+        static const index_t npos = 0xFFFFFFFFu;
+        
+        // Magic and version of the blob format.
+        static const char magic[8];
+        static const uint32_t version = 4;
+        
+        // Layout of the index of the rows (see above).
+        enum Layout {
+            // Layout_Dense if the table is small, then Layout_Rows if states
+            // have few runs, Layout_Hash otherwise.
+            Layout_Auto = 0,
+            Layout_Dense,
+            Layout_Rows,
+            Layout_Hash,
+        };
+        // Class of a run in Layout_Rows.
+        using run_class_t = uint16_t;
+        // Returns a bitmask of the entries of classes[0, count) equal to cls,
+        // count <= 32.
+        using matchFn = uint32_t (*)(const run_class_t * classes, index_t count, run_class_t cls);
+        
+        /**
+         * The match function used by execute(): SSE2 or AVX2 when the CPU
+         * supports it (checked on the first call), scalar otherwise.
+         */
+        static uint32_t match_classes(const run_class_t * classes, index_t count, run_class_t cls)
+        {
+            // Selected on first use, so that definitions built during the
+            // static initialization of other files can run.
+            static const matchFn fn = select_match_classes();
+            return fn(classes, count, cls);
+        }
+        static uint32_t match_classes_scalar(const run_class_t * classes, index_t count, run_class_t cls);
+        
+        // Header of the blob. Offsets are in bytes from the start of the blob.
+        struct Header {
+            char magic[8];
+            uint32_t version;
+            uint32_t size;
+            uint32_t states;
+            uint32_t triggers;
+            uint32_t classes;
+            uint32_t rows;
+            uint32_t guards;
+            uint32_t actions;
+            uint32_t layout;
+            uint32_t runs;
+            uint32_t classes_offset;
+            // Layout_Dense: cells. 0 in Layout_Rows.
+            uint32_t cells_offset;
+            // Layout_Rows: first run of each state, first row of each run, and
+            // class of each run. 0 in Layout_Dense.
+            uint32_t state_runs_offset;
+            uint32_t run_rows_offset;
+            uint32_t run_classes_offset;
+            // Layout_Hash: number of buckets and slots, displacement of each
+            // bucket, and slots. 0 in the other layouts.
+            uint32_t buckets;
+            uint32_t slots;
+            uint32_t displacements_offset;
+            uint32_t slots_offset;
+            uint32_t rows_offset;
+            // 0 if the blob has no name table.
+            uint32_t names_offset;
+        };
+        
+        // A slot of Layout_Hash: the rows [first, last) of a state for a class.
+        // state is npos if the slot is empty.
+        struct HashSlot {
+            index_t state;
+            index_t cls;
+            index_t first;
+            index_t last;
+        };
+        
+        // Hashes of Layout_Hash.
+        static uint64_t hash_key(index_t state, index_t cls)
+        {
+            uint64_t h = ((static_cast<uint64_t>(state) << 32) | cls) * 0x9E3779B97F4A7C15ull;
+            h ^= h >> 32;
+            h *= 0xD6E8FEB86659FD93ull;
+            return h ^ (h >> 32);
+        }
+        static uint32_t hash_bucket(uint64_t hash, uint32_t buckets)
+        {
+            return static_cast<uint32_t>((static_cast<uint64_t>(static_cast<uint32_t>(hash)) * buckets) >> 32);
+        }
+        static uint32_t hash_slot(uint64_t hash, uint32_t displacement, uint32_t slots)
+        {
+            const uint32_t h = static_cast<uint32_t>(((hash ^ displacement) * 0x9E3779B97F4A7C15ull) >> 32);
+            return static_cast<uint32_t>((static_cast<uint64_t>(h) * slots) >> 32);
+        }
+        
+        // A candidate transition.
+        struct Row {
+            index_t from;
+            index_t to;
+            // npos if none.
+            index_t guard;
+            index_t action;
+        };
+        
+        /**
+         * Builds a definition from a list of transitions.
+         *
+         * Identical guards and actions (same function pointer) share an index.
+         * With Layout_Auto, the dense table is used if it has at most 16384
+         * cells or 4 cells per run, then the rows layout if no state has more
+         * than 8 runs, then the hash. Layout_Rows is only used with less than
+         * 65536 classes.
+         */
+        static std::shared_ptr<const Definition> build(const std::vector<Trans> & transitions, Layout layout = Layout_Auto);
+        
+        /**
+         * Constructs a definition on a blob and binds its indexes. `blob` must
+         * be at least `Header::size` bytes long and stay valid for the lifetime
+         * of the definition.
+         */
+        Definition(std::shared_ptr<const char> blob,
+                   std::vector<State *> states,
+                   std::vector<Event *> triggers,
+                   std::vector<guardFn> guards,
+                   std::vector<actionFn> actions);
+        
+        const Header & header() const { return *m_header; }
+        const char * blob() const { return m_blob.get(); }
+        
+        index_t state_count() const { return m_header->states; }
+        index_t trigger_count() const { return m_header->triggers; }
+        index_t class_count() const { return m_header->classes; }
+        index_t row_count() const { return m_header->rows; }
+        Layout layout() const { return static_cast<Layout>(m_header->layout); }
+        
+        State * state(index_t i) const { return m_states[i]; }
+        Event * trigger(index_t i) const { return m_triggers[i]; }
+        const guardFn & guard(index_t i) const { return m_guards[i]; }
+        const actionFn & action(index_t i) const { return m_actions[i]; }
+        const Row & row(index_t i) const { return m_rows[i]; }
+        index_t class_of(index_t trigger) const { return m_classes[trigger]; }
+        // Index of Fsm_AnyState and class of Fsm_AnyTrigger, npos if the
+        // definition has no such transition.
+        index_t any_state() const { return m_any_state; }
+        index_t any_class() const { return m_any_class; }
+        // Class of Fsm_Completion, npos if there are no eventless transitions.
+        index_t completion_class() const { return m_completion_class; }
+        
+        // Returns the index of a state or trigger by its ID, npos if unknown.
+        index_t state_index(unsigned int state_id) const
+        {
+            const unsigned int i = state_id - m_state_base;
+            if(i < m_state_index.size()) return m_state_index[i];
+            if(not m_sparse_states.empty()) {
+                const index_t s = find_id(m_sparse_states, state_id);
+                if(s != npos) return s;
+            }
+            if(state_id == m_states[0]->getID()) return 0;
+            if(state_id == m_states[1]->getID()) return 1;
+            return npos;
+        }
+        index_t trigger_index(unsigned int event_id) const
+        {
+            const unsigned int i = event_id - m_trigger_base;
+            if(i < m_trigger_index.size()) return m_trigger_index[i];
+            return m_sparse_triggers.empty() ? npos : find_id(m_sparse_triggers, event_id);
+        }
+        // Returns the class of a trigger by its ID. Unknown triggers are in
+        // the class of Fsm_AnyTrigger, npos if there is none.
+        index_t class_by_id(unsigned int event_id) const
+        {
+            const unsigned int i = event_id - m_trigger_base;
+            if(i < m_class_by_id.size()) return m_class_by_id[i];
+            const index_t t = m_sparse_triggers.empty() ? npos : find_id(m_sparse_triggers, event_id);
+            return t == npos ? m_any_class : m_classes[t];
+        }
+        
+        // Sets [first, last) to the candidate rows of a state for a class.
+        void candidates(index_t state, index_t cls, index_t & first, index_t & last) const
+        {
+            if(m_cells) {
+                const index_t * cell = m_cells + state * m_header->classes + cls;
+                first = cell[0];
+                last = cell[1];
+                return;
+            }
+            if(m_slots) {
+                const uint64_t hash = hash_key(state, cls);
+                const uint32_t displacement = m_displacements[hash_bucket(hash, m_header->buckets)];
+                const HashSlot & slot = m_slots[hash_slot(hash, displacement, m_header->slots)];
+                const bool found = slot.state == state && slot.cls == cls;
+                first = found ? slot.first : 0;
+                last = found ? slot.last : 0;
+                return;
+            }
+            // Most states have few runs: scan all of them without branching on
+            // the class, which the walk of the machine makes unpredictable.
+            // Longer runs are matched 32 at a time with match_classes().
+            const index_t begin = m_state_runs[state];
+            const index_t end = m_state_runs[state + 1];
+            index_t found = end;
+            if(end - begin <= 8) {
+                for(index_t i = begin; i < end; i++) {
+                    found = (m_run_classes[i] == cls) ? i : found;
+                }
+            } else {
+                for(index_t i = begin; i < end; i += 32) {
+                    const index_t count = end - i < 32 ? end - i : 32;
+                    const uint32_t mask = match_classes(m_run_classes + i, count, static_cast<run_class_t>(cls));
+                    if(mask) {
+                        found = i + lowest_bit(mask);
+                        break;
+                    }
+                }
+            }
+            if(found == end) {
+                first = last = 0;
+                return;
+            }
+            first = m_run_rows[found];
+            last = m_run_rows[found + 1];
+        }
+        
+        // Sets [first, last) to the rows tried when none of the candidates of
+        // a state for a class is taken: the rows on any trigger. Empty for the
+        // class of Fsm_AnyTrigger and for the eventless transitions.
+        void fallbacks(index_t state, index_t cls, index_t & first, index_t & last) const
+        {
+            if(m_any_class == npos || cls == m_any_class || cls == m_completion_class) {
+                first = last = 0;
+                return;
+            }
+            candidates(state, m_any_class, first, last);
+        }
+        
+        // Returns the names of a state, trigger, guard or action, nullptr if the
+        // blob has no name table.
+        const char * state_name(index_t i) const { return name(i); }
+        const char * trigger_name(index_t i) const { return name(m_header->states + i); }
+        const char * guard_name(index_t i) const { return name(m_header->states + m_header->triggers + i); }
+        const char * action_name(index_t i) const { return name(m_header->states + m_header->triggers + m_header->guards + i); }
+        
+    private:
+        static matchFn select_match_classes();
+        // Returns the index of an ID in sorted (ID, index) pairs, npos if
+        // it is not there.
+        static index_t find_id(const std::vector<std::pair<unsigned int, index_t> > & ids, unsigned int id)
+        {
+            auto it = std::lower_bound(ids.begin(), ids.end(), std::make_pair(id, index_t(0)));
+            return it != ids.end() && it->first == id ? it->second : npos;
+        }
+        // Index of the lowest set bit of a non-zero mask.
+        static index_t lowest_bit(uint32_t mask)
+        {
+#if defined(__GNUC__) || defined(__clang__)
+            return static_cast<index_t>(__builtin_ctz(mask));
+#else
+            index_t i = 0;
+            while((mask & 1u) == 0) {
+                mask >>= 1;
+                i++;
+            }
+            return i;
+#endif
+        }
+        const char * name(index_t i) const;
+        // Builds the hash table of Layout_Hash from the runs.
+        static void build_hash(const std::vector<index_t> & state_runs,
+                               const std::vector<index_t> & run_rows,
+                               const std::vector<index_t> & run_classes,
+                               std::vector<uint32_t> & displacements,
+                               std::vector<HashSlot> & slots);
+        
+        std::shared_ptr<const char> m_blob;
+        const Header * m_header;
+        const index_t * m_classes;
+        // nullptr in Layout_Rows.
+        const index_t * m_cells;
+        const index_t * m_state_runs;
+        const index_t * m_run_rows;
+        const run_class_t * m_run_classes;
+        // nullptr except in Layout_Hash.
+        const uint32_t * m_displacements;
+        const HashSlot * m_slots;
+        const Row * m_rows;
+        std::vector<State *> m_states;
+        std::vector<Event *> m_triggers;
+        std::vector<guardFn> m_guards;
+        std::vector<actionFn> m_actions;
+        index_t m_any_state;
+        index_t m_any_class;
+        index_t m_completion_class;
+        // Lookup tables by ID, starting at the lowest ID of the definition
+        // (IDs are global, but those of a machine are usually close).
+        // Fsm_AnyState, Fsm_AnyTrigger and Fsm_Completion are not in the
+        // tables, the other pseudo states only if their IDs fall in them.
+        unsigned int m_state_base;
+        unsigned int m_trigger_base;
+        std::vector<index_t> m_state_index;
+        std::vector<index_t> m_trigger_index;
+        std::vector<index_t> m_class_by_id;
+        // Instead of the tables when the IDs are spread: sorted (ID, index)
+        // pairs.
+        std::vector<std::pair<unsigned int, index_t> > m_sparse_states;
+        std::vector<std::pair<unsigned int, index_t> > m_sparse_triggers;
+    };
+    
+    /**
+     * States of the machines that a new definition does not have.
+     */
+    struct StateMapping {
+        // 'tor
+        StateMapping() : states(), fallback(nullptr) {}
+        
+        // New state, by ID of the old state.
+        std::map<unsigned int, State *> states;
+        // New state of the machines in other missing states, nullptr to
+        // leave them there.
+        State * fallback;
+    };
+    
+    /**
+     * The current definition of a group of machines, which can be replaced
+     * while they run (see "Updating a definition").
+     */
+    class DefinitionSlot : public std::enable_shared_from_this<DefinitionSlot> {
+    public:
+        // 'tor
+        explicit DefinitionSlot(std::shared_ptr<const Definition> def);
+        
+        DefinitionSlot(const DefinitionSlot &) = delete;
+        DefinitionSlot & operator=(const DefinitionSlot &) = delete;
+        
+        // The current definition. Can briefly lock (see "Updating a
+        // definition"): the machines call it only when the epoch changes.
+        std::shared_ptr<const Definition> load() const { return std::atomic_load(&m_version)->def; }
+        
+        // Number of definitions published since the construction.
+        uint64_t epoch() const { return m_epoch.load(std::memory_order_acquire); }
+        
+        /**
+         * Replaces the definition, with the mapping of the states it does not
+         * have. Returns the new epoch.
+         */
+        uint64_t publish(std::shared_ptr<const Definition> def, std::shared_ptr<const StateMapping> mapping = nullptr);
+        
+        /**
+         * Publishes a definition with the transitions of the current one and
+         * `transitions`, and its state mapping. Returns the new epoch.
+         */
+        uint64_t add_transitions(const std::vector<Trans> & transitions, Definition::Layout layout = Definition::Layout_Auto);
+        
+        /**
+         * Does the same as add_transitions() on `executor`, a new thread if
+         * nullptr, then calls `done` with the new epoch. The slot must be
+         * owned by a shared_ptr.
+         */
+        void add_transitions_async(std::vector<Trans> transitions,
+                                   std::function<void(uint64_t)> done = nullptr,
+                                   executorFn executor = nullptr);
+        
+    private:
+        // A published definition. Replaced as a whole, so that a machine
+        // gets a definition and its mapping together.
+        struct Version {
+            std::shared_ptr<const Definition> def;
+            std::shared_ptr<const StateMapping> mapping;
+        };
+        
+        std::shared_ptr<const Version> version() const { return std::atomic_load(&m_version); }
+        // Stores the version, then increments the epoch.
+        uint64_t store(std::shared_ptr<const Definition> def, std::shared_ptr<const StateMapping> mapping);
+        
+        std::shared_ptr<const Version> m_version;
+        std::atomic<uint64_t> m_epoch;
+        std::mutex m_writer;
+        friend class Fsm;
     };
     
     /**
@@ -253,16 +1119,349 @@ namespace FSM {
     class Fsm {
         
         // Definitions for the structure that holds the transitions.
-        // For good performance on state machines with many transitions, transitions
-        // are stored for each `from_state`:
-        //   map<from_state, vector<Trans> >
-        using transition_elem_t = std::vector<Trans>;
-        using transitions_t = std::map<int, transition_elem_t>;
+        // For good performance on state machines with many transitions, the
+        // transitions are kept in one array, sorted by `from_state` ID and in
+        // insertion order for each state. add_transitions() appends to the
+        // array, the new transitions are sorted in by the next execute().
+        // The transitions from Fsm_Initial come first, up to m_initial_end,
+        // then those from Fsm_Final, up to m_final_end. For the other states,
+        // m_offsets[id - m_offsets_base] is the first transition of the state
+        // with this ID, the next entry is the end, so that the table only
+        // covers the IDs of the states of the machine. If these IDs are
+        // spread, m_offset_ids has the sorted IDs of the states instead, and
+        // m_offsets the first transition of each. The transitions from
+        // Fsm_AnyState are sorted last, from m_any_first.
+        using transitions_t = std::vector<Trans>;
         transitions_t m_transitions;
+        size_t m_sorted;
+        uint32_t m_initial_end;
+        uint32_t m_final_end;
+        unsigned int m_offsets_base;
+        std::vector<uint32_t> m_offsets;
+        std::vector<unsigned int> m_offset_ids;
+        uint32_t m_any_first;
+        // Whether a transition is from Fsm_AnyState or on Fsm_AnyTrigger.
+        bool m_wildcards;
+        // Whether a transition is eventless, and whether the last dispatch
+        // entered a state.
+        bool m_completions;
+        bool m_entered;
+        unsigned int m_max_completion_steps;
+        // Frozen definition, nullptr if the machine is not frozen.
+        std::shared_ptr<const Definition> m_def;
         // Current state.
         State * m_cs;
+        // Index of the current state in m_def.
+        Definition::index_t m_csi;
         bool m_initialized;
         debugFn m_debug_fn;
+        journalFn m_journal_fn;
+        // Triggers deferred by each state, by state ID.
+        std::map<unsigned int, std::shared_ptr<const TriggerSet> > m_deferrals;
+        // Ring buffer of the deferred events.
+        Event * m_deferred[8];
+        uint8_t m_deferred_first;
+        uint8_t m_deferred_count;
+        bool m_recalling;
+        
+        // Asynchronous action begun by the running action, nullptr if none.
+        // m_transitioning is set while the machine waits for it, and the
+        // triggers executed meanwhile are queued in m_async_queue.
+        std::shared_ptr<AsyncToken::Operation> m_async;
+        bool m_transitioning;
+        std::deque<Event *> m_async_queue;
+        executorFn m_executor;
+        // The machine whose action is running on this thread.
+        static thread_local Fsm * s_running;
+        friend class AsyncToken;
+        friend class Activity;
+        
+        // Invokes a transition action, with the machine as s_running.
+        // Takes a copy of the action: it can add transitions to the machine,
+        // which frees the storage of the transition it comes from.
+        void invoke_action(actionFn action, Event * trigger)
+        {
+            struct Running {
+                Fsm * outer;
+                ~Running() { s_running = outer; }
+            } running = { s_running };
+            s_running = this;
+            action(trigger);
+        }
+        
+        // Called after the exit function when the action began an
+        // asynchronous action. Returns false if it is already done, so that
+        // the transition goes on, and otherwise makes the machine wait for it.
+        bool suspend(State * from_state, State * to_state, Event * trigger);
+        
+        // Finishes the transition once the asynchronous action is done, then
+        // executes the queued triggers.
+        void resume(const std::shared_ptr<AsyncToken::Operation> & op);
+        
+        // Drops the pending asynchronous action.
+        void cancel_async();
+        
+        // Do-activity of the current state, nullptr if none.
+        std::shared_ptr<Activity::Operation> m_activity;
+        executorFn m_activity_executor;
+        // Count of the do-activities that have not returned, shared with
+        // their tasks. Created by the first activity.
+        struct Activities;
+        std::shared_ptr<Activities> m_activities;
+        
+        // Starts the do-activity of the state entered.
+        void start_activity(State * state);
+        // Cancels the running do-activity.
+        void cancel_activity();
+        
+        // Triggers of the byte values, and the byte table compiled from the
+        // frozen definition: m_byte_table[state * 256 + byte] is the index of
+        // the state reached, with byte_marked set if the transition must be
+        // executed as by execute() (see "Byte streams"). Cleared by unfreeze().
+        static const uint32_t byte_marked = 0x80000000u;
+        std::vector<Event *> m_byte_triggers;
+        std::vector<uint32_t> m_byte_table;
+        
+        // Compiles m_byte_table.
+        void build_byte_table();
+        
+        // Queues a trigger that found no transition if the current state
+        // defers it.
+        Fsm_Errors defer(Event * trigger);
+        
+        // Executes the deferred events that the current state does not defer.
+        void recall(bool with_actions);
+        
+        // Takes the eventless transitions after a state was entered.
+        Fsm_Errors complete(bool with_actions);
+        
+        // Groups of states with a history (see "History").
+        // m_history_index[id - m_history_base] is, for a state of a group,
+        // the slot of the group, and for a history pseudo state, the slot of
+        // the group it resumes with history_bit set. npos for other states.
+        static const uint32_t history_bit = 0x80000000u;
+        unsigned int m_history_base;
+        std::vector<uint32_t> m_history_index;
+        // Default state and last entered state of each group.
+        std::vector<State *> m_history_defaults;
+        std::vector<State *> m_history_slots;
+        
+        // Sets the entry of a state in m_history_index.
+        void index_history(State * state, uint32_t entry);
+        
+        // Returns the state a transition to `to_state` enters: the last state
+        // of the group if `to_state` is a history pseudo state. Records the
+        // state in the slot of its group.
+        State * enter_history(State * to_state)
+        {
+            const unsigned int i = to_state->getID() - m_history_base;
+            if(i >= m_history_index.size()) {
+                return to_state;
+            }
+            uint32_t entry = m_history_index[i];
+            if(entry != Definition::npos && (entry & history_bit)) {
+                entry &= ~history_bit;
+                State * last = m_history_slots[entry];
+                return last ? last : (m_history_slots[entry] = m_history_defaults[entry]);
+            }
+            if(entry != Definition::npos) {
+                m_history_slots[entry] = to_state;
+            }
+            return to_state;
+        }
+        
+        // Drops the frozen definition. The transitions are copied back from the
+        // definition to m_transitions first.
+        void unfreeze();
+        
+        // Makes `def` the frozen definition, and drops the transitions.
+        void adopt(std::shared_ptr<const Definition> def);
+        
+        // Slot followed by the machine, nullptr if none, and the epoch of
+        // m_def in it.
+        std::shared_ptr<DefinitionSlot> m_slot;
+        uint64_t m_epoch;
+        
+        // Whether a definition was published that the machine can take now.
+        bool slot_changed() const
+        {
+            return m_slot && m_slot->epoch() != m_epoch && s_running != this;
+        }
+        
+        // Takes the current definition of m_slot.
+        void update_definition();
+        
+        // Sorts the transitions added since the last call, and rebuilds
+        // m_offsets.
+        void sort_transitions();
+        
+        // Sets [first, last) to the transitions from a state. Returns false if
+        // the state has none.
+        bool transitions_of(State * state, uint32_t & first, uint32_t & last) const
+        {
+            if(state == Fsm_Initial || state == Fsm_Final) {
+                first = state == Fsm_Initial ? 0 : m_initial_end;
+                last = state == Fsm_Initial ? m_initial_end : m_final_end;
+                return first != last;
+            }
+            if(not m_offset_ids.empty()) {
+                auto it = std::lower_bound(m_offset_ids.begin(), m_offset_ids.end(), state->getID());
+                if(it == m_offset_ids.end() || *it != state->getID()) {
+                    return false;
+                }
+                first = m_offsets[it - m_offset_ids.begin()];
+                last = m_offsets[it - m_offset_ids.begin() + 1];
+                return true;
+            }
+            const unsigned int i = state->getID() - m_offsets_base;
+            if(m_offsets.empty() || i >= m_offsets.size() - 1) {
+                return false;
+            }
+            first = m_offsets[i];
+            last = m_offsets[i + 1];
+            return first != last;
+        }
+        
+        // Takes the first transition of [first, last) on the trigger (on
+        // Fsm_AnyTrigger if `any`) whose guard is true. Sets `matched` if a
+        // transition is on the trigger, returns whether one was taken.
+        template<bool any>
+        bool take_transition(uint32_t first, uint32_t last, Event * trigger, bool with_actions, bool & matched)
+        {
+            for(uint32_t t = first; t != last; ++t) {
+                const Trans & transition = m_transitions[t];
+                
+                // Check if trigger matches.
+                if(any ? transition.trigger != Fsm_AnyTrigger : not transition.has_trigger(trigger->getID())) continue;
+                matched = true;
+                
+                // Check if guard exists and returns true.
+                if(transition.guard && (not transition.guard())) continue;
+                
+                // Now we have to take the action and set the new state.
+                // Then we are done. The action may add transitions, which
+                // invalidates `transition` (invoke_action() runs a copy).
+                State * from_state = m_cs;
+                State * to_state = transition.to_state;
+                if(not m_history_slots.empty()) {
+                    to_state = enter_history(to_state);
+                }
+                
+                m_entered = true;
+                if(not with_actions) {
+                    m_cs = to_state;
+                    return true;
+                }
+                
+                // Check if action exists and execute it.
+                if(transition.action != 0) {
+                    invoke_action(transition.action, trigger); //execute action
+                }
+                
+                if(m_activity) {
+                    cancel_activity();
+                }
+                from_state->invokeExitFunction();
+                if(m_async && suspend(from_state, to_state, trigger)) {
+                    return true;
+                }
+                m_cs = to_state;
+                to_state->invokeEnterFunction();
+                if(to_state->hasDoActivity()) {
+                    start_activity(to_state);
+                }
+                
+                if(m_debug_fn) {
+                    m_debug_fn(from_state, to_state, trigger);
+                }
+                return true;
+            }
+            return false;
+        }
+        
+        // Sets the current state and its index in the frozen definition.
+        void set_state(State * state)
+        {
+            m_cs = state;
+            if(m_def) {
+                m_csi = m_def->state_index(state->getID());
+            }
+        }
+        
+        // Execute a trigger of the class `cls` with the frozen definition.
+        Fsm_Errors execute_frozen(Event * trigger, Definition::index_t cls, bool with_actions)
+        {
+            // An action that adds transitions unfreezes the machine: the
+            // definition is kept until the transition is done.
+            const std::shared_ptr<const Definition> frozen = m_def;
+            const Definition & def = *frozen;
+            if(cls == Definition::npos || m_csi == Definition::npos) {
+                return Fsm_NoMatchingTrigger;
+            }
+            
+            Definition::index_t first, last, any_first, any_last;
+            def.candidates(m_csi, cls, first, last);
+            def.fallbacks(m_csi, cls, any_first, any_last);
+            if(first == last && any_first == any_last) {
+                return Fsm_NoMatchingTrigger;
+            }
+            
+            for(Definition::index_t r = first; ; ++r) {
+                if(r == last) {
+                    // Then the rows on any trigger, once.
+                    if(any_first == any_last) break;
+                    r = any_first;
+                    last = any_last;
+                    any_first = any_last;
+                }
+                const Definition::Row & row = def.row(r);
+                
+                // Check if guard exists and returns true.
+                if(row.guard != Definition::npos && (not def.guard(row.guard)())) continue;
+                
+                State * from_state = m_cs;
+                State * to_state = def.state(row.to);
+                Definition::index_t to = row.to;
+                if(not m_history_slots.empty()) {
+                    State * target = enter_history(to_state);
+                    if(target != to_state) {
+                        to_state = target;
+                        to = def.state_index(target->getID());
+                    }
+                }
+                m_entered = true;
+                if(not with_actions) {
+                    m_cs = to_state;
+                    m_csi = to;
+                    break;
+                }
+                
+                if(row.action != Definition::npos) {
+                    invoke_action(def.action(row.action), trigger);
+                }
+                
+                if(m_activity) {
+                    cancel_activity();
+                }
+                from_state->invokeExitFunction();
+                if(m_async && suspend(from_state, to_state, trigger)) {
+                    break;
+                }
+                m_cs = to_state;
+                m_csi = to;
+                to_state->invokeEnterFunction();
+                if(to_state->hasDoActivity()) {
+                    start_activity(to_state);
+                }
+                
+                if(m_debug_fn) {
+                    m_debug_fn(from_state, to_state, trigger);
+                }
+                break;
+            }
+            
+            return Fsm_Success;
+        }
         
     public:
         
@@ -271,10 +1470,23 @@ namespace FSM {
          */
         static State * Fsm_Initial;
         static State * Fsm_Final;
+        /**
+         * Wildcards, only valid as the `from_state` and `trigger` of a
+         * transition (see "Wildcards").
+         */
+        static State * Fsm_AnyState;
+        static Event * Fsm_AnyTrigger;
+        /**
+         * Trigger of the eventless transitions (see "Eventless transitions").
+         */
+        static Event * Fsm_Completion;
         
         // Constructor.
-        Fsm() : m_transitions(), m_cs(0), m_initialized(false), m_debug_fn(nullptr) {atexit(dealocateFSMStatic);}
+        Fsm() : m_transitions(), m_sorted(0), m_initial_end(0), m_final_end(0), m_offsets_base(0), m_offsets(), m_offset_ids(), m_any_first(0), m_wildcards(false), m_completions(false), m_entered(false), m_max_completion_steps(64), m_def(), m_cs(0), m_csi(Definition::npos), m_initialized(false), m_debug_fn(nullptr), m_journal_fn(nullptr), m_deferrals(), m_deferred_first(0), m_deferred_count(0), m_recalling(false), m_async(), m_transitioning(false), m_async_queue(), m_executor(nullptr), m_activity(), m_activity_executor(nullptr), m_activities(), m_byte_triggers(), m_byte_table(), m_history_base(0), m_history_index(), m_history_defaults(), m_history_slots(), m_slot(), m_epoch(0) {atexit(dealocateFSMStatic);}
         Fsm(const Fsm & orig);
+        ~Fsm();
+        // Constructs a machine that executes a frozen definition.
+        explicit Fsm(std::shared_ptr<const Definition> def) : m_transitions(), m_sorted(0), m_initial_end(0), m_final_end(0), m_offsets_base(0), m_offsets(), m_offset_ids(), m_any_first(0), m_wildcards(false), m_completions(def && def->completion_class() != Definition::npos), m_entered(false), m_max_completion_steps(64), m_def(def), m_cs(0), m_csi(Definition::npos), m_initialized(false), m_debug_fn(nullptr), m_journal_fn(nullptr), m_deferrals(), m_deferred_first(0), m_deferred_count(0), m_recalling(false), m_async(), m_transitioning(false), m_async_queue(), m_executor(nullptr), m_activity(), m_activity_executor(nullptr), m_activities(), m_byte_triggers(), m_byte_table(), m_history_base(0), m_history_index(), m_history_defaults(), m_history_slots(), m_slot(), m_epoch(0) {atexit(dealocateFSMStatic);}
         /**
          * Initializes the FSM.
          *
@@ -283,8 +1495,11 @@ namespace FSM {
          */
         void init()
         {
+            if(m_journal_fn) {
+                m_journal_fn(Journal_Init, nullptr);
+            }
             if(!m_initialized) {
-                m_cs = Fsm_Initial;
+                set_state(Fsm_Initial);
                 m_initialized = true;
             }
         }
@@ -297,23 +1512,45 @@ namespace FSM {
          */
         void reset()
         {
-            m_cs = Fsm_Initial;
+            if(m_journal_fn) {
+                m_journal_fn(Journal_Reset, nullptr);
+            }
+            set_state(Fsm_Initial);
             m_initialized = false;
+            m_deferred_count = 0;
+            if(m_async) {
+                cancel_async();
+            }
+            if(m_activity) {
+                cancel_activity();
+            }
+            std::fill(m_history_slots.begin(), m_history_slots.end(), nullptr);
         }
         
         /**
          * Add a set of transition definitions to the state machine.
          *
          * This function can be called multiple times at any time. Added
-         * transitions cannot be removed from the machine.
+         * transitions cannot be removed from the machine. Adding transitions
+         * to a frozen machine unfreezes it, call freeze() again afterwards. A
+         * machine that follows a DefinitionSlot stops following it.
          */
         template<typename InputIt>
         void add_transitions(InputIt start, InputIt end)
         {
-            InputIt it = start;
-            for(; it != end; ++it) {
-                // Add element in the transition table
-                m_transitions[(*it).from_state->getID()].push_back(*it);
+            if(m_def) {
+                m_slot.reset();
+                unfreeze();
+            }
+            // Add the elements to the transition table, they are sorted in
+            // lazily.
+            const size_t first = m_transitions.size();
+            m_transitions.insert(m_transitions.end(), start, end);
+            for(size_t t = first; t < m_transitions.size(); t++) {
+                Trans & transition = m_transitions[t];
+                if(transition.trigger == nullptr && not transition.triggers) {
+                    transition.trigger = Fsm_Completion;
+                }
             }
         }
         
@@ -352,6 +1589,126 @@ namespace FSM {
             add_transitions(std::begin(i), std::end(i));
         }
         
+        /**
+         * Compiles the transitions into a frozen definition, which is then used
+         * by execute(). See FSM::Definition.
+         *
+         * The definition can be retrieved with definition() and shared with
+         * other instances. Has no effect if the machine is already frozen.
+         */
+        void freeze(Definition::Layout layout = Definition::Layout_Auto);
+        
+        /**
+         * Makes the machine run the definition of `slot`, and take the
+         * definitions published to it (see "Updating a definition"). nullptr
+         * stops following; the machine keeps its current definition.
+         */
+        void set_definition_slot(std::shared_ptr<DefinitionSlot> slot);
+        
+        /**
+         * Sets the triggers deferred by a state (see "Deferred triggers"),
+         * nullptr to defer none. A transition from the state on the trigger
+         * takes precedence over the deferral.
+         */
+        void add_deferrals(State * state, std::shared_ptr<const TriggerSet> triggers)
+        {
+            if(triggers) {
+                m_deferrals[state->getID()] = triggers;
+            } else {
+                m_deferrals.erase(state->getID());
+            }
+        }
+        
+        /**
+         * Groups states, and makes `history` the history pseudo state of the
+         * group (see "History"). A transition to `history` enters the state of
+         * the group entered last, `initial` if there is none. A state can be
+         * in one group only.
+         */
+        void add_history(State * history, const std::vector<State *> & states, State * initial);
+        
+        /**
+         * Returns the IDs of the last entered state of each group, in the
+         * order of add_history(). For the groups that were not entered yet,
+         * this is the ID of the initial state, which they resume the same.
+         */
+        std::vector<unsigned int> history() const;
+        
+        /**
+         * Restores the last entered states returned by history(). An empty
+         * list clears them. Returns Fsm_UnknownId if the list does not match
+         * the groups.
+         */
+        Fsm_Errors restore_history(const std::vector<unsigned int> & state_ids);
+        
+        /**
+         * Sets the maximum number of eventless transitions taken in a row by
+         * execute() (64 by default). The next one, if any, is taken and
+         * execute() returns Fsm_CompletionLimit.
+         */
+        void set_max_completion_steps(unsigned int steps)
+        {
+            m_max_completion_steps = steps;
+        }
+        
+        /**
+         * Begins an asynchronous action (see "Asynchronous actions"). Must be
+         * called from a transition action; the transition is finished when
+         * the returned token is completed.
+         */
+        static AsyncToken begin_async();
+        
+        /**
+         * Sets the executor that finishes the transitions after their
+         * asynchronous action, nullptr to finish them inside
+         * AsyncToken::complete() (which must then be called on the thread
+         * that owns the machine).
+         */
+        void set_executor(executorFn fn)
+        {
+            m_executor = fn;
+        }
+        
+        /**
+         * Sets the executor that runs the do-activities, nullptr to run each
+         * on a new thread.
+         */
+        void set_activity_executor(executorFn fn)
+        {
+            m_activity_executor = fn;
+        }
+        
+        /**
+         * Executes the events posted by the do-activity of the current state,
+         * when the machine has no executor. Returns their number.
+         */
+        size_t run_posted();
+        
+        /**
+         * Waits until the do-activities started by the machine have returned.
+         * The activity of the current state, if any, must have been cancelled
+         * (by reset(), say), and the tasks of the activity executor must run.
+         */
+        void wait_activities();
+        
+        /**
+         * Returns whether the machine waits for an asynchronous action.
+         */
+        bool is_transitioning() const { return m_transitioning; }
+        
+        // Capacity of the queue of deferred events.
+        static const size_t deferred_capacity = sizeof(m_deferred) / sizeof(m_deferred[0]);
+        
+        /**
+         * Returns the number of deferred events waiting in the queue.
+         */
+        size_t deferred_count() const { return m_deferred_count; }
+        
+        /**
+         * Returns the frozen definition, nullptr if the machine is not frozen.
+         */
+        std::shared_ptr<const Definition> definition() const { return m_def; }
+        
         /**
          * Adds a function that is called on every state change. The type of the
          * function is `debugFn`. It has the following parameters.
@@ -369,6 +1726,19 @@ namespace FSM {
             m_debug_fn = fn;
         }
         
+        /**
+         * Adds a function that is called with every trigger delivered to
+         * execute(), and on every init() and reset(), before the machine acts
+         * on it (write-ahead). The type of the function is `journalFn`.
+         *
+         * It is meant to be used with FSM::Journal (see fsm_journal.h), but any
+         * function can be passed. In order to disable it, pass `nullptr`.
+         */
+        void add_journal_fn(journalFn fn)
+        {
+            m_journal_fn = fn;
+        }
+        
         /**
          * Execute the given trigger according to the semantics defined for this
          * state machine.
@@ -376,50 +1746,193 @@ namespace FSM {
          * Returns the status of the execute operation. Fsm_Success is 0.
          */
         Fsm_Errors execute(Event * trigger)
+        {
+            if(m_journal_fn) {
+                m_journal_fn(Journal_Event, trigger);
+            }
+            return replay(trigger, true);
+        }
+        
+        /**
+         * Execute an event of the `kind` trigger, with a payload.
+         *
+         * The event is built on the stack and refers to `payload`, which is not
+         * copied.
+         */
+        template<typename T>
+        Fsm_Errors execute(TypedEvent<T> & kind, const T & payload)
+        {
+            TypedEvent<T> trigger(kind, payload);
+            return execute(&trigger);
+        }
+        
+        /**
+         * Maps the byte values to the triggers executed by execute_bytes()
+         * (see "Byte streams"), nullptr for the bytes that change nothing.
+         * `triggers` has 256 entries. Freezes the machine.
+         */
+        void set_byte_triggers(const std::vector<Event *> & triggers);
+        
+        /**
+         * Executes the triggers of `count` bytes. Bytes that do not trigger a
+         * transition are ignored, as by execute().
+         *
+         * Returns Fsm_Unsupported if set_byte_triggers() was not called, and
+         * Fsm_Success otherwise.
+         */
+        Fsm_Errors execute_bytes(const uint8_t * bytes, size_t count);
+        
+        /**
+         * Execute the given trigger without passing it to the journal function.
+         *
+         * This is used to replay a journal. If `with_actions` is false, only the
+         * current state is updated: transition actions, enter and exit functions
+         * and the debug function are not invoked.
+         */
+        Fsm_Errors replay(Event * trigger, bool with_actions)
         {
             if(not m_initialized) {
                 return Fsm_NotInitialized;
             }
+            if(m_transitioning) {
+                m_async_queue.push_back(trigger);
+                return Fsm_Transitioning;
+            }
+            if(slot_changed()) {
+                update_definition();
+            }
+            m_entered = false;
+            Fsm_Errors err_code = dispatch(trigger, with_actions);
+            const bool entered = m_entered;
+            if(m_completions && m_entered) {
+                const Fsm_Errors completion = complete(with_actions);
+                if(completion != Fsm_Success) err_code = completion;
+            }
+            if(m_deferrals.empty() && m_deferred_count == 0) {
+                return err_code;
+            }
+            if(err_code == Fsm_NoMatchingTrigger) {
+                return defer(trigger);
+            }
+            // The deferred events are recalled when a state is entered: in
+            // the same state, they would only be deferred again.
+            if(entered && m_deferred_count != 0 && not m_transitioning) {
+                recall(with_actions);
+            }
+            return err_code;
+        }
+        
+    private:
+        
+        // Executes a trigger on an initialized machine.
+        Fsm_Errors dispatch(Event * trigger, bool with_actions)
+        {
+            if(m_def) {
+                return execute_frozen(trigger, m_def->class_by_id(trigger->getID()), with_actions);
+            }
             
-            Fsm_Errors err_code = Fsm_NoMatchingTrigger;
-            
-            const auto state_transitions = m_transitions.find(m_cs->getID());
-            if(state_transitions == m_transitions.end()) {
-                return err_code; // No transition from current state found.
+            if(m_sorted != m_transitions.size()) {
+                sort_transitions();
+            }
+            bool matched = false;
+            uint32_t first = 0, last = 0;
+            const bool own = transitions_of(m_cs, first, last);
+            if(own && take_transition<false>(first, last, trigger, with_actions, matched)) {
+                return Fsm_Success;
             }
             
-            // iterate the transitions
-            const transition_elem_t& active_transitions = state_transitions->second;
-            for(auto& transition : active_transitions) {
-                
-                // Check if trigger matches.
-                if(trigger->getID() != (transition.trigger)->getID()) continue;
-                err_code = Fsm_Success;
-                
-                // Check if guard exists and returns true.
-                if(transition.guard && (not transition.guard())) continue;
-                
-                // Now we have to take the action and set the new state.
-                // Then we are done.
-                
-                // Check if action exists and execute it.
-                if(transition.action != 0) {
-                    transition.action(trigger); //execute action
-                }
-                
-                transition.from_state->invokeExitFunction();
-                m_cs = transition.to_state;
-                transition.to_state->invokeEnterFunction();
-                
-                if(m_debug_fn) {
-                    m_debug_fn(transition.from_state, transition.to_state, trigger);
+            // Fallbacks, in the order described in "Wildcards". The eventless
+            // transitions have no fallback on any trigger.
+            if(m_wildcards) {
+                const bool any_state = m_any_first != m_transitions.size() && m_cs != Fsm_Initial && m_cs != Fsm_Final;
+                const bool any_trigger = trigger != Fsm_Completion;
+                const uint32_t end = static_cast<uint32_t>(m_transitions.size());
+                if((any_state && take_transition<false>(m_any_first, end, trigger, with_actions, matched)) ||
+                   (any_trigger && own && take_transition<true>(first, last, trigger, with_actions, matched)) ||
+                   (any_trigger && any_state && take_transition<true>(m_any_first, end, trigger, with_actions, matched))) {
+                    return Fsm_Success;
                 }
-                break;
             }
             
-            return err_code;
+            return matched ? Fsm_Success : Fsm_NoMatchingTrigger;
         }
         
+    public:
+        
+        /**
+         * Sets the current state and the initialized flag without invoking any
+         * function, e.g. to restore an instance from a snapshot.
+         *
+         * Returns Fsm_UnknownId if no transition of this machine references
+         * the state.
+         */
+        Fsm_Errors restore(unsigned int state_id, bool initialized)
+        {
+            State * state = find_state(state_id);
+            if(state == nullptr) {
+                return Fsm_UnknownId;
+            }
+            set_state(state);
+            m_initialized = initialized;
+            return Fsm_Success;
+        }
+        
+        /**
+         * Drops the deferred triggers and the asynchronous transition in
+         * progress, with the triggers it queued, without invoking any
+         * function, e.g. before restoring an instance from a snapshot.
+         */
+        void discard_pending()
+        {
+            m_deferred_count = 0;
+            if(m_async) {
+                cancel_async();
+            }
+        }
+        
+        /**
+         * Returns the state with the given ID if a transition of this machine
+         * references it, nullptr otherwise.
+         */
+        State * find_state(unsigned int state_id) const
+        {
+            if(state_id == Fsm_Initial->getID()) return Fsm_Initial;
+            if(state_id == Fsm_Final->getID()) return Fsm_Final;
+            if(m_def) {
+                const Definition::index_t i = m_def->state_index(state_id);
+                if(i != Definition::npos) return m_def->state(i);
+            }
+            for(auto& transition : m_transitions) {
+                if(transition.from_state->getID() == state_id) return transition.from_state;
+                if(transition.to_state->getID() == state_id) return transition.to_state;
+            }
+            return nullptr;
+        }
+        
+        /**
+         * Returns the trigger with the given ID if a transition of this machine
+         * references it, nullptr otherwise.
+         */
+        Event * find_event(unsigned int event_id) const
+        {
+            if(m_def) {
+                const Definition::index_t i = m_def->trigger_index(event_id);
+                if(i != Definition::npos) return m_def->trigger(i);
+            }
+            for(auto& transition : m_transitions) {
+                if(not transition.has_trigger(event_id)) continue;
+                if(not transition.triggers) return transition.trigger;
+                for(Event * trigger : transition.triggers->triggers()) {
+                    if(trigger->getID() == event_id) return trigger;
+                }
+            }
+            return nullptr;
+        }
+        
+        /**
+         * Returns whether init() has been called since the last reset().
+         */
+        bool is_initialized() const { return m_initialized; }
         /**
          * Returns the current state;
          */
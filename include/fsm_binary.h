@@ -0,0 +1,143 @@
+#ifndef FSM_BINARY_H
+#define FSM_BINARY_H
+
+/**
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2015 Eric Halère
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * \file fsm_binary.h
+ *
+ * Precompiled definitions
+ * =======================
+ *
+ * A frozen `FSM::Definition` can be saved to a binary file, and loaded back by
+ * mapping the file into memory. The tables of the definition are used in
+ * place, without being copied: loading reads them once, to check that every
+ * index stays inside its table, so it is linear in their size. Only the
+ * names of the states, triggers, guards and actions are bound to the objects
+ * of the process through a `FSM::Registry`.
+ *
+ * Guards and actions are identified by name. To be saved, a guard or action
+ * must be a function pointer registered with the registry, or the function
+ * returned by `Registry::add_guard()` or `Registry::add_action()`.
+ *
+ * ~~~
+ * FSM::Registry registry;
+ * registry.add_state("Idle", idle);
+ * registry.add_event("Start", start);
+ * FSM::guardFn ready = registry.add_guard("ready", []{ return true; });
+ * fsm.add_transitions({ { FSM::Fsm::Fsm_Initial, idle, start, ready, nullptr } });
+ * fsm.freeze();
+ * FSM::save_definition(*fsm.definition(), registry, "machine.fsmdef");
+ *
+ * // In another process, with the same names registered.
+ * std::shared_ptr<const FSM::Definition> def;
+ * FSM::load_definition("machine.fsmdef", registry, def);
+ * FSM::Fsm fsm(def);
+ * ~~~
+ *
+ * The pseudo states are always bound to the names "Fsm_Initial" and
+ * "Fsm_Final", the wildcards to "Fsm_AnyState" and "Fsm_AnyTrigger", and the
+ * trigger of the eventless transitions to "Fsm_Completion". The file is not
+ * portable between machines of different endianness.
+ */
+
+// Includes
+#include <map>
+#include <string>
+#include <vector>
+#include "fsm.h"
+
+namespace FSM {
+
+    /**
+     * Name tables binding states, events, guards and actions to names.
+     */
+    class Registry {
+    public:
+        // 'tor
+        Registry();
+
+        // Bind a state or event to a name.
+        void add_state(const std::string & name, State * state);
+        void add_event(const std::string & name, Event * event);
+        // Bind a guard or action to a name. The returned function must be used
+        // in the transitions, unless `fn` is a function pointer.
+        guardFn add_guard(const std::string & name, guardFn fn);
+        actionFn add_action(const std::string & name, actionFn fn);
+
+        // Returns the object bound to a name, nullptr if none.
+        State * state(const std::string & name) const;
+        Event * event(const std::string & name) const;
+        guardFn guard(const std::string & name) const;
+        actionFn action(const std::string & name) const;
+
+        // Returns the name of an object, an empty string if it has none.
+        std::string state_name(State * state) const;
+        std::string event_name(Event * event) const;
+        std::string guard_name(const guardFn & fn) const;
+        std::string action_name(const actionFn & fn) const;
+
+    private:
+        // Function objects returned by add_guard() and add_action(). They
+        // carry their name, so that they can be identified.
+        struct NamedGuard {
+            std::string name;
+            guardFn fn;
+            bool operator()() const { return fn(); }
+        };
+        struct NamedAction {
+            std::string name;
+            actionFn fn;
+            void operator()(Event * evt) const { fn(evt); }
+        };
+
+        std::map<std::string, State *> m_states;
+        std::map<std::string, Event *> m_events;
+        std::map<std::string, guardFn> m_guards;
+        std::map<std::string, actionFn> m_actions;
+        std::map<unsigned int, std::string> m_state_names;
+        std::map<unsigned int, std::string> m_event_names;
+        std::map<bool (*)(), std::string> m_guard_ptrs;
+        std::map<void (*)(Event *), std::string> m_action_ptrs;
+    };
+
+    /**
+     * Saves a definition to a file, with the names from the registry.
+     *
+     * Returns Fsm_UnknownId if an object of the definition has no name, and
+     * Fsm_IOError if the file cannot be written.
+     */
+    Fsm_Errors save_definition(const Definition & def, const Registry & registry, const std::string & path);
+
+    /**
+     * Maps a definition file into memory, checks its tables and binds its
+     * names with the registry.
+     *
+     * Returns Fsm_UnknownId if a name is not bound in the registry, and
+     * Fsm_IOError if the file cannot be read or is not a valid definition.
+     */
+    Fsm_Errors load_definition(const std::string & path, const Registry & registry, std::shared_ptr<const Definition> & def);
+
+} // end namespace FSM
+
+#endif // FSM_BINARY_H
@@ -0,0 +1,124 @@
+#ifndef FSM_COROUTINE_H
+#define FSM_COROUTINE_H
+
+/**
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2015 Eric Halère
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * \file fsm_coroutine.h
+ *
+ * Coroutine actions
+ * =================
+ *
+ * With C++20, a transition action can be a coroutine that returns
+ * `FSM::AsyncAction` and awaits its I/O. `coroutine_action()` adapts it to an
+ * `actionFn`: the coroutine is started by the transition, and the machine is
+ * transitioning until it returns (see "Asynchronous actions" in fsm.h).
+ *
+ * ~~~
+ * fsm.add_transitions({
+ *   { idle, sent, send, nullptr, FSM::coroutine_action([&](FSM::Event * e) -> FSM::AsyncAction {
+ *       co_await socket.write(e);
+ *   }) },
+ * });
+ * ~~~
+ *
+ * The coroutine is resumed by whatever completes its awaitables; the rest of
+ * the transition then runs on the executor of the machine. An exception that
+ * escapes the coroutine terminates the program.
+ *
+ * The captures of a lambda coroutine live in its closure, not in the
+ * coroutine frame: coroutine_action() keeps the closure alive until the
+ * coroutine returns, even if the machine drops the action meanwhile (e.g.
+ * add_transitions() or a new definition). The trigger given to the coroutine
+ * must stay valid until it returns too.
+ */
+
+#if !defined(__cpp_impl_coroutine)
+#error "fsm_coroutine.h requires C++20 coroutines"
+#endif
+
+// Includes
+#include <coroutine>
+#include <exception>
+#include <memory>
+#include <utility>
+#include "fsm.h"
+
+namespace FSM {
+    
+    /**
+     * Return type of a coroutine used as a transition action.
+     */
+    class AsyncAction {
+        public :
+        struct promise_type {
+            AsyncToken token;
+            // Keeps the closure of the coroutine alive, see coroutine_action().
+            std::shared_ptr<const void> owner;
+            
+            AsyncAction get_return_object() { return AsyncAction(std::coroutine_handle<promise_type>::from_promise(*this)); }
+            // Started by coroutine_action(), once the token is set.
+            std::suspend_always initial_suspend() noexcept { return {}; }
+            // The frame is destroyed when the coroutine returns.
+            std::suspend_never final_suspend() noexcept { return {}; }
+            void return_void() { token.complete(); }
+            void unhandled_exception() { std::terminate(); }
+        };
+        
+        AsyncAction(AsyncAction && other) noexcept : m_handle(std::exchange(other.m_handle, nullptr)) {}
+        AsyncAction & operator=(AsyncAction &&) = delete;
+        ~AsyncAction()
+        {
+            if(m_handle) m_handle.destroy();
+        }
+        
+        // Runs the coroutine until its first suspension, it then owns its
+        // frame, and `owner` until it returns.
+        void start(AsyncToken token, std::shared_ptr<const void> owner = nullptr)
+        {
+            std::coroutine_handle<promise_type> handle = std::exchange(m_handle, nullptr);
+            handle.promise().token = token;
+            handle.promise().owner = std::move(owner);
+            handle.resume();
+        }
+        
+    private:
+        explicit AsyncAction(std::coroutine_handle<promise_type> handle) : m_handle(handle) {}
+        std::coroutine_handle<promise_type> m_handle;
+    };
+    
+    // Adapts a coroutine `AsyncAction fn(Event *)` to an actionFn. Each
+    // running coroutine shares the ownership of `fn`.
+    template<typename Fn>
+    actionFn coroutine_action(Fn fn)
+    {
+        std::shared_ptr<Fn> shared = std::make_shared<Fn>(std::move(fn));
+        return [shared](Event * trigger) {
+            AsyncToken token = Fsm::begin_async();
+            (*shared)(trigger).start(token, shared);
+        };
+    }
+    
+} // end namespace FSM
+
+#endif // FSM_COROUTINE_H
@@ -0,0 +1,113 @@
+#ifndef FSM_DSL_H
+#define FSM_DSL_H
+
+/**
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2015 Eric Halère
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * \file fsm_dsl.h
+ *
+ * Text definitions
+ * ================
+ *
+ * A simple text format to describe a state machine, so that it can be kept
+ * outside of the code (e.g. in a configuration file) or compiled into C++ by
+ * tools/fsm_codegen.
+ *
+ * ~~~
+ * # The turnstile.
+ * machine Turnstile
+ * states Locked Unlocked
+ * events Coin Push
+ *
+ * # from      -> to          on event [guard]  / action
+ * Fsm_Initial -> Locked      on Push
+ * Locked      -> Unlocked    on Coin  [paid]   / unlock
+ * Unlocked    -> Locked      on Push           / lock
+ * ~~~
+ *
+ * - `#` starts a comment, blank lines are ignored.
+ * - `machine` gives the name of the machine (optional).
+ * - `states` and `events` declare names, and can be repeated. The pseudo
+ *   states `Fsm_Initial` and `Fsm_Final` are always declared.
+ * - Each other line is a transition. The guard and the action are optional,
+ *   transitions are evaluated in the order of the file.
+ *
+ * All names must be C++ identifiers.
+ */
+
+// Includes
+#include <string>
+#include <vector>
+#include "fsm.h"
+#include "fsm_binary.h"
+
+namespace FSM {
+
+    /**
+     * A parsed text definition. Everything is kept by name.
+     */
+    struct Description {
+        struct Transition {
+            std::string from_state;
+            std::string to_state;
+            std::string trigger;
+            // empty if none.
+            std::string guard;
+            std::string action;
+            // line in the text, for error messages.
+            unsigned int line;
+        };
+
+        std::string name;
+        std::vector<std::string> states;
+        std::vector<std::string> events;
+        std::vector<Transition> transitions;
+        // Guards and actions, in order of first use.
+        std::vector<std::string> guards;
+        std::vector<std::string> actions;
+    };
+
+    /**
+     * Parses a text definition.
+     *
+     * Returns Fsm_ParseError with a message in `error` if the text is not
+     * valid, or references undeclared states or events.
+     */
+    Fsm_Errors parse_description(const std::string & text, Description & description, std::string & error);
+
+    /**
+     * Reads and parses a text definition file.
+     */
+    Fsm_Errors load_description(const std::string & path, Description & description, std::string & error);
+
+    /**
+     * Binds a description with the objects of a registry, and appends the
+     * resulting transitions.
+     *
+     * Returns Fsm_UnknownId with a message in `error` if a name is not bound.
+     */
+    Fsm_Errors bind_description(const Description & description, const Registry & registry, std::vector<Trans> & transitions, std::string & error);
+
+} // end namespace FSM
+
+#endif // FSM_DSL_H
@@ -0,0 +1,138 @@
+#ifndef FSM_EVENTLOG_H
+#define FSM_EVENTLOG_H
+
+/**
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2015 Eric Halère
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * \file fsm_eventlog.h
+ *
+ * Event logs
+ * ==========
+ *
+ * An `FSM::EventLog` replays a capture of triggers, a binary file of
+ * fixed-width records, through one or many machines. Each record holds the
+ * ID of a trigger and, optionally, the instance number of the machine it is
+ * for, both as native `uint32_t` at offsets given by an `EventLogFormat`;
+ * the other bytes of a record are ignored.
+ *
+ * ~~~
+ * FSM::EventLog log;
+ * log.open("capture.bin", FSM::EventLogFormat(8, 4, 0));
+ * log.add_instance(0, &fsm0);
+ * log.add_instance(1, &fsm1);
+ * log.run();
+ * ~~~
+ *
+ * The file is mapped, not read, and the machines get the triggers themselves
+ * (found once per ID with Fsm::find_event()), so that replay allocates
+ * nothing per record. The mapping is advised as sequential (and for huge
+ * pages where the system supports it); the pages ahead are requested a window
+ * at a time and those of the window just consumed are dropped, so that a
+ * capture larger than the memory streams through. The records a few cache
+ * lines ahead are prefetched.
+ *
+ * Records without instance number go to instance 0. Records of an instance
+ * that was not added, or with a trigger that none of the machines has, are
+ * skipped. Instance numbers index a table, so they should be dense.
+ */
+
+// Includes
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <stdint.h>
+#include "fsm.h"
+
+namespace FSM {
+
+    // Layout of the records of an event log.
+    struct EventLogFormat {
+        static const uint32_t none = 0xFFFFFFFFu;
+
+        // 'tor. By default, records are a single trigger ID.
+        explicit EventLogFormat(uint32_t record_size = 4, uint32_t trigger_offset = 0, uint32_t instance_offset = none)
+            : record_size(record_size), trigger_offset(trigger_offset), instance_offset(instance_offset) {}
+
+        // Size of a record, in bytes.
+        uint32_t record_size;
+        // Offset of the trigger ID in a record.
+        uint32_t trigger_offset;
+        // Offset of the instance number, `none` if the records have none.
+        uint32_t instance_offset;
+    };
+
+    /**
+     * A memory-mapped event log, replayed through machines.
+     */
+    class EventLog {
+    public:
+        // 'tor
+        EventLog();
+        ~EventLog();
+
+        // Map the file. Returns Fsm_IOError if it cannot be mapped, or if the
+        // fields do not fit in a record. A trailing partial record is
+        // ignored.
+        Fsm_Errors open(const std::string & path, const EventLogFormat & format = EventLogFormat());
+        // Unmap the file.
+        void close();
+
+        // Associate an instance number of the log with a machine.
+        void add_instance(unsigned int instance, Fsm * fsm);
+
+        // Execute the records [first, last) on their machines.
+        Fsm_Errors run(size_t first = 0, size_t last = static_cast<size_t>(-1));
+
+        // Returns the number of records in the log.
+        size_t size() const { return m_count; }
+        // Returns the number of records executed and skipped by the last run.
+        size_t executed() const { return m_executed; }
+        size_t skipped() const { return m_skipped; }
+
+    private:
+        EventLog(const EventLog &);
+        EventLog & operator=(const EventLog &);
+
+        // Finds the trigger with an ID in the machines, once per ID.
+        Event * find_event(unsigned int id);
+        // Requests the window of pages from `offset`, and drops the pages
+        // of the previous window, from `consumed` to `offset`.
+        void advise(size_t consumed, size_t offset);
+
+        const char * m_data;
+        size_t m_size;
+        size_t m_count;
+        EventLogFormat m_format;
+        std::vector<Fsm *> m_instances;
+        // Triggers by ID, and whether the ID was looked up. Triggers with
+        // large IDs are kept in m_sparse.
+        std::vector<Event *> m_events;
+        std::vector<uint8_t> m_looked_up;
+        std::unordered_map<unsigned int, Event *> m_sparse;
+        size_t m_executed;
+        size_t m_skipped;
+    };
+
+} // end namespace FSM
+
+#endif // FSM_EVENTLOG_H
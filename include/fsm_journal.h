@@ -0,0 +1,185 @@
+#ifndef FSM_JOURNAL_H
+#define FSM_JOURNAL_H
+
+/**
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2015 Eric Halère
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * \file fsm_journal.h
+ *
+ * Event journal
+ * =============
+ *
+ * Write-ahead journal of the triggers delivered to state machines, and a
+ * replay engine that rebuilds the machines from it.
+ *
+ * The journal is an append-only file of records. Each record holds the kind
+ * of the record, the instance number given to `Journal::recorder()`, an ID
+ * (trigger ID for events, state ID for snapshots) and optional payload bytes
+ * produced by the encoder function. Records carry a checksum, so that a record
+ * torn by a crash at the end of the file is detected and ignored on replay.
+ *
+ * Records are batched in memory and written when `batch` records are pending,
+ * on `flush()` and on `close()`. The `Journal_Sync` policy defines when the
+ * file is synced to disk.
+ *
+ * ~~~
+ * FSM::Journal journal;
+ * journal.open("machines.journal", FSM::Journal_SyncOnFlush, 64);
+ * fsm.add_journal_fn(journal.recorder(1));
+ * fsm.init();
+ * fsm.execute(evt);
+ * journal.snapshot(1, fsm); // replay can start from here
+ * ~~~
+ *
+ * After a restart, the machines are defined again, and the journal is replayed.
+ *
+ * ~~~
+ * FSM::Replayer replayer;
+ * replayer.add_instance(1, &fsm);
+ * replayer.replay("machines.journal", false); // state only, no actions
+ * ~~~
+ *
+ * Trigger and state IDs are global counters (see fsm.h). They are stable
+ * between runs as long as the events and states are created in the same order.
+ */
+
+// Includes
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "fsm.h"
+
+namespace FSM {
+
+    // Defines the function prototype to encode the payload of a trigger.
+    // Parameters are: trigger, bytes to append the payload to.
+    using encodeFn = std::function<void(Event *,std::string &)>;
+    // Defines the function prototype to decode the payload of a trigger.
+    // Parameters are: trigger, payload, payload size. Returns the event passed
+    // to the machine, usually the trigger itself (or a copy of it) filled from
+    // the payload, as its ID must match the ID of the trigger.
+    using decodeFn = std::function<Event *(Event *,const char *,size_t)>;
+
+    // Defines when a journal file is synced to disk.
+    enum Journal_Sync {
+        // Never sync, leave it to the operating system.
+        Journal_SyncNever = 0,
+        // Sync every time a batch of records is written.
+        Journal_SyncOnFlush,
+        // Write and sync every record before the machine acts on it.
+        Journal_SyncEveryRecord,
+    };
+
+    /**
+     * An append-only journal file.
+     *
+     * A single journal can be shared by several machines, also from different
+     * threads.
+     */
+    class Journal {
+    public:
+        // 'tor
+        Journal();
+        ~Journal();
+
+        // Open (create or append to) the journal file. A torn record at the
+        // end of the file is truncated.
+        Fsm_Errors open(const std::string & path, Journal_Sync sync = Journal_SyncOnFlush, size_t batch = 64);
+        // Write pending records and close the file.
+        Fsm_Errors close();
+        // Write pending records (and sync according to the policy).
+        Fsm_Errors flush();
+
+        // set the payload encoder (set to nullptr to unset it)
+        void setEncoder(encodeFn iFn);
+
+        // Returns a function to pass to Fsm::add_journal_fn().
+        journalFn recorder(unsigned int instance);
+        // Record the current state and history slots of a machine. Returns
+        // Fsm_Deferred if the machine has deferred triggers and
+        // Fsm_Transitioning if it waits for an asynchronous action, as these
+        // are not recorded.
+        Fsm_Errors snapshot(unsigned int instance, const Fsm & fsm);
+
+    private:
+        Journal(const Journal &);
+        Journal & operator=(const Journal &);
+
+        void append(Fsm_JournalKind kind, unsigned int instance, unsigned int id, Event * trigger);
+        // Appends a record with m_payload, m_mutex must be held.
+        void append_record(Fsm_JournalKind kind, unsigned int instance, unsigned int id);
+        bool write_pending();
+
+        int m_fd;
+        Journal_Sync m_sync;
+        size_t m_batch;
+        size_t m_pending;
+        bool m_failed;
+        std::string m_buffer;
+        std::string m_payload;
+        encodeFn m_encoder;
+        std::mutex m_mutex;
+    };
+
+    /**
+     * Rebuilds machines from a journal.
+     *
+     * For each instance, replay starts at the last snapshot found in the
+     * journal (or at the beginning if there is none). Records of instances
+     * that have not been added are skipped.
+     */
+    class Replayer {
+    public:
+        // 'tor
+        Replayer();
+
+        // Associate an instance number of the journal with a machine.
+        void add_instance(unsigned int instance, Fsm * fsm);
+        // set the payload decoder (set to nullptr to unset it)
+        void setDecoder(decodeFn iFn);
+
+        // Replay the journal file. If `with_actions` is false, only the states
+        // are rebuilt (see Fsm::replay()).
+        Fsm_Errors replay(const std::string & path, bool with_actions = true);
+        // Returns the number of records applied by the last replay.
+        size_t replayed() const { return m_replayed; }
+
+    private:
+        struct Target {
+            Fsm * fsm;
+            // triggers of the machine, indexed by trigger ID
+            std::vector<Event *> events;
+            // offset of the last snapshot in the journal
+            size_t start;
+        };
+        Event * find_event(Target & target, unsigned int id);
+
+        std::map<unsigned int, Target> m_instances;
+        decodeFn m_decoder;
+        size_t m_replayed;
+    };
+
+} // end namespace FSM
+
+#endif // FSM_JOURNAL_H
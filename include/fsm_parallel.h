@@ -0,0 +1,124 @@
+#ifndef FSM_PARALLEL_H
+#define FSM_PARALLEL_H
+
+/**
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2015 Eric Halère
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * \file fsm_parallel.h
+ *
+ * Parallel runs
+ * =============
+ *
+ * A `ParallelRunner` executes a long stream of events on a frozen definition
+ * on several cores, e.g. to analyse a log offline. The stream is split into
+ * one chunk per thread. The first chunk is run from the start state; the
+ * others cannot know theirs, so each is run from every state reachable from
+ * the start state at once. The runs that reach the same state are merged as
+ * they go (most machines converge after a few events), and the chunk then
+ * costs one table lookup per event, like the first. The end state of each
+ * chunk gives the start state of the next, and the end state of the stream.
+ *
+ * ~~~
+ * FSM::ParallelRunner runner(fsm.definition());
+ * runner.run(fsm, events.data(), events.size());
+ * ~~~
+ *
+ * The states after each event can be recorded as well; the chunks are then
+ * run a second time, in parallel, from their actual start state.
+ *
+ * Only the transitions are taken: guards cannot be evaluated out of order, so
+ * definitions with guards are not supported, and actions, enter and exit
+ * functions are not called. Eventless transitions are followed (up to 64 in
+ * a row, as Fsm does by default). The history and deferred triggers of an
+ * instance are not used.
+ *
+ * The runner precomputes the state reached from each state on each class,
+ * `state_count() * class_count()` indexes.
+ */
+
+// Includes
+#include <memory>
+#include <vector>
+#include "fsm.h"
+
+namespace FSM {
+
+    /**
+     * Runs streams of events on a frozen definition, in chunks on several
+     * threads.
+     */
+    class ParallelRunner {
+    public:
+        using index_t = Definition::index_t;
+
+        // 'tor. `threads` is the number of chunks run in parallel, 0 for the
+        // number of cores.
+        explicit ParallelRunner(std::shared_ptr<const Definition> def, unsigned int threads = 0);
+
+        // Returns whether the definition can be run (it has no guard).
+        bool supported() const { return m_supported; }
+
+        // Sets the minimum number of events of a chunk (4096 by default).
+        void set_min_chunk(size_t events) { m_min_chunk = events ? events : 1; }
+
+        // Executes `count` events from the state `start`, and sets `end` to
+        // the state reached. If `states` is not nullptr, states[i] is set to
+        // the state after the event i. Returns Fsm_Unsupported if the
+        // definition has guards, Fsm_UnknownId if it has no state `start`.
+        Fsm_Errors run(Event * const * events, size_t count, State * start, State *& end, State ** states = nullptr) const;
+
+        // Executes `count` events on a machine frozen with the definition,
+        // and restores it to the state reached.
+        Fsm_Errors run(Fsm & fsm, Event * const * events, size_t count, State ** states = nullptr) const;
+
+    private:
+        struct Chunk;
+
+        // Column of an event in m_next.
+        index_t column(Event * event) const
+        {
+            const index_t cls = m_def->class_by_id(event->getID());
+            return cls == Definition::npos ? m_columns - 1 : cls;
+        }
+        // Runs a chunk from its start states.
+        void simulate(Chunk & chunk, Event * const * events) const;
+        // Runs a chunk from a single state, recording the states if `states`
+        // is not nullptr. Returns the end state.
+        index_t follow(index_t state, Event * const * events, size_t first, size_t last, State ** states) const;
+        // Returns the states reachable from `start`, `start` included.
+        std::vector<index_t> reachable(index_t start) const;
+
+        std::shared_ptr<const Definition> m_def;
+        unsigned int m_threads;
+        size_t m_min_chunk;
+        bool m_supported;
+        // m_next[state * m_columns + cls] is the state reached from `state` on
+        // a trigger of the class `cls`. The last column is for the triggers
+        // without a class, which change nothing.
+        index_t m_columns;
+        std::vector<index_t> m_next;
+    };
+
+} // end namespace FSM
+
+#endif // FSM_PARALLEL_H
@@ -0,0 +1,182 @@
+#ifndef FSM_POOL_H
+#define FSM_POOL_H
+
+/**
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2015 Eric Halère
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * \file fsm_pool.h
+ *
+ * Event pools
+ * ===========
+ *
+ * Events that carry a payload are often created for each call to execute().
+ * An `FSM::EventPool<T>` allocates them from an arena: slots are carved from
+ * chunks of `chunk_size` events by a pointer bump, and released slots are kept
+ * in a free list and reused. A pool belongs to one thread (the one that
+ * constructs it), so that creating an event takes no lock; each producer
+ * thread has its own pool.
+ *
+ * `T` derives from FSM::Event and has a constructor whose first parameter is
+ * the ID, passed to the protected `Event(unsigned int)` constructor.
+ *
+ * ~~~
+ * struct Coin : public FSM::Event {
+ *     Coin(unsigned int id, int cents) : FSM::Event(id), cents(cents) {}
+ *     int cents;
+ * };
+ *
+ * FSM::EventPool<Coin> coins;
+ * // Handled as the `coin` trigger of the transitions.
+ * Coin * c = coins.create_as(coin, 50);
+ * fsm.execute(c);
+ * coins.release(c);
+ * ~~~
+ *
+ * Events created by create_as() take the ID of an existing trigger. Events
+ * created by create() take the ID of their slot: IDs are reserved for a whole
+ * chunk at once, and are reused with the slot, so the global counter does
+ * not grow with the number of events created.
+ *
+ * release() can be called from any thread. Events released by another thread
+ * are pushed on a lock-free list, which the owner takes back when its own
+ * free list is empty.
+ *
+ * Events still alive when the pool is destroyed are not destructed.
+ */
+
+// Includes
+#include <atomic>
+#include <memory>
+#include <new>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "fsm.h"
+
+namespace FSM {
+
+    template<typename T>
+    class EventPool {
+        static_assert(std::is_base_of<Event, T>::value, "T must derive from FSM::Event");
+
+        // The event is at the start of the slot, so that a T * is also a Slot *.
+        struct Slot {
+            union {
+                typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+                // next free slot, when the slot is free.
+                Slot * next;
+            };
+            // ID taken by create().
+            unsigned int id;
+        };
+
+        const size_t m_chunk_size;
+        std::vector<std::unique_ptr<Slot[]> > m_chunks;
+        // Bump allocation in the last chunk.
+        Slot * m_bump;
+        Slot * m_end;
+        unsigned int m_next_id;
+        // Slots released by the owner thread.
+        Slot * m_free;
+        // Slots released by other threads.
+        std::atomic<Slot *> m_remote;
+        const std::thread::id m_owner;
+
+        Slot * acquire()
+        {
+            if(m_free == nullptr) {
+                m_free = m_remote.exchange(nullptr, std::memory_order_acquire);
+            }
+            if(m_free != nullptr) {
+                Slot * slot = m_free;
+                m_free = slot->next;
+                return slot;
+            }
+            if(m_bump == m_end) {
+                m_chunks.push_back(std::unique_ptr<Slot[]>(new Slot[m_chunk_size]));
+                m_bump = m_chunks.back().get();
+                m_end = m_bump + m_chunk_size;
+                m_next_id = Event::reserveIDs(static_cast<unsigned int>(m_chunk_size));
+            }
+            Slot * slot = m_bump++;
+            slot->id = m_next_id++;
+            return slot;
+        }
+
+    public:
+
+        explicit EventPool(size_t chunk_size = 256) : m_chunk_size(chunk_size), m_chunks(), m_bump(nullptr), m_end(nullptr), m_next_id(0), m_free(nullptr), m_remote(nullptr), m_owner(std::this_thread::get_id())
+        {
+            assert(chunk_size > 0);
+        }
+
+        EventPool(const EventPool &) = delete;
+        EventPool & operator=(const EventPool &) = delete;
+
+        /**
+         * Creates an event with a new ID. Must be called by the owner thread.
+         */
+        template<typename... Args>
+        T * create(Args &&... args)
+        {
+            assert(std::this_thread::get_id() == m_owner);
+            Slot * slot = acquire();
+            return new (&slot->storage) T(slot->id, std::forward<Args>(args)...);
+        }
+
+        /**
+         * Creates an event with the ID of `kind`, so that the machines handle
+         * it as the trigger `kind`. Must be called by the owner thread.
+         */
+        template<typename... Args>
+        T * create_as(Event * kind, Args &&... args)
+        {
+            assert(std::this_thread::get_id() == m_owner);
+            Slot * slot = acquire();
+            return new (&slot->storage) T(kind->getID(), std::forward<Args>(args)...);
+        }
+
+        /**
+         * Destructs an event of this pool and makes its slot available.
+         */
+        void release(T * event)
+        {
+            event->~T();
+            Slot * slot = reinterpret_cast<Slot *>(event);
+            if(std::this_thread::get_id() == m_owner) {
+                slot->next = m_free;
+                m_free = slot;
+                return;
+            }
+            slot->next = m_remote.load(std::memory_order_relaxed);
+            while(not m_remote.compare_exchange_weak(slot->next, slot, std::memory_order_release, std::memory_order_relaxed)) {}
+        }
+
+        // Number of slots allocated so far.
+        size_t capacity() const { return m_chunks.size() * m_chunk_size; }
+    };
+
+} // end namespace FSM
+
+#endif // FSM_POOL_H
@@ -0,0 +1,256 @@
+#ifndef FSM_PRODUCT_H
+#define FSM_PRODUCT_H
+
+/**
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2015 Eric Halère
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * \file fsm_product.h
+ *
+ * Product machines
+ * ================
+ *
+ * Several machines that watch the same stream of events (one per pattern to
+ * detect, say) can be combined into a single machine, whose states stand for
+ * a state of each component. One dispatch per event then replaces one per
+ * component.
+ *
+ * ~~~
+ * std::shared_ptr<const FSM::Product> product;
+ * FSM::Product::build({ pattern1.definition(), pattern2.definition() }, product);
+ * FSM::Fsm fsm(product->definition());
+ * fsm.init();
+ * fsm.execute(evt);
+ * FSM::State * state = product->component_state(fsm.state(), 1);
+ * ~~~
+ *
+ * The components are frozen definitions without guards. The product states
+ * reachable from the initial states of the components are enumerated, up to a
+ * maximum. A trigger takes a transition in each component that has one (the
+ * others stay in their state), and the transition of the product calls their
+ * actions, in the order of the components. Eventless transitions of the
+ * components are taken as part of the transition that enters their state.
+ * The enter and exit functions of the component states are not called.
+ *
+ * A component in a terminal state (a state without transition) is not looked
+ * at any more: its state is carried over by all the transitions of the
+ * product. The product is in its initial state when all components are in
+ * theirs, and in its final state when all components are in their final
+ * state.
+ *
+ * The states of the product are owned by the `Product`, which must outlive
+ * the machines that use its definition.
+ *
+ * Lazy products
+ * -------------
+ *
+ * The number of product states can grow with the product of the numbers of
+ * component states, while a stream of events usually visits few of them. A
+ * `LazyProduct` runs the product without enumerating it: the product state
+ * that a trigger leads to is computed when the transition is first taken,
+ * and kept in a cache of `capacity` states, so that the next dispatches of
+ * the same trigger from the same state are a table lookup.
+ *
+ * ~~~
+ * std::unique_ptr<FSM::LazyProduct> lazy;
+ * FSM::LazyProduct::build({ pattern1.definition(), pattern2.definition() }, lazy, 1024);
+ * lazy->execute(evt);
+ * FSM::State * state = lazy->component_state(1);
+ * ~~~
+ *
+ * When the cache is full, `Cache_Flush` empties it (only the current state
+ * is kept), and `Cache_Evict` drops a state that was not visited recently
+ * (the clock approximation of least recently used). The transitions are the
+ * same as those of `Product`; the actions must not call execute() on the
+ * same lazy product.
+ */
+
+// Includes
+#include <map>
+#include <memory>
+#include <vector>
+#include "fsm.h"
+
+namespace FSM {
+
+    /**
+     * The product of several definitions.
+     */
+    class Product {
+    public:
+        using index_t = Definition::index_t;
+
+        /**
+         * Builds the product of guard-free definitions. Returns Fsm_Unsupported
+         * if there is no component or a component has a guard, Fsm_StateLimit
+         * if the product has more than `max_states` states.
+         */
+        static Fsm_Errors build(const std::vector<std::shared_ptr<const Definition> > & components,
+                                std::shared_ptr<const Product> & product,
+                                size_t max_states = 65536);
+
+        // The definition of the product machine.
+        std::shared_ptr<const Definition> definition() const { return m_def; }
+
+        size_t component_count() const { return m_components.size(); }
+        size_t state_count() const { return m_states.size(); }
+
+        // Returns the state of the component `k` when the product is in
+        // `state`, nullptr if `state` is not a state of the product.
+        State * component_state(State * state, size_t k) const;
+
+    private:
+        Product() : m_components(), m_tuples(), m_states(), m_owned(), m_base(0), m_tuple_of(), m_final(Definition::npos), m_def() {}
+
+        std::vector<std::shared_ptr<const Definition> > m_components;
+        // m_tuples[p * component_count() + k] is the index of the state of
+        // the component `k` in the product state `p`. The product state 0 is
+        // the initial state.
+        std::vector<index_t> m_tuples;
+        std::vector<State *> m_states;
+        std::vector<std::unique_ptr<State> > m_owned;
+        // m_tuple_of[id - m_base] is the product state of an owned state.
+        unsigned int m_base;
+        std::vector<index_t> m_tuple_of;
+        // The product state that is Fsm_Final, npos if none.
+        index_t m_final;
+        std::shared_ptr<const Definition> m_def;
+    };
+
+    /**
+     * The product of several definitions, computed as it runs.
+     */
+    class LazyProduct {
+    public:
+        using index_t = Definition::index_t;
+
+        enum Policy {
+            Cache_Flush,
+            Cache_Evict
+        };
+
+        /**
+         * Prepares the product of guard-free definitions, in the initial
+         * state. Returns Fsm_Unsupported if there is no component or a
+         * component has a guard. `capacity` is the number of product states
+         * kept in the cache, at least 2.
+         */
+        static Fsm_Errors build(const std::vector<std::shared_ptr<const Definition> > & components,
+                                std::unique_ptr<LazyProduct> & product,
+                                size_t capacity = 4096,
+                                Policy policy = Cache_Flush);
+
+        /**
+         * Takes the transition of each component on `trigger`, and calls
+         * their actions. Returns Fsm_NoMatchingTrigger if no component has
+         * a transition on it.
+         */
+        Fsm_Errors execute(Event * trigger)
+        {
+            assert(trigger != nullptr);
+            const unsigned int id = trigger->getID() - m_trigger_base;
+            const index_t g = id < m_group_of.size() ? m_group_of[id] : m_other;
+            if(g == Definition::npos) {
+                return Fsm_NoMatchingTrigger;
+            }
+            const size_t cell = static_cast<size_t>(m_current) * m_group_count + g;
+            index_t to = m_edges[cell].to;
+            if(to == Definition::npos || m_edges[cell].generation != m_generation[to]) {
+                to = expand(g);
+            }
+            // expand() can move the current state.
+            const Edge & edge = m_edges[static_cast<size_t>(m_current) * m_group_count + g];
+            m_current = to;
+            m_referenced[to] = true;
+            if(edge.action) {
+                edge.action(trigger);
+            }
+            return edge.matched ? Fsm_Success : Fsm_NoMatchingTrigger;
+        }
+
+        // Goes back to the initial state of all components.
+        void reset();
+
+        size_t component_count() const { return m_components.size(); }
+
+        // The current state of the component `k`.
+        State * component_state(size_t k) const;
+
+        // Whether all components are in their final state.
+        bool is_final() const;
+
+        // Number of product states in the cache.
+        size_t cached_states() const { return m_index.size(); }
+        // Number of transitions computed so far.
+        size_t misses() const { return m_misses; }
+        // Number of times the cache was emptied (Cache_Flush), or of states
+        // dropped from it (Cache_Evict).
+        size_t flushes() const { return m_flushes; }
+        size_t evictions() const { return m_evictions; }
+
+    private:
+        struct Tables;
+
+        // A transition of a cached state. It is valid if `to` is still the
+        // product state it was computed for.
+        struct Edge {
+            index_t to;
+            uint32_t generation;
+            bool matched;
+            actionFn action;
+        };
+
+        LazyProduct() : m_components(), m_tables(), m_capacity(0), m_policy(Cache_Flush), m_trigger_base(0), m_group_of(), m_other(Definition::npos), m_group_count(0), m_tuples(), m_edges(), m_generation(), m_referenced(), m_index(), m_used(0), m_hand(0), m_current(0), m_misses(0), m_flushes(0), m_evictions(0) {}
+
+        index_t expand(index_t group);
+        index_t insert(const std::vector<index_t> & tuple);
+        index_t allocate();
+
+        std::vector<std::shared_ptr<const Definition> > m_components;
+        std::shared_ptr<const Tables> m_tables;
+        size_t m_capacity;
+        Policy m_policy;
+        // m_group_of[id - m_trigger_base] is the group of a trigger, m_other
+        // that of the triggers of no component.
+        unsigned int m_trigger_base;
+        std::vector<index_t> m_group_of;
+        index_t m_other;
+        index_t m_group_count;
+        // By cache slot: the state of each component, the transition of
+        // each group, the generation (incremented when the slot is reused)
+        // and whether the slot was visited since the clock hand passed.
+        std::vector<index_t> m_tuples;
+        std::vector<Edge> m_edges;
+        std::vector<uint32_t> m_generation;
+        std::vector<bool> m_referenced;
+        std::map<std::vector<index_t>, index_t> m_index;
+        index_t m_used;
+        index_t m_hand;
+        index_t m_current;
+        size_t m_misses;
+        size_t m_flushes;
+        size_t m_evictions;
+    };
+
+} // end namespace FSM
+
+#endif // FSM_PRODUCT_H
@@ -0,0 +1,145 @@
+#ifndef FSM_RELOAD_H
+#define FSM_RELOAD_H
+
+/**
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2015 Eric Halère
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * \file fsm_reload.h
+ *
+ * Hot reload
+ * ==========
+ *
+ * An `FSM::DefinitionLoader` keeps the definition of a group of machines in
+ * sync with a text definition file (see fsm_dsl.h). Each time the file is
+ * written, it is parsed, bound with a registry and frozen on a background
+ * thread, and the new definition is published to a DefinitionSlot, which
+ * the machines take at their next execute() (see "Updating a definition"
+ * in fsm.h).
+ *
+ * ~~~
+ * FSM::DefinitionLoader loader("routing.fsm", registry);
+ * loader.map_state("Waiting", "Queued");    // renamed in the file
+ * loader.reload();
+ * fsm.set_definition_slot(loader.slot());
+ * loader.start();
+ * ~~~
+ *
+ * A file that does not parse, names objects that the registry does not
+ * bind, has no transition from Fsm_Initial, or lacks a state that
+ * map_state() or set_fallback_state() moves machines to is not published: the
+ * machines keep the previous definition, and the report function, if any,
+ * gets the error. The definitions are published with a state mapping built
+ * from map_state() and set_fallback_state(), for the machines whose state
+ * was renamed or removed.
+ *
+ * The file is watched with inotify, through its directory, so that editors
+ * that replace the file rather than write it are seen too. Where inotify is
+ * not available, start() returns Fsm_Unsupported and reload() must be
+ * called explicitly. The registry must outlive the loader.
+ */
+
+// Includes
+#include <atomic>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include "fsm.h"
+#include "fsm_binary.h"
+
+namespace FSM {
+
+    // Defines the function prototype for the report of a reload.
+    // Parameters are: result, error message (empty on success)
+    using reportFn = std::function<void(Fsm_Errors, const std::string &)>;
+
+    /**
+     * Publishes the definition of a text file, and its new versions.
+     */
+    class DefinitionLoader {
+    public:
+        // 'tor. Without slot, one is created by the first successful reload.
+        DefinitionLoader(const std::string & path, const Registry & registry, std::shared_ptr<DefinitionSlot> slot = nullptr);
+        ~DefinitionLoader();
+
+        // Moves the machines in the state named `from`, when the new
+        // definition does not have it, to the state named `to`.
+        void map_state(const std::string & from, const std::string & to);
+        // State of the machines in other missing states, an empty name to
+        // leave them there.
+        void set_fallback_state(const std::string & name);
+        // Function called with the result of each reload.
+        void set_report_fn(reportFn fn);
+
+        /**
+         * Parses, binds and freezes the file, and publishes the definition.
+         * Returns Fsm_IOError or Fsm_ParseError if the file cannot be read or
+         * parsed, Fsm_UnknownId if a name is not bound, and Fsm_Unsupported
+         * if it has no transition from Fsm_Initial.
+         */
+        Fsm_Errors reload();
+
+        /**
+         * Reloads the file on a background thread each time it is written.
+         * Returns Fsm_IOError if it cannot be watched.
+         */
+        Fsm_Errors start();
+        // Stops watching the file.
+        void stop();
+
+        // The slot of the definitions, nullptr until the first reload.
+        std::shared_ptr<DefinitionSlot> slot() const;
+        // Numbers of definitions published, and of failed reloads.
+        size_t reloads() const { return m_reloads.load(); }
+        size_t failures() const { return m_failures.load(); }
+
+    private:
+        DefinitionLoader(const DefinitionLoader &);
+        DefinitionLoader & operator=(const DefinitionLoader &);
+
+        // Builds the definition of the file.
+        Fsm_Errors build(std::shared_ptr<const Definition> & def, std::shared_ptr<const StateMapping> & mapping, std::string & error);
+        // Body of the watcher thread.
+        void watch();
+
+        const std::string m_path;
+        const Registry & m_registry;
+        // Held by reload(), and by the setters.
+        mutable std::mutex m_mutex;
+        std::shared_ptr<DefinitionSlot> m_slot;
+        std::map<std::string, std::string> m_renamed;
+        std::string m_fallback;
+        reportFn m_report_fn;
+        std::atomic<size_t> m_reloads;
+        std::atomic<size_t> m_failures;
+        // inotify descriptor, and pipe that wakes the watcher up to stop it.
+        int m_inotify;
+        int m_wake[2];
+        std::thread m_watcher;
+    };
+
+} // end namespace FSM
+
+#endif // FSM_RELOAD_H
@@ -29,37 +29,74 @@
 
 #include "../include/fsm.h"
 #include "stdlib.h"
+#include "string.h"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FSM_MATCH_X86 1
+#endif
 
 
 // static assignement
 
-unsigned int FSM::Event::__current_id = 0;
+std::atomic<unsigned int> FSM::Event::__current_id(0);
 unsigned int FSM::State::__current_id = 0;
 
 FSM::State * FSM::Fsm::Fsm_Initial = new FSM::State;
 FSM::State * FSM::Fsm::Fsm_Final = new FSM::State;
+FSM::State * FSM::Fsm::Fsm_AnyState = new FSM::State;
+FSM::Event * FSM::Fsm::Fsm_AnyTrigger = new FSM::Event;
+FSM::Event * FSM::Fsm::Fsm_Completion = new FSM::Event;
+thread_local FSM::Fsm * FSM::Fsm::s_running = nullptr;
+
+namespace {
+
+    // Whether a table by ID is kept for `count` objects whose IDs cover
+    // `span` values. The IDs of a machine are usually close, but objects
+    // created in between by the rest of the process spread them: the
+    // objects are then found in a sorted index.
+    bool dense_ids(uint64_t span, size_t count) {
+        return span <= 4 * static_cast<uint64_t>(count) + 64;
+    }
+
+} // end anonymous namespace
 
 void FSM::dealocateFSMStatic() {
     delete FSM::Fsm::Fsm_Initial;
     FSM::Fsm::Fsm_Initial = nullptr;
     delete FSM::Fsm::Fsm_Final;
     FSM::Fsm::Fsm_Final = nullptr;
+    delete FSM::Fsm::Fsm_AnyState;
+    FSM::Fsm::Fsm_AnyState = nullptr;
+    delete FSM::Fsm::Fsm_AnyTrigger;
+    FSM::Fsm::Fsm_AnyTrigger = nullptr;
+    delete FSM::Fsm::Fsm_Completion;
+    FSM::Fsm::Fsm_Completion = nullptr;
 }
 
 // Event class methods implementation
 
-FSM::Event::Event() : m_id(__current_id) {
-    __current_id++;
-    assert(std::numeric_limits<unsigned int>::max() != __current_id);
+FSM::Event::Event() : m_id(__current_id.fetch_add(1)) {
+    assert(std::numeric_limits<unsigned int>::max() != m_id + 1);
 };
 
 unsigned int FSM::Event::getID() {
     return m_id;
 };
 
+unsigned int FSM::Event::reserveIDs(unsigned int count) {
+    unsigned int first = __current_id.fetch_add(count);
+    assert(std::numeric_limits<unsigned int>::max() - count > first);
+    return first;
+}
+
 // State Class implementation
 
-FSM::State::State() : m_id(__current_id), m_enterFn(nullptr), m_exitFn(nullptr) {
+FSM::State::State() : m_id(__current_id), m_enterFn(nullptr), m_exitFn(nullptr), m_doFn(nullptr) {
     __current_id++;
     assert((std::numeric_limits<unsigned int>::max() -2 ) != __current_id);
 };
@@ -84,3 +121,1124 @@ void FSM::State::invokeExitFunction() {
     if (m_exitFn) m_exitFn();
 };
 
+void FSM::State::setDoActivity(activityFn iFn) {
+    m_doFn = iFn;
+};
+
+void FSM::State::invokeDoActivity(const Activity & activity) {
+    if (m_doFn) m_doFn(activity);
+};
+
+
+// Definition class implementation
+
+const char FSM::Definition::magic[8] = { 'F', 'S', 'M', 'D', 'E', 'F', '\0', '\0' };
+const uint32_t FSM::Definition::version;
+const FSM::Definition::index_t FSM::Definition::npos;
+
+void FSM::Definition::build_hash(const std::vector<index_t> & state_runs,
+                                 const std::vector<index_t> & run_rows,
+                                 const std::vector<index_t> & run_classes,
+                                 std::vector<uint32_t> & displacements,
+                                 std::vector<HashSlot> & slots) {
+    struct Key {
+        uint64_t hash;
+        index_t run;
+        index_t state;
+    };
+    std::vector<Key> keys;
+    for(index_t s = 0; s + 1 < state_runs.size(); s++) {
+        for(index_t run = state_runs[s]; run < state_runs[s + 1]; run++) {
+            Key key = { hash_key(s, run_classes[run]), run, s };
+            keys.push_back(key);
+        }
+    }
+    
+    // One slot per key if possible, two keys per bucket on average (with
+    // more, the last large buckets rarely fit in a nearly full table). If a
+    // bucket cannot be placed, retry with more slots.
+    const HashSlot empty = { npos, npos, 0, 0 };
+    uint32_t nslots = static_cast<uint32_t>(std::max<size_t>(keys.size(), 1));
+    const uint32_t nbuckets = static_cast<uint32_t>(std::max<size_t>(keys.size() / 2, 1));
+    std::vector<std::vector<const Key *> > buckets(nbuckets);
+    for(auto& key : keys) {
+        buckets[hash_bucket(key.hash, nbuckets)].push_back(&key);
+    }
+    // Largest buckets first, while there are many free slots.
+    std::vector<uint32_t> order(nbuckets);
+    for(uint32_t b = 0; b < nbuckets; b++) order[b] = b;
+    std::stable_sort(order.begin(), order.end(), [&buckets](uint32_t a, uint32_t b) { return buckets[a].size() > buckets[b].size(); });
+    
+    for(;;) {
+        displacements.assign(nbuckets, 0);
+        slots.assign(nslots, empty);
+        std::vector<uint32_t> placed;
+        bool complete = true;
+        const uint32_t max_tries = static_cast<uint32_t>(std::min<uint64_t>(64 + 64 * static_cast<uint64_t>(nslots), 0xFFFFFFFFu));
+        for(uint32_t b : order) {
+            if(buckets[b].empty()) break;
+            uint32_t d = 0;
+            for(; d < max_tries; d++) {
+                placed.clear();
+                for(const Key * key : buckets[b]) {
+                    const uint32_t slot = hash_slot(key->hash, d, nslots);
+                    if(slots[slot].state != npos || std::find(placed.begin(), placed.end(), slot) != placed.end()) break;
+                    placed.push_back(slot);
+                }
+                if(placed.size() == buckets[b].size()) break;
+            }
+            if(d == max_tries) {
+                complete = false;
+                break;
+            }
+            displacements[b] = d;
+            for(size_t i = 0; i < placed.size(); i++) {
+                const Key * key = buckets[b][i];
+                HashSlot slot = { key->state, run_classes[key->run], run_rows[key->run], run_rows[key->run + 1] };
+                slots[placed[i]] = slot;
+            }
+        }
+        if(complete) return;
+        nslots += nslots / 8 + 1;
+    }
+}
+
+std::shared_ptr<const FSM::Definition> FSM::Definition::build(const std::vector<Trans> & transitions, Layout layout) {
+    // Assign dense indexes to states, triggers, guards and actions.
+    std::vector<State *> states = { Fsm::Fsm_Initial, Fsm::Fsm_Final };
+    std::map<unsigned int, index_t> state_ids = { { Fsm::Fsm_Initial->getID(), 0 }, { Fsm::Fsm_Final->getID(), 1 } };
+    std::vector<Event *> triggers;
+    std::map<unsigned int, index_t> trigger_ids;
+    std::vector<guardFn> guards;
+    std::map<bool (*)(), index_t> guard_ptrs;
+    std::vector<actionFn> actions;
+    std::map<void (*)(Event *), index_t> action_ptrs;
+    
+    auto state_index = [&](State * state) {
+        auto it = state_ids.insert(std::make_pair(state->getID(), static_cast<index_t>(states.size())));
+        if(it.second) states.push_back(state);
+        return it.first->second;
+    };
+    auto trigger_index = [&](Event * trigger) {
+        auto it = trigger_ids.insert(std::make_pair(trigger->getID(), static_cast<index_t>(triggers.size())));
+        if(it.second) triggers.push_back(trigger);
+        return it.first->second;
+    };
+    auto guard_index = [&](const guardFn & guard) {
+        if(not guard) return npos;
+        bool (* const * ptr)() = guard.target<bool (*)()>();
+        if(ptr) {
+            auto it = guard_ptrs.insert(std::make_pair(*ptr, static_cast<index_t>(guards.size())));
+            if(not it.second) return it.first->second;
+        }
+        guards.push_back(guard);
+        return static_cast<index_t>(guards.size() - 1);
+    };
+    auto action_index = [&](const actionFn & action) {
+        if(not action) return npos;
+        void (* const * ptr)(Event *) = action.target<void (*)(Event *)>();
+        if(ptr) {
+            auto it = action_ptrs.insert(std::make_pair(*ptr, static_cast<index_t>(actions.size())));
+            if(not it.second) return it.first->second;
+        }
+        actions.push_back(action);
+        return static_cast<index_t>(actions.size() - 1);
+    };
+    
+    struct Entry {
+        index_t trigger;
+        Row row;
+    };
+    std::vector<Entry> entries;
+    entries.reserve(transitions.size());
+    for(auto& transition : transitions) {
+        assert(transition.to_state != Fsm::Fsm_AnyState);
+        Entry entry;
+        entry.row.from = state_index(transition.from_state);
+        entry.row.to = state_index(transition.to_state);
+        entry.row.guard = guard_index(transition.guard);
+        entry.row.action = action_index(transition.action);
+        if(not transition.triggers) {
+            entry.trigger = trigger_index(transition.trigger ? transition.trigger : Fsm::Fsm_Completion);
+            entries.push_back(entry);
+            continue;
+        }
+        // One row per trigger of the set. The triggers that behave the same
+        // elsewhere end up in one class, and share the row.
+        for(Event * trigger : transition.triggers->triggers()) {
+            entry.trigger = trigger_index(trigger);
+            entries.push_back(entry);
+        }
+    }
+    // Group by from_state, keeping the insertion order of each state.
+    std::stable_sort(entries.begin(), entries.end(), [](const Entry & a, const Entry & b) { return a.row.from < b.row.from; });
+    
+    // Triggers are equivalent if they have the same candidate rows in every
+    // state.
+    std::vector<std::vector<index_t> > signatures(triggers.size());
+    for(auto& entry : entries) {
+        std::vector<index_t> & signature = signatures[entry.trigger];
+        signature.push_back(entry.row.from);
+        signature.push_back(entry.row.to);
+        signature.push_back(entry.row.guard);
+        signature.push_back(entry.row.action);
+    }
+    // Fsm_AnyTrigger and Fsm_Completion are alone in their class: the other
+    // triggers fall back to the rows of Fsm_AnyTrigger, and Fsm_Completion
+    // does not.
+    auto any_trigger = trigger_ids.find(Fsm::Fsm_AnyTrigger->getID());
+    if(any_trigger != trigger_ids.end()) {
+        signatures[any_trigger->second].push_back(npos);
+    }
+    auto completion = trigger_ids.find(Fsm::Fsm_Completion->getID());
+    if(completion != trigger_ids.end()) {
+        signatures[completion->second].push_back(npos);
+        signatures[completion->second].push_back(npos);
+    }
+    std::map<std::vector<index_t>, index_t> class_ids;
+    std::vector<index_t> classes(triggers.size());
+    std::vector<index_t> representatives;
+    for(index_t t = 0; t < triggers.size(); t++) {
+        auto it = class_ids.insert(std::make_pair(signatures[t], static_cast<index_t>(representatives.size())));
+        if(it.second) representatives.push_back(t);
+        classes[t] = it.first->second;
+    }
+    
+    // Group the rows by state and class, and count the runs (rows of a state
+    // for one class).
+    const size_t nstates = states.size();
+    const size_t nclasses = representatives.size();
+    auto any_state_id = state_ids.find(Fsm::Fsm_AnyState->getID());
+    const index_t any_state = any_state_id == state_ids.end() ? npos : any_state_id->second;
+    // Rows from Fsm_AnyState, by class.
+    std::vector<std::vector<Row> > any_rows(nclasses);
+    std::vector<index_t> any_classes;
+    for(auto& entry : entries) {
+        const index_t c = classes[entry.trigger];
+        if(entry.row.from != any_state || representatives[c] != entry.trigger) continue;
+        if(any_rows[c].empty()) any_classes.push_back(c);
+        any_rows[c].push_back(entry.row);
+    }
+    std::vector<Row> sorted;
+    std::vector<index_t> state_runs(nstates + 1);
+    std::vector<index_t> run_rows;
+    std::vector<index_t> run_classes;
+    size_t max_runs = 0;
+    {
+        std::vector<std::vector<Row> > buckets(nclasses);
+        std::vector<index_t> used;
+        auto append = [&](index_t c, const std::vector<Row> & rows) {
+            if(rows.empty()) return;
+            if(buckets[c].empty()) used.push_back(c);
+            buckets[c].insert(buckets[c].end(), rows.begin(), rows.end());
+        };
+        auto entry = entries.begin();
+        for(index_t s = 0; s < nstates; s++) {
+            state_runs[s] = static_cast<index_t>(run_rows.size());
+            for(; entry != entries.end() && entry->row.from == s; ++entry) {
+                const index_t c = classes[entry->trigger];
+                if(representatives[c] != entry->trigger) continue;
+                if(buckets[c].empty()) used.push_back(c);
+                buckets[c].push_back(entry->row);
+            }
+            // Then the rows from any state (not from the pseudo states). The
+            // rows on any trigger stay in their own run, the fallback of the
+            // other classes (see fallbacks()).
+            if(s >= 2 && s != any_state) {
+                for(index_t c : any_classes) append(c, any_rows[c]);
+            }
+            std::sort(used.begin(), used.end());
+            for(index_t c : used) {
+                run_rows.push_back(static_cast<index_t>(sorted.size()));
+                run_classes.push_back(c);
+                sorted.insert(sorted.end(), buckets[c].begin(), buckets[c].end());
+                buckets[c].clear();
+            }
+            max_runs = std::max(max_runs, used.size());
+            used.clear();
+        }
+        state_runs[nstates] = static_cast<index_t>(run_rows.size());
+        run_rows.push_back(static_cast<index_t>(sorted.size()));
+    }
+    const size_t nrows = sorted.size();
+    const size_t nruns = run_classes.size();
+    
+    const size_t ncells = nstates * nclasses;
+    const bool rows_possible = nclasses <= std::numeric_limits<run_class_t>::max();
+    if(layout == Layout_Auto) {
+        if(ncells <= 16384 || ncells <= 4 * nruns) layout = Layout_Dense;
+        else if(max_runs <= 8 && rows_possible) layout = Layout_Rows;
+        else layout = Layout_Hash;
+    }
+    if(layout == Layout_Rows && not rows_possible) {
+        layout = Layout_Hash;
+    }
+    
+    std::vector<uint32_t> displacements;
+    std::vector<HashSlot> slots;
+    if(layout == Layout_Hash) {
+        build_hash(state_runs, run_rows, run_classes, displacements, slots);
+    }
+    
+    // Lay out the blob.
+    Header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, magic, sizeof(magic));
+    header.version = version;
+    header.states = static_cast<uint32_t>(nstates);
+    header.triggers = static_cast<uint32_t>(triggers.size());
+    header.classes = static_cast<uint32_t>(nclasses);
+    header.rows = static_cast<uint32_t>(nrows);
+    header.guards = static_cast<uint32_t>(guards.size());
+    header.actions = static_cast<uint32_t>(actions.size());
+    header.layout = layout;
+    header.classes_offset = sizeof(Header);
+    size_t size = header.classes_offset + header.triggers * sizeof(index_t);
+    if(layout == Layout_Dense) {
+        header.cells_offset = static_cast<uint32_t>(size);
+        size += (ncells + 1) * sizeof(index_t);
+    } else if(layout == Layout_Hash) {
+        header.runs = static_cast<uint32_t>(nruns);
+        header.buckets = static_cast<uint32_t>(displacements.size());
+        header.slots = static_cast<uint32_t>(slots.size());
+        header.displacements_offset = static_cast<uint32_t>(size);
+        size += displacements.size() * sizeof(uint32_t);
+        header.slots_offset = static_cast<uint32_t>(size);
+        size += slots.size() * sizeof(HashSlot);
+    } else {
+        header.runs = static_cast<uint32_t>(nruns);
+        header.state_runs_offset = static_cast<uint32_t>(size);
+        size += (nstates + 1) * sizeof(index_t);
+        header.run_rows_offset = static_cast<uint32_t>(size);
+        size += (nruns + 1) * sizeof(index_t);
+        header.run_classes_offset = static_cast<uint32_t>(size);
+        size += (nruns * sizeof(run_class_t) + 3) & ~static_cast<size_t>(3);
+    }
+    header.rows_offset = static_cast<uint32_t>(size);
+    size += nrows * sizeof(Row);
+    assert(size <= std::numeric_limits<uint32_t>::max());
+    header.size = static_cast<uint32_t>(size);
+    
+    char * blob = new char[size];
+    memset(blob, 0, size);
+    std::shared_ptr<const char> holder(blob, std::default_delete<char[]>());
+    memcpy(blob, &header, sizeof(header));
+    memcpy(blob + header.classes_offset, classes.data(), classes.size() * sizeof(index_t));
+    memcpy(blob + header.rows_offset, sorted.data(), nrows * sizeof(Row));
+    if(layout == Layout_Dense) {
+        // Classes without rows in a state start and end at the next run.
+        index_t * cells = reinterpret_cast<index_t *>(blob + header.cells_offset);
+        for(index_t s = 0; s < nstates; s++) {
+            index_t run = state_runs[s];
+            for(index_t c = 0; c < nclasses; c++) {
+                cells[s * nclasses + c] = run_rows[run];
+                if(run < state_runs[s + 1] && run_classes[run] == c) run++;
+            }
+        }
+        cells[ncells] = static_cast<index_t>(nrows);
+    } else if(layout == Layout_Hash) {
+        memcpy(blob + header.displacements_offset, displacements.data(), displacements.size() * sizeof(uint32_t));
+        memcpy(blob + header.slots_offset, slots.data(), slots.size() * sizeof(HashSlot));
+    } else {
+        memcpy(blob + header.state_runs_offset, state_runs.data(), state_runs.size() * sizeof(index_t));
+        memcpy(blob + header.run_rows_offset, run_rows.data(), run_rows.size() * sizeof(index_t));
+        run_class_t * hot = reinterpret_cast<run_class_t *>(blob + header.run_classes_offset);
+        for(size_t i = 0; i < nruns; i++) hot[i] = static_cast<run_class_t>(run_classes[i]);
+    }
+    
+    return std::make_shared<Definition>(holder, states, triggers, guards, actions);
+}
+
+FSM::Definition::Definition(std::shared_ptr<const char> blob,
+                            std::vector<State *> states,
+                            std::vector<Event *> triggers,
+                            std::vector<guardFn> guards,
+                            std::vector<actionFn> actions)
+: m_blob(blob), m_header(reinterpret_cast<const Header *>(blob.get())),
+  m_states(states), m_triggers(triggers), m_guards(guards), m_actions(actions) {
+    m_classes = reinterpret_cast<const index_t *>(m_blob.get() + m_header->classes_offset);
+    const bool dense = m_header->layout == Layout_Dense;
+    const bool rows = m_header->layout == Layout_Rows;
+    const bool hash = m_header->layout == Layout_Hash;
+    m_cells = dense ? reinterpret_cast<const index_t *>(m_blob.get() + m_header->cells_offset) : nullptr;
+    m_state_runs = rows ? reinterpret_cast<const index_t *>(m_blob.get() + m_header->state_runs_offset) : nullptr;
+    m_run_rows = rows ? reinterpret_cast<const index_t *>(m_blob.get() + m_header->run_rows_offset) : nullptr;
+    m_run_classes = rows ? reinterpret_cast<const run_class_t *>(m_blob.get() + m_header->run_classes_offset) : nullptr;
+    m_displacements = hash ? reinterpret_cast<const uint32_t *>(m_blob.get() + m_header->displacements_offset) : nullptr;
+    m_slots = hash ? reinterpret_cast<const HashSlot *>(m_blob.get() + m_header->slots_offset) : nullptr;
+    m_rows = reinterpret_cast<const Row *>(m_blob.get() + m_header->rows_offset);
+    
+    m_any_state = npos;
+    m_any_class = npos;
+    m_completion_class = npos;
+    for(index_t i = 2; i < m_states.size(); i++) {
+        if(m_states[i] == Fsm::Fsm_AnyState) m_any_state = i;
+    }
+    for(index_t i = 0; i < m_triggers.size(); i++) {
+        if(m_triggers[i] == Fsm::Fsm_AnyTrigger) m_any_class = m_classes[i];
+        if(m_triggers[i] == Fsm::Fsm_Completion) m_completion_class = m_classes[i];
+    }
+    
+    // Lookup tables by ID, or sorted indexes if the IDs are spread.
+    m_state_base = std::numeric_limits<unsigned int>::max();
+    unsigned int state_max = 0;
+    for(index_t i = 2; i < m_states.size(); i++) {
+        if(i == m_any_state) continue;
+        m_state_base = std::min(m_state_base, m_states[i]->getID());
+        state_max = std::max(state_max, m_states[i]->getID());
+        m_sparse_states.push_back(std::make_pair(m_states[i]->getID(), i));
+    }
+    if(m_sparse_states.empty() || dense_ids(state_max - m_state_base + 1ull, m_sparse_states.size())) {
+        for(auto& state : m_sparse_states) {
+            const unsigned int id = state.first - m_state_base;
+            if(id >= m_state_index.size()) m_state_index.resize(id + 1, npos);
+            m_state_index[id] = state.second;
+        }
+        // The pseudo states are found by identity, but their IDs can be in
+        // the table.
+        for(index_t i = 0; i < 2; i++) {
+            const unsigned int id = m_states[i]->getID() - m_state_base;
+            if(id < m_state_index.size()) m_state_index[id] = i;
+        }
+        std::vector<std::pair<unsigned int, index_t> >().swap(m_sparse_states);
+    } else {
+        std::sort(m_sparse_states.begin(), m_sparse_states.end());
+    }
+    m_trigger_base = std::numeric_limits<unsigned int>::max();
+    unsigned int trigger_max = 0;
+    for(index_t i = 0; i < m_triggers.size(); i++) {
+        if(m_triggers[i] == Fsm::Fsm_AnyTrigger || m_triggers[i] == Fsm::Fsm_Completion) continue;
+        m_trigger_base = std::min(m_trigger_base, m_triggers[i]->getID());
+        trigger_max = std::max(trigger_max, m_triggers[i]->getID());
+        m_sparse_triggers.push_back(std::make_pair(m_triggers[i]->getID(), i));
+    }
+    if(m_sparse_triggers.empty() || dense_ids(trigger_max - m_trigger_base + 1ull, m_sparse_triggers.size())) {
+        for(auto& trigger : m_sparse_triggers) {
+            const unsigned int id = trigger.first - m_trigger_base;
+            if(id >= m_trigger_index.size()) {
+                m_trigger_index.resize(id + 1, npos);
+                m_class_by_id.resize(id + 1, m_any_class);
+            }
+            m_trigger_index[id] = trigger.second;
+            m_class_by_id[id] = m_classes[trigger.second];
+        }
+        std::vector<std::pair<unsigned int, index_t> >().swap(m_sparse_triggers);
+    } else {
+        std::sort(m_sparse_triggers.begin(), m_sparse_triggers.end());
+    }
+}
+
+// Match functions
+
+uint32_t FSM::Definition::match_classes_scalar(const run_class_t * classes, index_t count, run_class_t cls) {
+    uint32_t mask = 0;
+    for(index_t i = 0; i < count; i++) {
+        mask |= static_cast<uint32_t>(classes[i] == cls) << i;
+    }
+    return mask;
+}
+
+#ifdef FSM_MATCH_X86
+
+namespace {
+    
+    using run_class_t = FSM::Definition::run_class_t;
+    using index_t = FSM::Definition::index_t;
+    
+    // 8 classes per compare. The tail is matched by the scalar version, so
+    // that nothing is read past the end of the array.
+    __attribute__((target("sse2")))
+    uint32_t match_classes_sse2(const run_class_t * classes, index_t count, run_class_t cls) {
+        const __m128i needle = _mm_set1_epi16(static_cast<short>(cls));
+        uint32_t mask = 0;
+        index_t i = 0;
+        for(; i + 8 <= count; i += 8) {
+            const __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i *>(classes + i));
+            const __m128i equal = _mm_cmpeq_epi16(block, needle);
+            const uint32_t bits = static_cast<uint32_t>(_mm_movemask_epi8(_mm_packs_epi16(equal, _mm_setzero_si128()))) & 0xFFu;
+            mask |= bits << i;
+        }
+        if(i < count) {
+            mask |= FSM::Definition::match_classes_scalar(classes + i, count - i, cls) << i;
+        }
+        return mask;
+    }
+    
+    // 16 classes per compare.
+    __attribute__((target("avx2")))
+    uint32_t match_classes_avx2(const run_class_t * classes, index_t count, run_class_t cls) {
+        const __m256i needle = _mm256_set1_epi16(static_cast<short>(cls));
+        uint32_t mask = 0;
+        index_t i = 0;
+        for(; i + 16 <= count; i += 16) {
+            const __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(classes + i));
+            const __m256i equal = _mm256_cmpeq_epi16(block, needle);
+            // packs works on each 128 bit lane: bytes 0-7 and 16-23 are the
+            // results of classes 0-7 and 8-15.
+            const uint32_t bytes = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_packs_epi16(equal, _mm256_setzero_si256())));
+            const uint32_t bits = (bytes & 0xFFu) | ((bytes >> 8) & 0xFF00u);
+            mask |= bits << i;
+        }
+        if(i < count) {
+            mask |= match_classes_sse2(classes + i, count - i, cls) << i;
+        }
+        return mask;
+    }
+    
+} // end anonymous namespace
+
+FSM::Definition::matchFn FSM::Definition::select_match_classes() {
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")) return match_classes_avx2;
+    if(__builtin_cpu_supports("sse2")) return match_classes_sse2;
+    return match_classes_scalar;
+}
+
+#else
+
+FSM::Definition::matchFn FSM::Definition::select_match_classes() {
+    return match_classes_scalar;
+}
+
+#endif
+
+const char * FSM::Definition::name(index_t i) const {
+    if(m_header->names_offset == 0) return nullptr;
+    const uint32_t * offsets = reinterpret_cast<const uint32_t *>(m_blob.get() + m_header->names_offset);
+    const uint32_t count = m_header->states + m_header->triggers + m_header->guards + m_header->actions;
+    return reinterpret_cast<const char *>(offsets + count) + offsets[i];
+}
+
+// Fsm class implementation
+
+void FSM::Fsm::freeze(Definition::Layout layout) {
+    if(m_def) return;
+    adopt(Definition::build(m_transitions, layout));
+}
+
+void FSM::Fsm::adopt(std::shared_ptr<const Definition> def) {
+    m_def = def;
+    // The transitions are rebuilt from the definition if it is unfrozen.
+    transitions_t().swap(m_transitions);
+    std::vector<uint32_t>().swap(m_offsets);
+    std::vector<unsigned int>().swap(m_offset_ids);
+    m_sorted = 0;
+    m_initial_end = 0;
+    m_final_end = 0;
+    m_any_first = 0;
+    m_wildcards = false;
+    m_completions = m_def->completion_class() != Definition::npos;
+    m_byte_table.clear();
+    if(m_cs) set_state(m_cs);
+}
+
+void FSM::Fsm::set_definition_slot(std::shared_ptr<DefinitionSlot> slot) {
+    m_slot = slot;
+    if(m_slot) {
+        update_definition();
+    }
+}
+
+void FSM::Fsm::update_definition() {
+    // The epoch is read first: the definition is the one of this epoch or
+    // a newer one, which the next execute() takes again.
+    m_epoch = m_slot->epoch();
+    std::shared_ptr<const DefinitionSlot::Version> version = m_slot->version();
+    if(version->def == m_def) {
+        return;
+    }
+    adopt(version->def);
+    const StateMapping * mapping = version->mapping.get();
+    if(mapping && m_cs && m_csi == Definition::npos) {
+        auto it = mapping->states.find(m_cs->getID());
+        State * state = it != mapping->states.end() ? it->second : mapping->fallback;
+        if(state) {
+            if(m_activity) {
+                cancel_activity();
+            }
+            set_state(state);
+        }
+    }
+}
+
+FSM::DefinitionSlot::DefinitionSlot(std::shared_ptr<const Definition> def) : m_version(), m_epoch(0), m_writer() {
+    assert(def);
+    m_version = std::make_shared<const Version>(Version{ def, nullptr });
+}
+
+uint64_t FSM::DefinitionSlot::publish(std::shared_ptr<const Definition> def, std::shared_ptr<const StateMapping> mapping) {
+    assert(def);
+    std::lock_guard<std::mutex> lock(m_writer);
+    return store(def, mapping);
+}
+
+uint64_t FSM::DefinitionSlot::add_transitions(const std::vector<Trans> & transitions, Definition::Layout layout) {
+    std::lock_guard<std::mutex> lock(m_writer);
+    // The transitions of the current definition are copied back by an
+    // unfrozen machine.
+    Fsm builder(m_version->def);
+    builder.add_transitions(transitions);
+    builder.freeze(layout);
+    return store(builder.definition(), m_version->mapping);
+}
+
+uint64_t FSM::DefinitionSlot::store(std::shared_ptr<const Definition> def, std::shared_ptr<const StateMapping> mapping) {
+    // The version is stored before the epoch is incremented (see
+    // Fsm::update_definition()).
+    std::atomic_store(&m_version, std::make_shared<const Version>(Version{ def, mapping }));
+    return m_epoch.fetch_add(1, std::memory_order_acq_rel) + 1;
+}
+
+void FSM::DefinitionSlot::add_transitions_async(std::vector<Trans> transitions,
+                                                std::function<void(uint64_t)> done,
+                                                executorFn executor) {
+    std::shared_ptr<DefinitionSlot> self = shared_from_this();
+    std::function<void()> build = [self, transitions, done]() {
+        const uint64_t epoch = self->add_transitions(transitions);
+        if(done) done(epoch);
+    };
+    if(executor) {
+        executor(build);
+    } else {
+        std::thread(build).detach();
+    }
+}
+
+void FSM::Fsm::unfreeze() {
+    m_byte_table.clear();
+    if(m_transitions.empty()) {
+        // Every row is taken on the triggers of its class: the classes of
+        // more than one trigger become trigger sets.
+        const Definition & def = *m_def;
+        std::vector<std::vector<Event *> > members(def.class_count());
+        for(Definition::index_t t = 0; t < def.trigger_count(); t++) {
+            members[def.class_of(t)].push_back(def.trigger(t));
+        }
+        std::vector<std::shared_ptr<const TriggerSet> > sets(def.class_count());
+        for(Definition::index_t c = 0; c < def.class_count(); c++) {
+            if(members[c].size() > 1) sets[c] = std::make_shared<const TriggerSet>(members[c].begin(), members[c].end());
+        }
+        // The rows from Fsm_AnyState merged into the runs of the states (see
+        // Definition) are dropped, and rebuilt from the rows of Fsm_AnyState.
+        for(Definition::index_t s = 0; s < def.state_count(); s++) {
+            for(Definition::index_t c = 0; c < def.class_count(); c++) {
+                Definition::index_t first, last;
+                def.candidates(s, c, first, last);
+                for(Definition::index_t r = first; r < last; r++) {
+                    const Definition::Row & row = def.row(r);
+                    if(row.from != s) continue;
+                    Trans transition = {
+                        def.state(row.from), def.state(row.to), sets[c] ? nullptr : members[c].front(),
+                        row.guard == Definition::npos ? guardFn(nullptr) : def.guard(row.guard),
+                        row.action == Definition::npos ? actionFn(nullptr) : def.action(row.action),
+                        sets[c]
+                    };
+                    m_transitions.push_back(transition);
+                }
+            }
+        }
+    }
+    m_def.reset();
+    m_csi = Definition::npos;
+}
+
+void FSM::Fsm::sort_transitions() {
+    // Sort (state ID, position) keys rather than the transitions, which are
+    // large, then move each transition once. The position keeps the insertion
+    // order of each state. The transitions from Fsm_Initial and Fsm_Final
+    // sort first and those from Fsm_AnyState last, whatever their IDs: a
+    // state constructed before them (in the static initialization of
+    // another file) has a lower ID.
+    assert(m_transitions.size() <= std::numeric_limits<uint32_t>::max());
+    std::vector<std::pair<uint64_t, uint32_t> > keys(m_transitions.size());
+    m_wildcards = false;
+    m_completions = false;
+    for(uint32_t t = 0; t < m_transitions.size(); t++) {
+        const Trans & transition = m_transitions[t];
+        assert(transition.to_state != Fsm_AnyState);
+        const bool any_state = transition.from_state == Fsm_AnyState;
+        m_wildcards = m_wildcards || any_state || transition.trigger == Fsm_AnyTrigger;
+        m_completions = m_completions || transition.trigger == Fsm_Completion;
+        uint64_t key = (2ull << 32) | transition.from_state->getID();
+        if(transition.from_state == Fsm_Initial) key = 0;
+        else if(transition.from_state == Fsm_Final) key = 1ull << 32;
+        else if(any_state) key = 3ull << 32;
+        keys[t] = std::make_pair(key, t);
+    }
+    std::sort(keys.begin() + m_sorted, keys.end());
+    std::inplace_merge(keys.begin(), keys.begin() + m_sorted, keys.end());
+    transitions_t sorted;
+    sorted.reserve(m_transitions.size());
+    for(auto& key : keys) {
+        sorted.push_back(std::move(m_transitions[key.second]));
+    }
+    m_transitions.swap(sorted);
+    m_sorted = m_transitions.size();
+    
+    m_any_first = static_cast<uint32_t>(m_transitions.size());
+    while(m_any_first > 0 && m_transitions[m_any_first - 1].from_state == Fsm_AnyState) m_any_first--;
+    
+    uint32_t t = 0;
+    while(t < m_any_first && m_transitions[t].from_state == Fsm_Initial) t++;
+    m_initial_end = t;
+    while(t < m_any_first && m_transitions[t].from_state == Fsm_Final) t++;
+    m_final_end = t;
+    
+    m_offsets.clear();
+    m_offset_ids.clear();
+    if(m_final_end == m_any_first) return;
+    size_t count = 0;
+    for(uint32_t i = m_final_end; i < m_any_first; i++) {
+        if(i == m_final_end || m_transitions[i].from_state != m_transitions[i - 1].from_state) count++;
+    }
+    m_offsets_base = m_transitions[m_final_end].from_state->getID();
+    const unsigned int range = m_transitions[m_any_first - 1].from_state->getID() - m_offsets_base + 1;
+    if(not dense_ids(range, count)) {
+        for(; t < m_any_first; t++) {
+            const unsigned int id = m_transitions[t].from_state->getID();
+            if(m_offset_ids.empty() || m_offset_ids.back() != id) {
+                m_offset_ids.push_back(id);
+                m_offsets.push_back(t);
+            }
+        }
+        m_offsets.push_back(m_any_first);
+        return;
+    }
+    m_offsets.resize(range + 1);
+    for(unsigned int i = 0; i <= range; i++) {
+        while(t < m_any_first && m_transitions[t].from_state->getID() - m_offsets_base < i) t++;
+        m_offsets[i] = t;
+    }
+}
+
+const size_t FSM::Fsm::deferred_capacity;
+
+void FSM::Fsm::set_byte_triggers(const std::vector<Event *> & triggers) {
+    assert(triggers.size() == 256);
+    m_byte_triggers = triggers;
+    m_byte_table.clear();
+}
+
+void FSM::Fsm::build_byte_table() {
+    freeze();
+    const Definition & def = *m_def;
+    const Definition::index_t completion = def.completion_class();
+    m_byte_table.resize(static_cast<size_t>(def.state_count()) * 256);
+    for(Definition::index_t s = 0; s < def.state_count(); s++) {
+        State * from_state = def.state(s);
+        for(unsigned int b = 0; b < 256; b++) {
+            uint32_t & entry = m_byte_table[static_cast<size_t>(s) * 256 + b];
+            entry = s;
+            Event * trigger = m_byte_triggers[b];
+            const Definition::index_t cls = trigger ? def.class_by_id(trigger->getID()) : Definition::npos;
+            if(cls == Definition::npos) continue;
+            Definition::index_t first, last, any_first, any_last;
+            def.candidates(s, cls, first, last);
+            def.fallbacks(s, cls, any_first, any_last);
+            if(first == last && any_first == any_last) continue;
+            const Definition::Row & row = def.row(first != last ? first : any_first);
+            State * to_state = def.state(row.to);
+            Definition::index_t eventless_first = 0, eventless_last = 0;
+            if(completion != Definition::npos) {
+                def.candidates(row.to, completion, eventless_first, eventless_last);
+            }
+            const bool marked = (last - first) + (any_last - any_first) > 1 || row.guard != Definition::npos || row.action != Definition::npos
+                || from_state->hasExitFunction() || from_state->hasDoActivity()
+                || to_state->hasEnterFunction() || to_state->hasDoActivity()
+                || eventless_first != eventless_last;
+            entry = row.to | (marked ? byte_marked : 0);
+        }
+    }
+}
+
+FSM::Fsm_Errors FSM::Fsm::execute_bytes(const uint8_t * bytes, size_t count) {
+    if(m_byte_triggers.empty()) {
+        return Fsm_Unsupported;
+    }
+    if(not m_initialized) {
+        return Fsm_NotInitialized;
+    }
+    if(slot_changed() && not m_transitioning) {
+        update_definition();
+    }
+    if(m_byte_table.empty()) {
+        build_byte_table();
+    }
+    size_t i = 0;
+    if(m_csi != Definition::npos && not m_journal_fn && not m_debug_fn && m_deferrals.empty() && m_history_slots.empty()) {
+        const uint32_t * table = m_byte_table.data();
+        uint32_t state = m_csi;
+        for(; i != count && not m_transitioning; i++) {
+            const uint32_t entry = table[static_cast<size_t>(state) * 256 + bytes[i]];
+            if(not (entry & byte_marked)) {
+                state = entry;
+                continue;
+            }
+            m_cs = m_def->state(state);
+            m_csi = state;
+            replay(m_byte_triggers[bytes[i]], true);
+            if(m_byte_table.empty()) {
+                // replay() took a new definition, the rest of the bytes are
+                // executed one by one.
+                state = Definition::npos;
+                i++;
+                break;
+            }
+            state = m_csi;
+        }
+        if(state != Definition::npos) {
+            m_cs = m_def->state(state);
+            m_csi = state;
+        }
+    }
+    // The rest is queued by an asynchronous action, or needs execute().
+    for(; i != count; i++) {
+        Event * trigger = m_byte_triggers[bytes[i]];
+        if(trigger) execute(trigger);
+    }
+    return Fsm_Success;
+}
+
+FSM::Fsm_Errors FSM::Fsm::defer(Event * trigger) {
+    auto it = m_deferrals.find(m_cs->getID());
+    if(it == m_deferrals.end() || not it->second->contains(trigger->getID())) {
+        return Fsm_NoMatchingTrigger;
+    }
+    if(m_deferred_count == deferred_capacity) {
+        return Fsm_QueueFull;
+    }
+    m_deferred[(m_deferred_first + m_deferred_count) % deferred_capacity] = trigger;
+    m_deferred_count++;
+    return Fsm_Deferred;
+}
+
+void FSM::Fsm::recall(bool with_actions) {
+    // The events released by this loop are executed with replay(), which
+    // must not recall in turn.
+    if(m_recalling) return;
+    m_recalling = true;
+    for(;;) {
+        // The first event of the queue the current state does not defer.
+        auto it = m_deferrals.find(m_cs->getID());
+        const TriggerSet * deferred = it == m_deferrals.end() ? nullptr : it->second.get();
+        uint8_t i = 0;
+        while(i < m_deferred_count && deferred &&
+              deferred->contains(m_deferred[(m_deferred_first + i) % deferred_capacity]->getID())) {
+            i++;
+        }
+        if(i == m_deferred_count) break;
+        
+        // Take it out of the queue, keeping the order of the others.
+        Event * trigger = m_deferred[(m_deferred_first + i) % deferred_capacity];
+        if(i == 0) {
+            m_deferred_first = (m_deferred_first + 1) % deferred_capacity;
+        } else {
+            for(; i + 1 < m_deferred_count; i++) {
+                m_deferred[(m_deferred_first + i) % deferred_capacity] = m_deferred[(m_deferred_first + i + 1) % deferred_capacity];
+            }
+        }
+        m_deferred_count--;
+        replay(trigger, with_actions);
+    }
+    m_recalling = false;
+}
+
+FSM::Fsm_Errors FSM::Fsm::complete(bool with_actions) {
+    for(unsigned int step = 0; m_entered; step++) {
+        m_entered = false;
+        if(m_def) {
+            execute_frozen(Fsm_Completion, m_def->completion_class(), with_actions);
+        } else {
+            dispatch(Fsm_Completion, with_actions);
+        }
+        // A chain of the maximum length ends with a step that enters no state
+        // (nothing matches, or the guards are false).
+        if(step == m_max_completion_steps && m_entered) {
+            return Fsm_CompletionLimit;
+        }
+    }
+    return Fsm_Success;
+}
+
+// An asynchronous action, shared by its tokens and the machine.
+struct FSM::AsyncToken::Operation {
+    Operation(Fsm * fsm) : mutex(), fsm(fsm), executor(fsm->m_executor), done(false), suspended(false), from_state(nullptr), to_state(nullptr), trigger(nullptr) {}
+    std::mutex mutex;
+    // The machine, nullptr once it dropped the action.
+    Fsm * fsm;
+    executorFn executor;
+    bool done;
+    // Whether the machine waits for the action.
+    bool suspended;
+    // The transition to finish.
+    State * from_state;
+    State * to_state;
+    Event * trigger;
+};
+
+void FSM::AsyncToken::complete() {
+    std::shared_ptr<Operation> op = m_op;
+    assert(op);
+    executorFn executor;
+    {
+        std::lock_guard<std::mutex> lock(op->mutex);
+        if(op->done) return;
+        op->done = true;
+        // If the action is still running, suspend() sees it is done.
+        if(not op->suspended || op->fsm == nullptr) return;
+        executor = op->executor;
+    }
+    auto resume = [op]() {
+        Fsm * fsm;
+        {
+            std::lock_guard<std::mutex> lock(op->mutex);
+            fsm = op->fsm;
+        }
+        if(fsm) fsm->resume(op);
+    };
+    if(executor) {
+        executor(resume);
+    } else {
+        resume();
+    }
+}
+
+bool FSM::AsyncToken::done() const {
+    std::lock_guard<std::mutex> lock(m_op->mutex);
+    return m_op->done;
+}
+
+FSM::Fsm::~Fsm() {
+    if(m_async) {
+        cancel_async();
+    }
+    if(m_activity) {
+        cancel_activity();
+    }
+}
+
+FSM::AsyncToken FSM::Fsm::begin_async() {
+    Fsm * fsm = s_running;
+    assert(fsm != nullptr && not fsm->m_async);
+    fsm->m_async = std::make_shared<AsyncToken::Operation>(fsm);
+    return AsyncToken(fsm->m_async);
+}
+
+bool FSM::Fsm::suspend(State * from_state, State * to_state, Event * trigger) {
+    std::shared_ptr<AsyncToken::Operation> op = m_async;
+    std::lock_guard<std::mutex> lock(op->mutex);
+    if(op->done) {
+        m_async.reset();
+        return false;
+    }
+    op->suspended = true;
+    op->from_state = from_state;
+    op->to_state = to_state;
+    op->trigger = trigger;
+    m_transitioning = true;
+    m_entered = false;
+    return true;
+}
+
+void FSM::Fsm::resume(const std::shared_ptr<AsyncToken::Operation> & op) {
+    // The machine may have been reset since.
+    if(op != m_async) return;
+    {
+        std::lock_guard<std::mutex> lock(op->mutex);
+        op->fsm = nullptr;
+    }
+    m_async.reset();
+    m_transitioning = false;
+    
+    set_state(op->to_state);
+    op->to_state->invokeEnterFunction();
+    if(op->to_state->hasDoActivity()) {
+        start_activity(op->to_state);
+    }
+    if(m_debug_fn) {
+        m_debug_fn(op->from_state, op->to_state, op->trigger);
+    }
+    if(m_completions) {
+        m_entered = true;
+        complete(true);
+    }
+    if(m_deferred_count != 0 && not m_transitioning) {
+        recall(true);
+    }
+    while(not m_transitioning && not m_async_queue.empty()) {
+        Event * trigger = m_async_queue.front();
+        m_async_queue.pop_front();
+        replay(trigger, true);
+    }
+}
+
+void FSM::Fsm::cancel_async() {
+    {
+        std::lock_guard<std::mutex> lock(m_async->mutex);
+        m_async->fsm = nullptr;
+    }
+    m_async.reset();
+    m_transitioning = false;
+    m_async_queue.clear();
+}
+
+// A do-activity, shared by its function and the machine.
+struct FSM::Activity::Operation {
+    Operation(Fsm * fsm) : cancelled(false), mutex(), fsm(fsm), executor(fsm->m_executor), posted() {}
+    std::atomic<bool> cancelled;
+    std::mutex mutex;
+    // The machine, nullptr once cancelled.
+    Fsm * fsm;
+    executorFn executor;
+    // Events posted without executor, for Fsm::run_posted().
+    std::deque<Event *> posted;
+};
+
+struct FSM::Fsm::Activities {
+    Activities() : mutex(), returned(), running(0) {}
+    std::mutex mutex;
+    std::condition_variable returned;
+    size_t running;
+};
+
+bool FSM::Activity::cancelled() const {
+    return m_op->cancelled.load(std::memory_order_acquire);
+}
+
+void FSM::Activity::post(Event * event) const {
+    std::shared_ptr<Operation> op = m_op;
+    {
+        std::lock_guard<std::mutex> lock(op->mutex);
+        if(op->fsm == nullptr) return;
+        if(not op->executor) {
+            // The machine belongs to another thread.
+            op->posted.push_back(event);
+            return;
+        }
+    }
+    // The activity may be cancelled before the event is executed.
+    op->executor([op, event]() {
+        Fsm * fsm;
+        {
+            std::lock_guard<std::mutex> lock(op->mutex);
+            fsm = op->fsm;
+        }
+        if(fsm) fsm->execute(event);
+    });
+}
+
+size_t FSM::Fsm::run_posted() {
+    size_t count = 0;
+    // An event can exit the state, which cancels the activity.
+    while(m_activity) {
+        Event * event;
+        {
+            std::lock_guard<std::mutex> lock(m_activity->mutex);
+            if(m_activity->posted.empty()) break;
+            event = m_activity->posted.front();
+            m_activity->posted.pop_front();
+        }
+        execute(event);
+        count++;
+    }
+    return count;
+}
+
+void FSM::Fsm::wait_activities() {
+    if(not m_activities) return;
+    std::unique_lock<std::mutex> lock(m_activities->mutex);
+    std::shared_ptr<Activities> activities = m_activities;
+    activities->returned.wait(lock, [&activities]() { return activities->running == 0; });
+}
+
+void FSM::Fsm::start_activity(State * state) {
+    std::shared_ptr<Activity::Operation> op = std::make_shared<Activity::Operation>(this);
+    m_activity = op;
+    if(not m_activities) {
+        m_activities = std::make_shared<Activities>();
+    }
+    std::shared_ptr<Activities> activities = m_activities;
+    {
+        std::lock_guard<std::mutex> lock(activities->mutex);
+        activities->running++;
+    }
+    // The task keeps the function and the count alive: the state and the
+    // machine can be deleted while it runs.
+    Activity activity(op);
+    activityFn fn = state->getDoActivity();
+    auto run = [fn, activity, activities]() {
+        fn(activity);
+        std::lock_guard<std::mutex> lock(activities->mutex);
+        if(--activities->running == 0) activities->returned.notify_all();
+    };
+    if(m_activity_executor) {
+        m_activity_executor(run);
+    } else {
+        std::thread(run).detach();
+    }
+}
+
+void FSM::Fsm::cancel_activity() {
+    {
+        std::lock_guard<std::mutex> lock(m_activity->mutex);
+        m_activity->fsm = nullptr;
+    }
+    m_activity->cancelled.store(true, std::memory_order_release);
+    m_activity.reset();
+}
+
+void FSM::Fsm::index_history(State * state, uint32_t entry) {
+    const unsigned int id = state->getID();
+    if(m_history_index.empty()) {
+        m_history_base = id;
+    } else if(id < m_history_base) {
+        m_history_index.insert(m_history_index.begin(), m_history_base - id, Definition::npos);
+        m_history_base = id;
+    }
+    const unsigned int i = id - m_history_base;
+    if(i >= m_history_index.size()) {
+        m_history_index.resize(i + 1, Definition::npos);
+    }
+    assert(m_history_index[i] == Definition::npos);
+    m_history_index[i] = entry;
+}
+
+void FSM::Fsm::add_history(State * history, const std::vector<State *> & states, State * initial) {
+    assert(std::find(states.begin(), states.end(), initial) != states.end());
+    const uint32_t slot = static_cast<uint32_t>(m_history_slots.size());
+    index_history(history, slot | history_bit);
+    for(State * state : states) {
+        index_history(state, slot);
+    }
+    m_history_defaults.push_back(initial);
+    m_history_slots.push_back(nullptr);
+}
+
+std::vector<unsigned int> FSM::Fsm::history() const {
+    std::vector<unsigned int> state_ids;
+    for(size_t slot = 0; slot < m_history_slots.size(); slot++) {
+        State * state = m_history_slots[slot] ? m_history_slots[slot] : m_history_defaults[slot];
+        state_ids.push_back(state->getID());
+    }
+    return state_ids;
+}
+
+FSM::Fsm_Errors FSM::Fsm::restore_history(const std::vector<unsigned int> & state_ids) {
+    if(state_ids.empty()) {
+        std::fill(m_history_slots.begin(), m_history_slots.end(), nullptr);
+        return Fsm_Success;
+    }
+    if(state_ids.size() != m_history_slots.size()) {
+        return Fsm_UnknownId;
+    }
+    std::vector<State *> states(state_ids.size());
+    for(size_t slot = 0; slot < state_ids.size(); slot++) {
+        const unsigned int i = state_ids[slot] - m_history_base;
+        states[slot] = find_state(state_ids[slot]);
+        if(i >= m_history_index.size() || m_history_index[i] != slot || states[slot] == nullptr) {
+            return Fsm_UnknownId;
+        }
+    }
+    m_history_slots.swap(states);
+    return Fsm_Success;
+}
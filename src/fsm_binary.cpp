@@ -0,0 +1,350 @@
+/**
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2015 Eric Halère
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+#include "../include/fsm_binary.h"
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace {
+
+    const char * const initial_name = "Fsm_Initial";
+    const char * const final_name = "Fsm_Final";
+    const char * const any_state_name = "Fsm_AnyState";
+    const char * const any_trigger_name = "Fsm_AnyTrigger";
+    const char * const completion_name = "Fsm_Completion";
+
+    // Returns whether [offset, offset + size) is inside the blob and aligned.
+    bool in_blob(uint64_t offset, uint64_t size, uint64_t blob_size) {
+        return offset % sizeof(uint32_t) == 0 && offset <= blob_size && size <= blob_size - offset;
+    }
+
+    // Returns whether values never decrease and stay under max.
+    bool ascending(const uint32_t * values, uint64_t count, uint32_t max) {
+        for(uint64_t i = 0; i < count; i++) {
+            if(values[i] > max || (i > 0 && values[i] < values[i - 1])) return false;
+        }
+        return true;
+    }
+
+    // Returns whether every index of the tables stays inside the tables it
+    // refers to, so that a corrupted file cannot make execute() read outside
+    // the blob. The structure of the blob must have been checked.
+    bool tables_valid(const FSM::Definition::Header & header, const char * blob) {
+        using FSM::Definition;
+        const uint32_t * classes = reinterpret_cast<const uint32_t *>(blob + header.classes_offset);
+        for(uint32_t i = 0; i < header.triggers; i++) {
+            if(classes[i] >= header.classes) return false;
+        }
+        if(header.layout == Definition::Layout_Dense) {
+            const uint64_t cells = static_cast<uint64_t>(header.states) * header.classes + 1;
+            if(not ascending(reinterpret_cast<const uint32_t *>(blob + header.cells_offset), cells, header.rows)) return false;
+        } else if(header.layout == Definition::Layout_Rows) {
+            const Definition::run_class_t * run_classes = reinterpret_cast<const Definition::run_class_t *>(blob + header.run_classes_offset);
+            if(not ascending(reinterpret_cast<const uint32_t *>(blob + header.state_runs_offset), header.states + 1ull, header.runs)
+               || not ascending(reinterpret_cast<const uint32_t *>(blob + header.run_rows_offset), header.runs + 1ull, header.rows)) {
+                return false;
+            }
+            for(uint32_t i = 0; i < header.runs; i++) {
+                if(run_classes[i] >= header.classes) return false;
+            }
+        } else {
+            const Definition::HashSlot * slots = reinterpret_cast<const Definition::HashSlot *>(blob + header.slots_offset);
+            for(uint32_t i = 0; i < header.slots; i++) {
+                const Definition::HashSlot & slot = slots[i];
+                if(slot.state == Definition::npos) continue;
+                if(slot.state >= header.states || slot.cls >= header.classes
+                   || slot.first > slot.last || slot.last > header.rows) {
+                    return false;
+                }
+            }
+        }
+        const Definition::Row * rows = reinterpret_cast<const Definition::Row *>(blob + header.rows_offset);
+        for(uint32_t i = 0; i < header.rows; i++) {
+            const Definition::Row & row = rows[i];
+            if(row.from >= header.states || row.to >= header.states
+               || (row.guard != Definition::npos && row.guard >= header.guards)
+               || (row.action != Definition::npos && row.action >= header.actions)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool write_all(int fd, const char * data, size_t size) {
+        while(size > 0) {
+            ssize_t written = ::write(fd, data, size);
+            if(written < 0) {
+                if(errno == EINTR) continue;
+                return false;
+            }
+            data += written;
+            size -= static_cast<size_t>(written);
+        }
+        return true;
+    }
+
+} // end anonymous namespace
+
+// Registry class implementation
+
+FSM::Registry::Registry() {
+}
+
+void FSM::Registry::add_state(const std::string & name, State * state) {
+    m_states[name] = state;
+    m_state_names[state->getID()] = name;
+}
+
+void FSM::Registry::add_event(const std::string & name, Event * event) {
+    m_events[name] = event;
+    m_event_names[event->getID()] = name;
+}
+
+FSM::guardFn FSM::Registry::add_guard(const std::string & name, guardFn fn) {
+    bool (* const * ptr)() = fn.target<bool (*)()>();
+    if(ptr) {
+        m_guard_ptrs[*ptr] = name;
+        m_guards[name] = fn;
+        return fn;
+    }
+    NamedGuard named = { name, fn };
+    m_guards[name] = named;
+    return m_guards[name];
+}
+
+FSM::actionFn FSM::Registry::add_action(const std::string & name, actionFn fn) {
+    void (* const * ptr)(Event *) = fn.target<void (*)(Event *)>();
+    if(ptr) {
+        m_action_ptrs[*ptr] = name;
+        m_actions[name] = fn;
+        return fn;
+    }
+    NamedAction named = { name, fn };
+    m_actions[name] = named;
+    return m_actions[name];
+}
+
+FSM::State * FSM::Registry::state(const std::string & name) const {
+    if(name == initial_name) return Fsm::Fsm_Initial;
+    if(name == final_name) return Fsm::Fsm_Final;
+    if(name == any_state_name) return Fsm::Fsm_AnyState;
+    auto it = m_states.find(name);
+    return it == m_states.end() ? nullptr : it->second;
+}
+
+FSM::Event * FSM::Registry::event(const std::string & name) const {
+    if(name == any_trigger_name) return Fsm::Fsm_AnyTrigger;
+    if(name == completion_name) return Fsm::Fsm_Completion;
+    auto it = m_events.find(name);
+    return it == m_events.end() ? nullptr : it->second;
+}
+
+FSM::guardFn FSM::Registry::guard(const std::string & name) const {
+    auto it = m_guards.find(name);
+    return it == m_guards.end() ? guardFn(nullptr) : it->second;
+}
+
+FSM::actionFn FSM::Registry::action(const std::string & name) const {
+    auto it = m_actions.find(name);
+    return it == m_actions.end() ? actionFn(nullptr) : it->second;
+}
+
+std::string FSM::Registry::state_name(State * state) const {
+    if(state == Fsm::Fsm_Initial) return initial_name;
+    if(state == Fsm::Fsm_Final) return final_name;
+    if(state == Fsm::Fsm_AnyState) return any_state_name;
+    auto it = m_state_names.find(state->getID());
+    return it == m_state_names.end() ? std::string() : it->second;
+}
+
+std::string FSM::Registry::event_name(Event * event) const {
+    if(event == Fsm::Fsm_AnyTrigger) return any_trigger_name;
+    if(event == Fsm::Fsm_Completion) return completion_name;
+    auto it = m_event_names.find(event->getID());
+    return it == m_event_names.end() ? std::string() : it->second;
+}
+
+std::string FSM::Registry::guard_name(const guardFn & fn) const {
+    const NamedGuard * named = fn.target<NamedGuard>();
+    if(named) return named->name;
+    bool (* const * ptr)() = fn.target<bool (*)()>();
+    if(ptr) {
+        auto it = m_guard_ptrs.find(*ptr);
+        if(it != m_guard_ptrs.end()) return it->second;
+    }
+    return std::string();
+}
+
+std::string FSM::Registry::action_name(const actionFn & fn) const {
+    const NamedAction * named = fn.target<NamedAction>();
+    if(named) return named->name;
+    void (* const * ptr)(Event *) = fn.target<void (*)(Event *)>();
+    if(ptr) {
+        auto it = m_action_ptrs.find(*ptr);
+        if(it != m_action_ptrs.end()) return it->second;
+    }
+    return std::string();
+}
+
+// Save and load
+
+FSM::Fsm_Errors FSM::save_definition(const Definition & def, const Registry & registry, const std::string & path) {
+    // Collect the names, in the order of the name table.
+    std::vector<std::string> names;
+    for(Definition::index_t i = 0; i < def.state_count(); i++) {
+        names.push_back(registry.state_name(def.state(i)));
+    }
+    for(Definition::index_t i = 0; i < def.trigger_count(); i++) {
+        names.push_back(registry.event_name(def.trigger(i)));
+    }
+    for(Definition::index_t i = 0; i < def.header().guards; i++) {
+        names.push_back(registry.guard_name(def.guard(i)));
+    }
+    for(Definition::index_t i = 0; i < def.header().actions; i++) {
+        names.push_back(registry.action_name(def.action(i)));
+    }
+
+    std::vector<uint32_t> offsets;
+    std::string pool;
+    for(auto& name : names) {
+        if(name.empty()) return Fsm_UnknownId;
+        offsets.push_back(static_cast<uint32_t>(pool.size()));
+        pool.append(name);
+        pool.push_back('\0');
+    }
+    pool.resize((pool.size() + 3) & ~static_cast<size_t>(3), '\0');
+
+    // The tables are copied as is, the name table is (re)placed after them.
+    Definition::Header header = def.header();
+    const uint32_t tables_end = header.names_offset ? header.names_offset : header.size;
+    header.names_offset = tables_end;
+    header.size = static_cast<uint32_t>(tables_end + offsets.size() * sizeof(uint32_t) + pool.size());
+
+    // Write to a temporary file, then rename, so that the file is replaced
+    // atomically.
+    const std::string tmp = path + ".tmp";
+    int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0) return Fsm_IOError;
+    bool ok = write_all(fd, reinterpret_cast<const char *>(&header), sizeof(header))
+           && write_all(fd, def.blob() + sizeof(header), tables_end - sizeof(header))
+           && write_all(fd, reinterpret_cast<const char *>(offsets.data()), offsets.size() * sizeof(uint32_t))
+           && write_all(fd, pool.data(), pool.size())
+           && ::fsync(fd) == 0;
+    ok = (::close(fd) == 0) && ok;
+    if(not ok || ::rename(tmp.c_str(), path.c_str()) != 0) {
+        ::unlink(tmp.c_str());
+        return Fsm_IOError;
+    }
+    return Fsm_Success;
+}
+
+FSM::Fsm_Errors FSM::load_definition(const std::string & path, const Registry & registry, std::shared_ptr<const Definition> & def) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if(fd < 0) return Fsm_IOError;
+    struct stat st;
+    if(::fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(Definition::Header)) {
+        ::close(fd);
+        return Fsm_IOError;
+    }
+    const size_t size = static_cast<size_t>(st.st_size);
+    void * addr = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if(addr == MAP_FAILED) return Fsm_IOError;
+    std::shared_ptr<const char> blob(static_cast<const char *>(addr), [size](const char * p) {
+        ::munmap(const_cast<char *>(p), size);
+    });
+
+    // Check the structure of the blob, then its contents.
+    const Definition::Header & header = *reinterpret_cast<const Definition::Header *>(blob.get());
+    const uint64_t cells = static_cast<uint64_t>(header.states) * header.classes + 1;
+    const uint64_t names = static_cast<uint64_t>(header.states) + header.triggers + header.guards + header.actions;
+    bool index_valid = false;
+    if(header.layout == Definition::Layout_Dense) {
+        index_valid = in_blob(header.cells_offset, cells * sizeof(uint32_t), size);
+    } else if(header.layout == Definition::Layout_Rows) {
+        index_valid = in_blob(header.state_runs_offset, (static_cast<uint64_t>(header.states) + 1) * sizeof(uint32_t), size)
+                   && in_blob(header.run_rows_offset, (static_cast<uint64_t>(header.runs) + 1) * sizeof(uint32_t), size)
+                   && in_blob(header.run_classes_offset, header.runs * sizeof(Definition::run_class_t), size);
+    } else if(header.layout == Definition::Layout_Hash) {
+        index_valid = header.buckets > 0 && header.slots > 0
+                   && in_blob(header.displacements_offset, header.buckets * sizeof(uint32_t), size)
+                   && in_blob(header.slots_offset, header.slots * sizeof(Definition::HashSlot), size);
+    }
+    if(memcmp(header.magic, Definition::magic, sizeof(header.magic)) != 0
+       || header.version != Definition::version
+       || header.size != size
+       || header.states < 2
+       || not in_blob(header.classes_offset, header.triggers * sizeof(uint32_t), size)
+       || not index_valid
+       || not in_blob(header.rows_offset, header.rows * sizeof(Definition::Row), size)
+       || header.names_offset == 0
+       || not in_blob(header.names_offset, names * sizeof(uint32_t), size)) {
+        return Fsm_IOError;
+    }
+    const uint32_t * offsets = reinterpret_cast<const uint32_t *>(blob.get() + header.names_offset);
+    const char * pool = reinterpret_cast<const char *>(offsets + names);
+    const size_t pool_size = size - (pool - blob.get());
+    for(uint64_t i = 0; i < names; i++) {
+        if(offsets[i] >= pool_size || memchr(pool + offsets[i], '\0', pool_size - offsets[i]) == nullptr) {
+            return Fsm_IOError;
+        }
+    }
+    if(not tables_valid(header, blob.get())) return Fsm_IOError;
+
+    // Bind the names.
+    uint32_t n = 0;
+    std::vector<State *> states;
+    for(uint32_t i = 0; i < header.states; i++, n++) {
+        State * state = registry.state(pool + offsets[n]);
+        if(state == nullptr) return Fsm_UnknownId;
+        states.push_back(state);
+    }
+    std::vector<Event *> triggers;
+    for(uint32_t i = 0; i < header.triggers; i++, n++) {
+        Event * event = registry.event(pool + offsets[n]);
+        if(event == nullptr) return Fsm_UnknownId;
+        triggers.push_back(event);
+    }
+    std::vector<guardFn> guards;
+    for(uint32_t i = 0; i < header.guards; i++, n++) {
+        guardFn guard = registry.guard(pool + offsets[n]);
+        if(not guard) return Fsm_UnknownId;
+        guards.push_back(guard);
+    }
+    std::vector<actionFn> actions;
+    for(uint32_t i = 0; i < header.actions; i++, n++) {
+        actionFn action = registry.action(pool + offsets[n]);
+        if(not action) return Fsm_UnknownId;
+        actions.push_back(action);
+    }
+
+    ::madvise(addr, size, MADV_WILLNEED);
+    def = std::make_shared<Definition>(blob, states, triggers, guards, actions);
+    return Fsm_Success;
+}
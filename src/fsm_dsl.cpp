@@ -0,0 +1,193 @@
+/**
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2015 Eric Halère
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+#include "../include/fsm_dsl.h"
+#include <ctype.h>
+#include <algorithm>
+#include <fstream>
+#include <set>
+#include <sstream>
+
+namespace {
+
+    bool is_identifier(const std::string & name) {
+        if(name.empty() || isdigit(static_cast<unsigned char>(name[0]))) return false;
+        for(char c : name) {
+            if(not isalnum(static_cast<unsigned char>(c)) && c != '_') return false;
+        }
+        return true;
+    }
+
+    // Splits a line in tokens. `[`, `]` and `/` are tokens of their own.
+    std::vector<std::string> tokenize(const std::string & line) {
+        std::vector<std::string> tokens;
+        std::string token;
+        for(char c : line) {
+            if(c == '#') break;
+            if(isspace(static_cast<unsigned char>(c)) || c == '[' || c == ']' || c == '/') {
+                if(not token.empty()) tokens.push_back(token);
+                token.clear();
+                if(not isspace(static_cast<unsigned char>(c))) tokens.push_back(std::string(1, c));
+            } else {
+                token.push_back(c);
+            }
+        }
+        if(not token.empty()) tokens.push_back(token);
+        return tokens;
+    }
+
+    void add_unique(std::vector<std::string> & names, const std::string & name) {
+        if(std::find(names.begin(), names.end(), name) == names.end()) names.push_back(name);
+    }
+
+    std::string at_line(unsigned int line) {
+        std::ostringstream out;
+        out << "line " << line << ": ";
+        return out.str();
+    }
+
+} // end anonymous namespace
+
+FSM::Fsm_Errors FSM::parse_description(const std::string & text, Description & description, std::string & error) {
+    description = Description();
+    description.states.push_back("Fsm_Initial");
+    description.states.push_back("Fsm_Final");
+
+    std::istringstream in(text);
+    std::string line;
+    unsigned int number = 0;
+    while(std::getline(in, line)) {
+        number++;
+        std::vector<std::string> tokens = tokenize(line);
+        if(tokens.empty()) continue;
+
+        if(tokens[0] == "machine" || tokens[0] == "states" || tokens[0] == "events") {
+            for(size_t i = 1; i < tokens.size(); i++) {
+                if(not is_identifier(tokens[i])) {
+                    error = at_line(number) + "invalid name '" + tokens[i] + "'";
+                    return Fsm_ParseError;
+                }
+            }
+            if(tokens[0] == "machine") {
+                if(tokens.size() != 2) {
+                    error = at_line(number) + "expected 'machine <name>'";
+                    return Fsm_ParseError;
+                }
+                description.name = tokens[1];
+            } else {
+                std::vector<std::string> & names = tokens[0] == "states" ? description.states : description.events;
+                for(size_t i = 1; i < tokens.size(); i++) add_unique(names, tokens[i]);
+            }
+            continue;
+        }
+
+        // from -> to on event [ guard ] / action
+        Description::Transition transition;
+        transition.line = number;
+        size_t i = 0;
+        bool valid = tokens.size() >= 5 && tokens[1] == "->" && tokens[3] == "on";
+        if(valid) {
+            transition.from_state = tokens[0];
+            transition.to_state = tokens[2];
+            transition.trigger = tokens[4];
+            i = 5;
+            if(i + 2 < tokens.size() && tokens[i] == "[" && tokens[i + 2] == "]") {
+                transition.guard = tokens[i + 1];
+                i += 3;
+            }
+            if(i + 1 < tokens.size() && tokens[i] == "/") {
+                transition.action = tokens[i + 1];
+                i += 2;
+            }
+            valid = (i == tokens.size());
+        }
+        if(not valid) {
+            error = at_line(number) + "expected '<from> -> <to> on <event> [<guard>] / <action>'";
+            return Fsm_ParseError;
+        }
+        const std::string names[] = { transition.from_state, transition.to_state, transition.trigger, transition.guard, transition.action };
+        for(auto& name : names) {
+            if(not name.empty() && not is_identifier(name)) {
+                error = at_line(number) + "invalid name '" + name + "'";
+                return Fsm_ParseError;
+            }
+        }
+        description.transitions.push_back(transition);
+        if(not transition.guard.empty()) add_unique(description.guards, transition.guard);
+        if(not transition.action.empty()) add_unique(description.actions, transition.action);
+    }
+
+    // Check that all names are declared.
+    std::set<std::string> states(description.states.begin(), description.states.end());
+    std::set<std::string> events(description.events.begin(), description.events.end());
+    for(auto& transition : description.transitions) {
+        if(not states.count(transition.from_state) || not states.count(transition.to_state)) {
+            error = at_line(transition.line) + "undeclared state '" + (states.count(transition.from_state) ? transition.to_state : transition.from_state) + "'";
+            return Fsm_ParseError;
+        }
+        if(not events.count(transition.trigger)) {
+            error = at_line(transition.line) + "undeclared event '" + transition.trigger + "'";
+            return Fsm_ParseError;
+        }
+    }
+    return Fsm_Success;
+}
+
+FSM::Fsm_Errors FSM::load_description(const std::string & path, Description & description, std::string & error) {
+    std::ifstream in(path.c_str());
+    if(not in) {
+        error = "cannot read " + path;
+        return Fsm_IOError;
+    }
+    std::ostringstream text;
+    text << in.rdbuf();
+    return parse_description(text.str(), description, error);
+}
+
+FSM::Fsm_Errors FSM::bind_description(const Description & description, const Registry & registry, std::vector<Trans> & transitions, std::string & error) {
+    std::vector<Trans> bound;
+    for(auto& transition : description.transitions) {
+        Trans trans = {
+            registry.state(transition.from_state),
+            registry.state(transition.to_state),
+            registry.event(transition.trigger),
+            transition.guard.empty() ? guardFn(nullptr) : registry.guard(transition.guard),
+            transition.action.empty() ? actionFn(nullptr) : registry.action(transition.action)
+        };
+        std::string unbound;
+        if(trans.from_state == nullptr) unbound = transition.from_state;
+        else if(trans.to_state == nullptr) unbound = transition.to_state;
+        else if(trans.trigger == nullptr) unbound = transition.trigger;
+        else if(not transition.guard.empty() && not trans.guard) unbound = transition.guard;
+        else if(not transition.action.empty() && not trans.action) unbound = transition.action;
+        if(not unbound.empty()) {
+            error = at_line(transition.line) + "'" + unbound + "' is not registered";
+            return Fsm_UnknownId;
+        }
+        bound.push_back(trans);
+    }
+    transitions.insert(transitions.end(), bound.begin(), bound.end());
+    return Fsm_Success;
+}
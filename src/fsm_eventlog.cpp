@@ -0,0 +1,197 @@
+/**
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2015 Eric Halère
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+#include "../include/fsm_eventlog.h"
+#include <algorithm>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace {
+
+    // Pages requested ahead of the replay, and dropped behind it.
+    const size_t window = 64 << 20;
+    // Distance, in bytes, of the prefetch of the records.
+    const size_t prefetch_distance = 1024;
+    // IDs below this have an entry in the table of the triggers, the
+    // others are looked up in a map (the IDs come from the file).
+    const unsigned int dense_ids = 1u << 20;
+
+    inline uint32_t field(const char * record, uint32_t offset) {
+        uint32_t value;
+        memcpy(&value, record + offset, sizeof(value));
+        return value;
+    }
+
+} // end anonymous namespace
+
+const uint32_t FSM::EventLogFormat::none;
+
+FSM::EventLog::EventLog() : m_data(nullptr), m_size(0), m_count(0), m_format(), m_instances(), m_events(), m_looked_up(), m_sparse(), m_executed(0), m_skipped(0) {
+}
+
+FSM::EventLog::~EventLog() {
+    close();
+}
+
+FSM::Fsm_Errors FSM::EventLog::open(const std::string & path, const EventLogFormat & format) {
+    close();
+    if(format.record_size == 0
+       || static_cast<uint64_t>(format.trigger_offset) + sizeof(uint32_t) > format.record_size
+       || (format.instance_offset != EventLogFormat::none && static_cast<uint64_t>(format.instance_offset) + sizeof(uint32_t) > format.record_size)) {
+        return Fsm_IOError;
+    }
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if(fd < 0) return Fsm_IOError;
+    struct stat st;
+    if(::fstat(fd, &st) != 0) {
+        ::close(fd);
+        return Fsm_IOError;
+    }
+    const size_t size = static_cast<size_t>(st.st_size);
+    m_format = format;
+    m_count = size / format.record_size;
+    if(m_count == 0) {
+        ::close(fd);
+        return Fsm_Success;
+    }
+    void * addr = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if(addr == MAP_FAILED) {
+        m_count = 0;
+        return Fsm_IOError;
+    }
+    m_data = static_cast<const char *>(addr);
+    m_size = size;
+    ::madvise(addr, size, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+    ::madvise(addr, size, MADV_HUGEPAGE);
+#endif
+    return Fsm_Success;
+}
+
+void FSM::EventLog::close() {
+    if(m_data) {
+        ::munmap(const_cast<char *>(m_data), m_size);
+    }
+    m_data = nullptr;
+    m_size = 0;
+    m_count = 0;
+}
+
+void FSM::EventLog::add_instance(unsigned int instance, Fsm * fsm) {
+    if(instance >= m_instances.size()) {
+        m_instances.resize(instance + 1, nullptr);
+    }
+    m_instances[instance] = fsm;
+    // A trigger not found so far may be in this machine.
+    std::fill(m_looked_up.begin(), m_looked_up.end(), 0);
+    m_sparse.clear();
+}
+
+FSM::Event * FSM::EventLog::find_event(unsigned int id) {
+    if(id >= dense_ids) {
+        // Only the triggers found are kept, so that the map does not grow
+        // with the IDs of the file.
+        auto it = m_sparse.find(id);
+        if(it != m_sparse.end()) return it->second;
+        for(Fsm * fsm : m_instances) {
+            Event * trigger = fsm ? fsm->find_event(id) : nullptr;
+            if(trigger) return m_sparse[id] = trigger;
+        }
+        return nullptr;
+    }
+    if(id >= m_events.size()) {
+        m_events.resize(id + 1, nullptr);
+        m_looked_up.resize(id + 1, 0);
+    }
+    if(not m_looked_up[id]) {
+        m_looked_up[id] = 1;
+        for(Fsm * fsm : m_instances) {
+            if(fsm && (m_events[id] = fsm->find_event(id)) != nullptr) break;
+        }
+    }
+    return m_events[id];
+}
+
+void FSM::EventLog::advise(size_t consumed, size_t offset) {
+    const size_t page = static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+    const size_t from = consumed / page * page;
+    const size_t start = offset / page * page;
+    if(from < start) {
+        ::madvise(const_cast<char *>(m_data) + from, start - from, MADV_DONTNEED);
+    }
+    ::madvise(const_cast<char *>(m_data) + start, std::min(window, m_size - start), MADV_WILLNEED);
+}
+
+FSM::Fsm_Errors FSM::EventLog::run(size_t first, size_t last) {
+    m_executed = 0;
+    m_skipped = 0;
+    last = std::min(last, m_count);
+    if(first >= last) {
+        return Fsm_Success;
+    }
+    const size_t record_size = m_format.record_size;
+    const uint32_t trigger_offset = m_format.trigger_offset;
+    const uint32_t instance_offset = m_format.instance_offset;
+    const bool instances = instance_offset != EventLogFormat::none;
+    const size_t window_records = std::max<size_t>(1, window / record_size);
+
+    const char * const end = m_data + last * record_size;
+    size_t advised = first;
+    size_t next_advice = first;
+    for(size_t i = first; i != last; i++) {
+        if(i == next_advice) {
+            advise(advised * record_size, i * record_size);
+            advised = i;
+            next_advice = i + window_records;
+        }
+        const char * record = m_data + i * record_size;
+#if defined(__GNUC__)
+        if(record + prefetch_distance < end) {
+            __builtin_prefetch(record + prefetch_distance);
+        }
+#endif
+        unsigned int instance = 0;
+        if(instances) {
+            instance = field(record, instance_offset);
+        }
+        const unsigned int id = field(record, trigger_offset);
+        Fsm * fsm = instance < m_instances.size() ? m_instances[instance] : nullptr;
+        Event * trigger = id < m_events.size() ? m_events[id] : nullptr;
+        if(trigger == nullptr && fsm) {
+            trigger = find_event(id);
+        }
+        if(fsm == nullptr || trigger == nullptr) {
+            m_skipped++;
+            continue;
+        }
+        fsm->execute(trigger);
+        m_executed++;
+    }
+    return Fsm_Success;
+}
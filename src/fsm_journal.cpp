@@ -0,0 +1,333 @@
+/**
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2015 Eric Halère
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+#include "../include/fsm_journal.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace {
+
+    // On-disk record header, followed by `size` payload bytes.
+    struct RecordHeader {
+        uint32_t kind;
+        uint32_t instance;
+        uint32_t id;
+        uint32_t size;
+        uint32_t checksum;
+    };
+
+    // FNV-1a, over the header (without checksum) and the payload.
+    uint32_t checksum(const RecordHeader & header, const char * payload) {
+        uint32_t hash = 2166136261u;
+        const unsigned char * bytes = reinterpret_cast<const unsigned char *>(&header);
+        for(size_t i = 0; i < offsetof(RecordHeader, checksum); i++) {
+            hash = (hash ^ bytes[i]) * 16777619u;
+        }
+        for(uint32_t i = 0; i < header.size; i++) {
+            hash = (hash ^ static_cast<unsigned char>(payload[i])) * 16777619u;
+        }
+        return hash;
+    }
+
+    // Returns the end of the record at offset, 0 if it is torn or corrupted.
+    size_t record_end(const std::string & data, size_t offset) {
+        if(offset + sizeof(RecordHeader) > data.size()) return 0;
+        RecordHeader header;
+        memcpy(&header, data.data() + offset, sizeof(header));
+        const size_t next = offset + sizeof(header) + header.size;
+        if(next > data.size() || checksum(header, data.data() + offset + sizeof(header)) != header.checksum) {
+            return 0;
+        }
+        return next;
+    }
+
+    // Reads the whole file from the start.
+    bool read_all(int fd, std::string & data) {
+        char chunk[65536];
+        ssize_t count;
+        while((count = ::pread(fd, chunk, sizeof(chunk), static_cast<off_t>(data.size()))) != 0) {
+            if(count < 0) {
+                if(errno == EINTR) continue;
+                return false;
+            }
+            data.append(chunk, static_cast<size_t>(count));
+        }
+        return true;
+    }
+
+    // IDs below this have an entry in the table of the triggers of a
+    // replayed instance, the others are looked up each time (the IDs come
+    // from the file).
+    const unsigned int dense_ids = 1u << 20;
+
+} // end anonymous namespace
+
+// Journal class implementation
+
+FSM::Journal::Journal() : m_fd(-1), m_sync(Journal_SyncOnFlush), m_batch(1), m_pending(0), m_failed(false), m_encoder(nullptr) {
+}
+
+FSM::Journal::~Journal() {
+    close();
+}
+
+FSM::Fsm_Errors FSM::Journal::open(const std::string & path, Journal_Sync sync, size_t batch) {
+    close();
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+    m_sync = sync;
+    m_batch = (sync == Journal_SyncEveryRecord || batch == 0) ? 1 : batch;
+    m_failed = (m_fd < 0);
+    if(m_failed) return Fsm_IOError;
+
+    // Drop a record torn by a crash: the records appended after it would
+    // not be replayed.
+    std::string data;
+    size_t end = 0;
+    size_t next;
+    m_failed = not read_all(m_fd, data);
+    while(not m_failed && (next = record_end(data, end)) != 0) {
+        end = next;
+    }
+    if(not m_failed && end < data.size()) {
+        m_failed = ::ftruncate(m_fd, static_cast<off_t>(end)) != 0 || ::fsync(m_fd) != 0;
+    }
+    if(m_failed) {
+        ::close(m_fd);
+        m_fd = -1;
+    }
+    return m_failed ? Fsm_IOError : Fsm_Success;
+}
+
+FSM::Fsm_Errors FSM::Journal::close() {
+    Fsm_Errors err_code = flush();
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if(m_fd >= 0) {
+        if(::close(m_fd) != 0) err_code = Fsm_IOError;
+        m_fd = -1;
+    }
+    return err_code;
+}
+
+FSM::Fsm_Errors FSM::Journal::flush() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if(m_fd >= 0) write_pending();
+    return m_failed ? Fsm_IOError : Fsm_Success;
+}
+
+void FSM::Journal::setEncoder(encodeFn iFn) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_encoder = iFn;
+}
+
+FSM::journalFn FSM::Journal::recorder(unsigned int instance) {
+    return [this, instance](Fsm_JournalKind kind, Event * trigger) {
+        append(kind, instance, trigger ? trigger->getID() : 0, trigger);
+    };
+}
+
+FSM::Fsm_Errors FSM::Journal::snapshot(unsigned int instance, const Fsm & fsm) {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if(m_fd < 0) return Fsm_IOError;
+        // The deferred triggers and the triggers queued by an asynchronous
+        // action are not recorded, so the machine must have none.
+        if(fsm.deferred_count() != 0) return Fsm_Deferred;
+        if(fsm.is_transitioning()) return Fsm_Transitioning;
+        // The payload of a snapshot is the initialized flag, then the
+        // history slots (see Fsm::history()).
+        m_payload.assign(1, fsm.is_initialized() ? 1 : 0);
+        const std::vector<unsigned int> history = fsm.history();
+        m_payload.append(reinterpret_cast<const char *>(history.data()), history.size() * sizeof(unsigned int));
+        append_record(Journal_Snapshot, instance, fsm.state()->getID());
+    }
+    return flush();
+}
+
+void FSM::Journal::append(Fsm_JournalKind kind, unsigned int instance, unsigned int id, Event * trigger) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if(m_fd < 0) return;
+    m_payload.clear();
+    if(trigger && m_encoder) {
+        m_encoder(trigger, m_payload);
+    }
+    append_record(kind, instance, id);
+}
+
+void FSM::Journal::append_record(Fsm_JournalKind kind, unsigned int instance, unsigned int id) {
+    RecordHeader header;
+    header.kind = kind;
+    header.instance = instance;
+    header.id = id;
+    header.size = static_cast<uint32_t>(m_payload.size());
+    header.checksum = checksum(header, m_payload.data());
+
+    m_buffer.append(reinterpret_cast<const char *>(&header), sizeof(header));
+    m_buffer.append(m_payload);
+    if(++m_pending >= m_batch) {
+        write_pending();
+    }
+}
+
+bool FSM::Journal::write_pending() {
+    size_t done = 0;
+    while(done < m_buffer.size()) {
+        ssize_t written = ::write(m_fd, m_buffer.data() + done, m_buffer.size() - done);
+        if(written < 0) {
+            if(errno == EINTR) continue;
+            m_failed = true;
+            break;
+        }
+        done += static_cast<size_t>(written);
+    }
+    bool sync = m_pending > 0 && m_sync != Journal_SyncNever;
+    m_buffer.clear();
+    m_pending = 0;
+    if(sync && ::fsync(m_fd) != 0) {
+        m_failed = true;
+    }
+    return not m_failed;
+}
+
+// Replayer class implementation
+
+FSM::Replayer::Replayer() : m_instances(), m_decoder(nullptr), m_replayed(0) {
+}
+
+void FSM::Replayer::add_instance(unsigned int instance, Fsm * fsm) {
+    Target target = { fsm, std::vector<Event *>(), 0 };
+    m_instances[instance] = target;
+}
+
+void FSM::Replayer::setDecoder(decodeFn iFn) {
+    m_decoder = iFn;
+}
+
+FSM::Event * FSM::Replayer::find_event(Target & target, unsigned int id) {
+    if(id >= dense_ids) {
+        return target.fsm->find_event(id);
+    }
+    if(id >= target.events.size()) {
+        target.events.resize(id + 1, nullptr);
+    }
+    if(target.events[id] == nullptr) {
+        target.events[id] = target.fsm->find_event(id);
+    }
+    return target.events[id];
+}
+
+FSM::Fsm_Errors FSM::Replayer::replay(const std::string & path, bool with_actions) {
+    m_replayed = 0;
+    for(auto& elem : m_instances) {
+        elem.second.start = 0;
+    }
+
+    // Read the whole journal.
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if(fd < 0) {
+        return Fsm_IOError;
+    }
+    std::string data;
+    const bool read = read_all(fd, data);
+    ::close(fd);
+    if(not read) {
+        return Fsm_IOError;
+    }
+
+    // First pass: validate the records and find the last snapshot of each
+    // instance. A torn or corrupted record ends the journal.
+    size_t end = 0;
+    for(size_t next; (next = record_end(data, end)) != 0; end = next) {
+        RecordHeader header;
+        memcpy(&header, data.data() + end, sizeof(header));
+        if(header.kind == Journal_Snapshot) {
+            auto it = m_instances.find(header.instance);
+            if(it != m_instances.end()) it->second.start = end;
+        }
+    }
+
+    // Second pass: apply the records.
+    size_t offset = 0;
+    while(offset < end) {
+        RecordHeader header;
+        memcpy(&header, data.data() + offset, sizeof(header));
+        const char * payload = data.data() + offset + sizeof(header);
+        const size_t record = offset;
+        offset += sizeof(header) + header.size;
+
+        auto it = m_instances.find(header.instance);
+        if(it == m_instances.end() || record < it->second.start) continue;
+        Target & target = it->second;
+
+        Fsm_Errors err_code = Fsm_Success;
+        switch(header.kind) {
+            case Journal_Event: {
+                Event * trigger = find_event(target, header.id);
+                if(trigger == nullptr) return Fsm_UnknownId;
+                if(header.size > 0 && m_decoder) {
+                    trigger = m_decoder(trigger, payload, header.size);
+                }
+                target.fsm->replay(trigger, with_actions);
+                break;
+            }
+            case Journal_Init:
+                if(not target.fsm->is_initialized()) {
+                    err_code = target.fsm->restore(Fsm::Fsm_Initial->getID(), true);
+                }
+                break;
+            case Journal_Reset:
+                target.fsm->discard_pending();
+                err_code = target.fsm->restore(Fsm::Fsm_Initial->getID(), false);
+                if(err_code == Fsm_Success) {
+                    err_code = target.fsm->restore_history(std::vector<unsigned int>());
+                }
+                break;
+            case Journal_Snapshot: {
+                target.fsm->discard_pending();
+                err_code = target.fsm->restore(header.id, header.size > 0 && payload[0] != 0);
+                std::vector<unsigned int> history(header.size > 0 ? (header.size - 1) / sizeof(unsigned int) : 0);
+                if(not history.empty()) {
+                    memcpy(history.data(), payload + 1, history.size() * sizeof(unsigned int));
+                }
+                if(err_code == Fsm_Success) {
+                    err_code = target.fsm->restore_history(history);
+                }
+                break;
+            }
+            default:
+                return Fsm_IOError;
+        }
+        if(err_code != Fsm_Success) {
+            return err_code;
+        }
+        m_replayed++;
+    }
+
+    return Fsm_Success;
+}
@@ -0,0 +1,222 @@
+/**
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2015 Eric Halère
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+#include "../include/fsm_parallel.h"
+#include <algorithm>
+#include <thread>
+
+// A chunk of the stream, and the runs through it.
+struct FSM::ParallelRunner::Chunk {
+    // Events [first, last) of the stream.
+    size_t first;
+    size_t last;
+    // The run from the i-th start state ends in active[slot[i]]; runs that
+    // meet share their slot.
+    std::vector<index_t> slot;
+    std::vector<index_t> active;
+    // The actual start state, once known.
+    index_t start;
+};
+
+FSM::ParallelRunner::ParallelRunner(std::shared_ptr<const Definition> def, unsigned int threads)
+    : m_def(def), m_threads(threads ? threads : std::max(1u, std::thread::hardware_concurrency())), m_min_chunk(4096), m_supported(true), m_columns(def->class_count() + 1), m_next()
+{
+    const Definition & d = *m_def;
+    for(index_t r = 0; r < d.row_count(); r++) {
+        if(d.row(r).guard != Definition::npos) {
+            m_supported = false;
+            return;
+        }
+    }
+    // Without guards, the first candidate row is taken.
+    const index_t completion = d.completion_class();
+    m_next.resize(static_cast<size_t>(d.state_count()) * m_columns);
+    for(index_t s = 0; s < d.state_count(); s++) {
+        for(index_t c = 0; c < m_columns; c++) {
+            index_t first = 0, last = 0;
+            if(c != m_columns - 1) {
+                d.candidates(s, c, first, last);
+                if(first == last) d.fallbacks(s, c, first, last);
+            }
+            index_t to = first != last ? d.row(first).to : s;
+            for(unsigned int step = 0; first != last && completion != Definition::npos && step < 64; step++) {
+                d.candidates(to, completion, first, last);
+                if(first != last) to = d.row(first).to;
+            }
+            m_next[static_cast<size_t>(s) * m_columns + c] = to;
+        }
+    }
+}
+
+FSM::ParallelRunner::index_t FSM::ParallelRunner::follow(index_t state, Event * const * events, size_t first, size_t last, State ** states) const {
+    const index_t * next = m_next.data();
+    if(states == nullptr) {
+        for(size_t i = first; i != last; i++) {
+            state = next[static_cast<size_t>(state) * m_columns + column(events[i])];
+        }
+        return state;
+    }
+    for(size_t i = first; i != last; i++) {
+        state = next[static_cast<size_t>(state) * m_columns + column(events[i])];
+        states[i] = m_def->state(state);
+    }
+    return state;
+}
+
+void FSM::ParallelRunner::simulate(Chunk & chunk, Event * const * events) const {
+    const index_t * next = m_next.data();
+    std::vector<index_t> & active = chunk.active;
+    std::vector<index_t> seen(m_def->state_count(), Definition::npos);
+    std::vector<index_t> merged;
+    std::vector<index_t> remap;
+    index_t columns[64];
+    size_t e = chunk.first;
+    while(e != chunk.last && active.size() > 1) {
+        // A block of events for all the runs, then merge the runs that are
+        // in the same state.
+        const size_t count = std::min<size_t>(64, chunk.last - e);
+        for(size_t i = 0; i < count; i++) {
+            columns[i] = column(events[e + i]);
+        }
+        e += count;
+        for(size_t i = 0; i < count; i++) {
+            for(index_t & state : active) {
+                state = next[static_cast<size_t>(state) * m_columns + columns[i]];
+            }
+        }
+        merged.clear();
+        remap.resize(active.size());
+        for(size_t k = 0; k < active.size(); k++) {
+            index_t & j = seen[active[k]];
+            if(j == Definition::npos) {
+                j = static_cast<index_t>(merged.size());
+                merged.push_back(active[k]);
+            }
+            remap[k] = j;
+        }
+        for(index_t state : merged) {
+            seen[state] = Definition::npos;
+        }
+        if(merged.size() != active.size()) {
+            for(index_t & j : chunk.slot) {
+                j = remap[j];
+            }
+            active.swap(merged);
+        }
+    }
+    if(active.size() == 1) {
+        active[0] = follow(active[0], events, e, chunk.last, nullptr);
+    }
+}
+
+std::vector<FSM::ParallelRunner::index_t> FSM::ParallelRunner::reachable(index_t start) const {
+    std::vector<bool> seen(m_def->state_count(), false);
+    std::vector<index_t> states(1, start);
+    seen[start] = true;
+    for(size_t i = 0; i < states.size(); i++) {
+        const index_t * row = &m_next[static_cast<size_t>(states[i]) * m_columns];
+        for(index_t c = 0; c < m_columns; c++) {
+            if(not seen[row[c]]) {
+                seen[row[c]] = true;
+                states.push_back(row[c]);
+            }
+        }
+    }
+    return states;
+}
+
+FSM::Fsm_Errors FSM::ParallelRunner::run(Event * const * events, size_t count, State * start, State *& end, State ** states) const {
+    if(not m_supported) {
+        return Fsm_Unsupported;
+    }
+    const index_t first_state = m_def->state_index(start->getID());
+    if(first_state == Definition::npos) {
+        return Fsm_UnknownId;
+    }
+    const size_t chunk_count = std::min<size_t>(m_threads, std::max<size_t>(1, count / m_min_chunk));
+    if(chunk_count <= 1) {
+        end = m_def->state(follow(first_state, events, 0, count, states));
+        return Fsm_Success;
+    }
+
+    // Run the chunks, the first one from the start state, the others from
+    // all the states it can reach.
+    const std::vector<index_t> starts = reachable(first_state);
+    std::vector<Chunk> chunks(chunk_count);
+    for(size_t i = 0; i < chunk_count; i++) {
+        Chunk & chunk = chunks[i];
+        chunk.first = count * i / chunk_count;
+        chunk.last = count * (i + 1) / chunk_count;
+        chunk.start = first_state;
+        if(i != 0) {
+            chunk.active = starts;
+            chunk.slot.resize(starts.size());
+            for(size_t j = 0; j < starts.size(); j++) chunk.slot[j] = static_cast<index_t>(j);
+        }
+    }
+    std::vector<std::thread> threads;
+    for(size_t i = 1; i < chunk_count; i++) {
+        threads.push_back(std::thread([this, &chunks, events, i]() { simulate(chunks[i], events); }));
+    }
+    chunks[0].active.assign(1, follow(first_state, events, chunks[0].first, chunks[0].last, states));
+    for(auto& thread : threads) thread.join();
+    threads.clear();
+
+    // Stitch: the end state of a chunk is the start state of the next.
+    std::vector<index_t> position(m_def->state_count(), Definition::npos);
+    for(size_t j = 0; j < starts.size(); j++) {
+        position[starts[j]] = static_cast<index_t>(j);
+    }
+    index_t state = chunks[0].active[0];
+    for(size_t i = 1; i < chunk_count; i++) {
+        assert(position[state] != Definition::npos);
+        chunks[i].start = state;
+        state = chunks[i].active[chunks[i].slot[position[state]]];
+    }
+    end = m_def->state(state);
+
+    // Record the states of the other chunks, now that their start is known.
+    if(states != nullptr) {
+        for(size_t i = 1; i < chunk_count; i++) {
+            threads.push_back(std::thread([this, &chunks, events, states, i]() {
+                follow(chunks[i].start, events, chunks[i].first, chunks[i].last, states);
+            }));
+        }
+        for(auto& thread : threads) thread.join();
+    }
+    return Fsm_Success;
+}
+
+FSM::Fsm_Errors FSM::ParallelRunner::run(Fsm & fsm, Event * const * events, size_t count, State ** states) const {
+    if(not fsm.is_initialized()) {
+        return Fsm_NotInitialized;
+    }
+    State * end = nullptr;
+    const Fsm_Errors err_code = run(events, count, fsm.state(), end, states);
+    if(err_code != Fsm_Success) {
+        return err_code;
+    }
+    return fsm.restore(end->getID(), true);
+}
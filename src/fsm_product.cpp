@@ -0,0 +1,455 @@
+/**
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2015 Eric Halère
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+#include "../include/fsm_product.h"
+#include <algorithm>
+#include <map>
+
+namespace {
+
+    using index_t = FSM::Definition::index_t;
+
+    // An action of a component, and whether it is eventless (it then gets
+    // Fsm_Completion as trigger).
+    using Step = std::pair<index_t, bool>;
+
+    // The transitions of a component, by state and column: the columns are
+    // the classes, then one for the triggers without class.
+    struct Component {
+        const FSM::Definition * def;
+        index_t columns;
+        std::vector<index_t> next;
+        std::vector<std::vector<Step> > actions;
+        // Whether a state has no transition.
+        std::vector<bool> terminal;
+
+        explicit Component(const FSM::Definition & d) : def(&d), columns(d.class_count() + 1), next(), actions(), terminal()
+        {
+            const size_t cells = static_cast<size_t>(d.state_count()) * columns;
+            next.resize(cells);
+            actions.resize(cells);
+            terminal.assign(d.state_count(), true);
+            const index_t completion = d.completion_class();
+            for(index_t s = 0; s < d.state_count(); s++) {
+                for(index_t c = 0; c < columns; c++) {
+                    const size_t cell = static_cast<size_t>(s) * columns + c;
+                    index_t first = 0, last = 0;
+                    if(c != columns - 1) {
+                        d.candidates(s, c, first, last);
+                        if(first == last) d.fallbacks(s, c, first, last);
+                    }
+                    next[cell] = s;
+                    if(first == last) continue;
+                    terminal[s] = false;
+                    index_t to = s;
+                    bool eventless = c == completion;
+                    // The transition, then the eventless transitions it
+                    // leads to (up to 64 in a row, as Fsm does).
+                    for(unsigned int step = 0; first != last && step <= 64; step++) {
+                        const FSM::Definition::Row & row = d.row(first);
+                        if(row.action != FSM::Definition::npos) {
+                            actions[cell].push_back(Step(row.action, eventless));
+                        }
+                        to = row.to;
+                        eventless = true;
+                        first = last = 0;
+                        if(completion != FSM::Definition::npos) {
+                            d.candidates(to, completion, first, last);
+                        }
+                    }
+                    next[cell] = to;
+                }
+            }
+        }
+
+        index_t column(index_t cls) const
+        {
+            return cls == FSM::Definition::npos ? columns - 1 : cls;
+        }
+    };
+
+    // Calls the actions of the components, in order.
+    struct ProductAction {
+        std::vector<std::pair<FSM::actionFn, bool> > actions;
+        void operator()(FSM::Event * trigger) const
+        {
+            for(auto& action : actions) {
+                action.first(action.second ? FSM::Fsm::Fsm_Completion : trigger);
+            }
+        }
+    };
+
+    // The triggers of the components, grouped by their column in each one.
+    // The triggers of no component form the last group, taken on
+    // Fsm_AnyTrigger, if a component has transitions on it.
+    struct Alphabet {
+        std::vector<std::vector<index_t> > keys;
+        std::vector<std::vector<FSM::Event *> > triggers;
+        bool any_trigger;
+
+        Alphabet(const std::vector<std::shared_ptr<const FSM::Definition> > & components,
+                 const std::vector<Component> & tables) : keys(), triggers(), any_trigger(false)
+        {
+            const size_t n = components.size();
+            std::map<std::vector<index_t>, std::vector<FSM::Event *> > groups;
+            std::map<unsigned int, bool> seen;
+            for(auto& def : components) {
+                for(index_t t = 0; t < def->trigger_count(); t++) {
+                    FSM::Event * trigger = def->trigger(t);
+                    if(trigger == FSM::Fsm::Fsm_AnyTrigger || trigger == FSM::Fsm::Fsm_Completion) continue;
+                    if(not seen.insert(std::make_pair(trigger->getID(), true)).second) continue;
+                    std::vector<index_t> key(n);
+                    for(size_t k = 0; k < n; k++) {
+                        key[k] = tables[k].column(components[k]->class_by_id(trigger->getID()));
+                    }
+                    groups[key].push_back(trigger);
+                }
+            }
+            for(auto& group : groups) {
+                keys.push_back(group.first);
+                triggers.push_back(group.second);
+            }
+            std::vector<index_t> other(n);
+            for(size_t k = 0; k < n; k++) {
+                other[k] = tables[k].column(components[k]->any_class());
+                any_trigger = any_trigger || components[k]->any_class() != FSM::Definition::npos;
+            }
+            if(any_trigger) {
+                keys.push_back(other);
+                triggers.push_back(std::vector<FSM::Event *>(1, FSM::Fsm::Fsm_AnyTrigger));
+            }
+        }
+    };
+
+    // Computes in `to` the product state that the group `key` leads to from
+    // `from`, and the actions on the way. Returns whether a component
+    // changes state.
+    bool step(const std::vector<std::shared_ptr<const FSM::Definition> > & components,
+              const std::vector<Component> & tables,
+              const index_t * from, const std::vector<index_t> & key,
+              std::vector<index_t> & to, ProductAction & action)
+    {
+        bool changed = false;
+        for(size_t k = 0; k < components.size(); k++) {
+            const index_t s = from[k];
+            to[k] = s;
+            if(tables[k].terminal[s]) continue;
+            const size_t cell = static_cast<size_t>(s) * tables[k].columns + key[k];
+            to[k] = tables[k].next[cell];
+            changed = changed || to[k] != s;
+            for(const Step & step : tables[k].actions[cell]) {
+                action.actions.push_back(std::make_pair(components[k]->action(step.first), step.second));
+            }
+        }
+        return changed;
+    }
+
+    // Returns Fsm_Unsupported if a definition has a guard.
+    FSM::Fsm_Errors make_tables(const std::vector<std::shared_ptr<const FSM::Definition> > & components,
+                                std::vector<Component> & tables)
+    {
+        for(auto& def : components) {
+            for(index_t r = 0; r < def->row_count(); r++) {
+                if(def->row(r).guard != FSM::Definition::npos) return FSM::Fsm_Unsupported;
+            }
+            tables.push_back(Component(*def));
+        }
+        return FSM::Fsm_Success;
+    }
+
+} // end anonymous namespace
+
+FSM::Fsm_Errors FSM::Product::build(const std::vector<std::shared_ptr<const Definition> > & components,
+                                    std::shared_ptr<const Product> & product,
+                                    size_t max_states) {
+    const size_t n = components.size();
+    if(n == 0) {
+        return Fsm_Unsupported;
+    }
+    std::vector<Component> tables;
+    if(make_tables(components, tables) != Fsm_Success) {
+        return Fsm_Unsupported;
+    }
+    const Alphabet alphabet(components, tables);
+    const std::vector<std::vector<index_t> > & keys = alphabet.keys;
+    const bool any_trigger = alphabet.any_trigger;
+    std::vector<std::shared_ptr<const TriggerSet> > sets;
+    std::vector<Event *> singles;
+    for(auto& group : alphabet.triggers) {
+        singles.push_back(group.size() == 1 ? group[0] : nullptr);
+        sets.push_back(group.size() == 1 ? nullptr : std::make_shared<const TriggerSet>(group.begin(), group.end()));
+    }
+
+    // Enumerate the reachable product states, from the initial states.
+    std::shared_ptr<Product> result(new Product());
+    result->m_components = components;
+    std::vector<index_t> & tuples = result->m_tuples;
+    std::map<std::vector<index_t>, index_t> index;
+    std::vector<index_t> tuple(n, 0);
+    tuples.insert(tuples.end(), tuple.begin(), tuple.end());
+    index[tuple] = 0;
+    struct Edge {
+        index_t from;
+        index_t to;
+        size_t key;
+        ProductAction action;
+    };
+    std::vector<Edge> edges;
+    for(index_t p = 0; p < tuples.size() / n; p++) {
+        for(size_t g = 0; g < keys.size(); g++) {
+            Edge edge = { p, p, g, ProductAction() };
+            const bool changed = step(components, tables, &tuples[static_cast<size_t>(p) * n], keys[g], tuple, edge.action);
+            // Without change, a transition is only needed so that the
+            // trigger does not fall back to Fsm_AnyTrigger.
+            if(not changed && edge.action.actions.empty() && not any_trigger) continue;
+            auto it = index.find(tuple);
+            if(it == index.end()) {
+                if(index.size() == max_states) return Fsm_StateLimit;
+                it = index.insert(std::make_pair(tuple, static_cast<index_t>(index.size()))).first;
+                tuples.insert(tuples.end(), tuple.begin(), tuple.end());
+            }
+            edge.to = it->second;
+            edges.push_back(edge);
+        }
+    }
+
+    // The states of the product, and its transitions.
+    const size_t count = tuples.size() / n;
+    for(size_t p = 0; p < count; p++) {
+        bool final = true;
+        for(size_t k = 0; k < n; k++) {
+            final = final && tuples[p * n + k] == 1;
+        }
+        if(p == 0) {
+            result->m_states.push_back(Fsm::Fsm_Initial);
+        } else if(final) {
+            result->m_final = static_cast<index_t>(p);
+            result->m_states.push_back(Fsm::Fsm_Final);
+        } else {
+            result->m_owned.push_back(std::unique_ptr<State>(new State()));
+            result->m_states.push_back(result->m_owned.back().get());
+        }
+    }
+    if(not result->m_owned.empty()) {
+        unsigned int low = result->m_owned.front()->getID(), high = low;
+        for(auto& state : result->m_owned) {
+            low = std::min(low, state->getID());
+            high = std::max(high, state->getID());
+        }
+        result->m_base = low;
+        result->m_tuple_of.assign(high - low + 1, Definition::npos);
+        for(size_t p = 0; p < count; p++) {
+            State * state = result->m_states[p];
+            if(state != Fsm::Fsm_Initial && state != Fsm::Fsm_Final) {
+                result->m_tuple_of[state->getID() - low] = static_cast<index_t>(p);
+            }
+        }
+    }
+    std::vector<Trans> transitions;
+    for(auto& edge : edges) {
+        actionFn action = nullptr;
+        if(edge.action.actions.size() == 1 && not edge.action.actions[0].second) {
+            action = edge.action.actions[0].first;
+        } else if(not edge.action.actions.empty()) {
+            action = edge.action;
+        }
+        transitions.push_back({ result->m_states[edge.from], result->m_states[edge.to], singles[edge.key], nullptr, action, sets[edge.key] });
+    }
+    result->m_def = Definition::build(transitions);
+    product = result;
+    return Fsm_Success;
+}
+
+FSM::State * FSM::Product::component_state(State * state, size_t k) const {
+    assert(k < m_components.size());
+    index_t p = Definition::npos;
+    if(state == Fsm::Fsm_Initial) {
+        p = 0;
+    } else if(state == Fsm::Fsm_Final) {
+        p = m_final;
+    } else if(state->getID() - m_base < m_tuple_of.size()) {
+        p = m_tuple_of[state->getID() - m_base];
+    }
+    if(p == Definition::npos) {
+        return nullptr;
+    }
+    return m_components[k]->state(m_tuples[static_cast<size_t>(p) * m_components.size() + k]);
+}
+
+struct FSM::LazyProduct::Tables {
+    std::vector<Component> components;
+    std::vector<std::vector<index_t> > keys;
+    bool any_trigger;
+};
+
+FSM::Fsm_Errors FSM::LazyProduct::build(const std::vector<std::shared_ptr<const Definition> > & components,
+                                        std::unique_ptr<LazyProduct> & product,
+                                        size_t capacity,
+                                        Policy policy) {
+    if(components.empty() || capacity < 2) {
+        return Fsm_Unsupported;
+    }
+    std::shared_ptr<Tables> tables = std::make_shared<Tables>();
+    if(make_tables(components, tables->components) != Fsm_Success) {
+        return Fsm_Unsupported;
+    }
+    const Alphabet alphabet(components, tables->components);
+    tables->keys = alphabet.keys;
+    tables->any_trigger = alphabet.any_trigger;
+
+    std::unique_ptr<LazyProduct> result(new LazyProduct());
+    result->m_components = components;
+    result->m_tables = tables;
+    result->m_capacity = capacity;
+    result->m_policy = policy;
+    result->m_group_count = static_cast<index_t>(alphabet.keys.size());
+    unsigned int low = 0, high = 0;
+    bool first = true;
+    for(auto& group : alphabet.triggers) {
+        for(Event * trigger : group) {
+            if(trigger == Fsm::Fsm_AnyTrigger) continue;
+            low = first ? trigger->getID() : std::min(low, trigger->getID());
+            high = first ? trigger->getID() : std::max(high, trigger->getID());
+            first = false;
+        }
+    }
+    if(not first) {
+        result->m_trigger_base = low;
+        result->m_group_of.assign(high - low + 1, alphabet.any_trigger ? result->m_group_count - 1 : Definition::npos);
+    }
+    for(index_t g = 0; g < alphabet.triggers.size(); g++) {
+        for(Event * trigger : alphabet.triggers[g]) {
+            if(trigger == Fsm::Fsm_AnyTrigger) continue;
+            result->m_group_of[trigger->getID() - low] = g;
+        }
+    }
+    if(alphabet.any_trigger) {
+        result->m_other = result->m_group_count - 1;
+    }
+    const size_t n = components.size();
+    result->m_tuples.resize(capacity * n);
+    result->m_edges.resize(capacity * result->m_group_count);
+    result->m_generation.assign(capacity, 0);
+    result->m_referenced.assign(capacity, false);
+    result->reset();
+    product = std::move(result);
+    return Fsm_Success;
+}
+
+void FSM::LazyProduct::reset() {
+    const std::vector<index_t> initial(m_components.size(), 0);
+    auto it = m_index.find(initial);
+    m_current = it != m_index.end() ? it->second : insert(initial);
+    m_referenced[m_current] = true;
+}
+
+FSM::State * FSM::LazyProduct::component_state(size_t k) const {
+    assert(k < m_components.size());
+    return m_components[k]->state(m_tuples[static_cast<size_t>(m_current) * m_components.size() + k]);
+}
+
+bool FSM::LazyProduct::is_final() const {
+    const size_t n = m_components.size();
+    for(size_t k = 0; k < n; k++) {
+        if(m_tuples[static_cast<size_t>(m_current) * n + k] != 1) return false;
+    }
+    return true;
+}
+
+FSM::LazyProduct::index_t FSM::LazyProduct::expand(index_t group) {
+    m_misses++;
+    const size_t n = m_components.size();
+    const Tables & tables = *m_tables;
+    std::vector<index_t> tuple(n);
+    ProductAction action;
+    const bool changed = step(m_components, tables.components, &m_tuples[static_cast<size_t>(m_current) * n], tables.keys[group], tuple, action);
+    auto it = m_index.find(tuple);
+    // The insertion can flush the cache, and move the current state.
+    const index_t to = it != m_index.end() ? it->second : insert(tuple);
+    Edge & edge = m_edges[static_cast<size_t>(m_current) * m_group_count + group];
+    edge.to = to;
+    edge.generation = m_generation[to];
+    // As in Product, a trigger that changes nothing only matches if it
+    // would otherwise be taken by Fsm_AnyTrigger.
+    edge.matched = changed || not action.actions.empty() || tables.any_trigger;
+    if(action.actions.size() == 1 && not action.actions[0].second) {
+        edge.action = action.actions[0].first;
+    } else if(not action.actions.empty()) {
+        edge.action = action;
+    } else {
+        edge.action = nullptr;
+    }
+    return to;
+}
+
+FSM::LazyProduct::index_t FSM::LazyProduct::insert(const std::vector<index_t> & tuple) {
+    const index_t slot = allocate();
+    const size_t n = m_components.size();
+    std::copy(tuple.begin(), tuple.end(), m_tuples.begin() + static_cast<size_t>(slot) * n);
+    for(index_t g = 0; g < m_group_count; g++) {
+        Edge & edge = m_edges[static_cast<size_t>(slot) * m_group_count + g];
+        edge.to = Definition::npos;
+        edge.action = nullptr;
+    }
+    m_referenced[slot] = false;
+    m_index[tuple] = slot;
+    return slot;
+}
+
+FSM::LazyProduct::index_t FSM::LazyProduct::allocate() {
+    if(m_used < m_capacity) {
+        return m_used++;
+    }
+    const size_t n = m_components.size();
+    if(m_policy == Cache_Flush) {
+        // Start over with the current state alone.
+        const std::vector<index_t> current(m_tuples.begin() + static_cast<size_t>(m_current) * n,
+                                           m_tuples.begin() + static_cast<size_t>(m_current + 1) * n);
+        m_flushes++;
+        m_index.clear();
+        for(index_t slot = 0; slot < m_used; slot++) {
+            m_generation[slot]++;
+        }
+        m_used = 0;
+        m_current = insert(current);
+        m_referenced[m_current] = true;
+        return m_used++;
+    }
+    // Clock: a slot visited since the last pass gets a second chance.
+    for(;;) {
+        const index_t slot = m_hand;
+        m_hand = (m_hand + 1) % m_used;
+        if(slot == m_current) continue;
+        if(m_referenced[slot]) {
+            m_referenced[slot] = false;
+            continue;
+        }
+        m_evictions++;
+        m_generation[slot]++;
+        m_index.erase(std::vector<index_t>(m_tuples.begin() + static_cast<size_t>(slot) * n,
+                                           m_tuples.begin() + static_cast<size_t>(slot + 1) * n));
+        return slot;
+    }
+}
@@ -0,0 +1,211 @@
+/**
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2015 Eric Halère
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+#include "../include/fsm_reload.h"
+#include "../include/fsm_dsl.h"
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+FSM::DefinitionLoader::DefinitionLoader(const std::string & path, const Registry & registry, std::shared_ptr<DefinitionSlot> slot) : m_path(path), m_registry(registry), m_mutex(), m_slot(slot), m_renamed(), m_fallback(), m_report_fn(nullptr), m_reloads(0), m_failures(0), m_inotify(-1), m_wake(), m_watcher() {
+    m_wake[0] = m_wake[1] = -1;
+}
+
+FSM::DefinitionLoader::~DefinitionLoader() {
+    stop();
+}
+
+void FSM::DefinitionLoader::map_state(const std::string & from, const std::string & to) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_renamed[from] = to;
+}
+
+void FSM::DefinitionLoader::set_fallback_state(const std::string & name) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_fallback = name;
+}
+
+void FSM::DefinitionLoader::set_report_fn(reportFn fn) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_report_fn = fn;
+}
+
+std::shared_ptr<FSM::DefinitionSlot> FSM::DefinitionLoader::slot() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_slot;
+}
+
+FSM::Fsm_Errors FSM::DefinitionLoader::build(std::shared_ptr<const Definition> & def, std::shared_ptr<const StateMapping> & mapping, std::string & error) {
+    Description description;
+    Fsm_Errors err = load_description(m_path, description, error);
+    if(err != Fsm_Success) {
+        return err;
+    }
+    std::vector<Trans> transitions;
+    err = bind_description(description, m_registry, transitions, error);
+    if(err != Fsm_Success) {
+        return err;
+    }
+    // A transition from Fsm_AnyState is not taken from Fsm_Initial.
+    bool initial = false;
+    for(auto& transition : transitions) {
+        initial = initial || transition.from_state == Fsm::Fsm_Initial;
+    }
+    if(not initial) {
+        error = m_path + ": no transition from Fsm_Initial";
+        return Fsm_Unsupported;
+    }
+
+    Fsm builder;
+    builder.add_transitions(transitions);
+    builder.freeze();
+    std::shared_ptr<const Definition> built = builder.definition();
+
+    // The machines are moved to states of the new definition only.
+    std::shared_ptr<StateMapping> states = std::make_shared<StateMapping>();
+    for(auto& renamed : m_renamed) {
+        State * from = m_registry.state(renamed.first);
+        State * to = m_registry.state(renamed.second);
+        if(from == nullptr || to == nullptr) {
+            error = "'" + (from == nullptr ? renamed.first : renamed.second) + "' is not registered";
+            return Fsm_UnknownId;
+        }
+        if(built->state_index(to->getID()) == Definition::npos) {
+            error = m_path + ": no state '" + renamed.second + "'";
+            return Fsm_UnknownId;
+        }
+        states->states[from->getID()] = to;
+    }
+    if(not m_fallback.empty()) {
+        states->fallback = m_registry.state(m_fallback);
+        if(states->fallback == nullptr) {
+            error = "'" + m_fallback + "' is not registered";
+            return Fsm_UnknownId;
+        }
+        if(built->state_index(states->fallback->getID()) == Definition::npos) {
+            error = m_path + ": no state '" + m_fallback + "'";
+            return Fsm_UnknownId;
+        }
+    }
+
+    def = built;
+    mapping = states;
+    return Fsm_Success;
+}
+
+FSM::Fsm_Errors FSM::DefinitionLoader::reload() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    std::shared_ptr<const Definition> def;
+    std::shared_ptr<const StateMapping> mapping;
+    std::string error;
+    const Fsm_Errors err = build(def, mapping, error);
+    if(err == Fsm_Success) {
+        if(m_slot) {
+            m_slot->publish(def, mapping);
+        } else {
+            m_slot = std::make_shared<DefinitionSlot>(def);
+        }
+        m_reloads++;
+    } else {
+        m_failures++;
+    }
+    // The report function can use the loader.
+    reportFn report = m_report_fn;
+    lock.unlock();
+    if(report) {
+        report(err, error);
+    }
+    return err;
+}
+
+FSM::Fsm_Errors FSM::DefinitionLoader::start() {
+#ifdef __linux__
+    if(m_watcher.joinable()) {
+        return Fsm_Success;
+    }
+    const size_t slash = m_path.rfind('/');
+    const std::string directory = slash == std::string::npos ? "." : (slash == 0 ? "/" : m_path.substr(0, slash));
+    m_inotify = inotify_init1(IN_CLOEXEC);
+    if(m_inotify < 0) {
+        return Fsm_IOError;
+    }
+    if(inotify_add_watch(m_inotify, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0 || pipe(m_wake) != 0) {
+        stop();
+        return Fsm_IOError;
+    }
+    m_watcher = std::thread(&DefinitionLoader::watch, this);
+    return Fsm_Success;
+#else
+    return Fsm_Unsupported;
+#endif
+}
+
+void FSM::DefinitionLoader::stop() {
+    if(m_watcher.joinable()) {
+        const char stop = 0;
+        while(write(m_wake[1], &stop, 1) < 0 && errno == EINTR) {}
+        m_watcher.join();
+    }
+    for(int * fd : { &m_inotify, &m_wake[0], &m_wake[1] }) {
+        if(*fd >= 0) close(*fd);
+        *fd = -1;
+    }
+}
+
+void FSM::DefinitionLoader::watch() {
+#ifdef __linux__
+    const size_t slash = m_path.rfind('/');
+    const std::string name = slash == std::string::npos ? m_path : m_path.substr(slash + 1);
+    alignas(struct inotify_event) char buffer[4096];
+    for(;;) {
+        struct pollfd fds[2] = { { m_inotify, POLLIN, 0 }, { m_wake[0], POLLIN, 0 } };
+        if(poll(fds, 2, -1) < 0) {
+            if(errno == EINTR) continue;
+            return;
+        }
+        if(fds[1].revents != 0) {
+            return;
+        }
+        const ssize_t size = read(m_inotify, buffer, sizeof(buffer));
+        if(size <= 0) {
+            if(size < 0 && errno == EINTR) continue;
+            return;
+        }
+        // Several events of the file in one read make one reload.
+        bool changed = false;
+        for(ssize_t offset = 0; offset < size; ) {
+            const struct inotify_event * event = reinterpret_cast<const struct inotify_event *>(buffer + offset);
+            changed = changed || (event->len != 0 && name == event->name);
+            offset += sizeof(struct inotify_event) + event->len;
+        }
+        if(changed) {
+            reload();
+        }
+    }
+#endif
+}
@@ -43,9 +43,27 @@
 
 #define CATCH_CONFIG_MAIN
 #include "catch.hpp"
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <chrono>
+#include <mutex>
 #include <vector>
+#include <stdio.h>
+#include <string.h>
+#include <thread>
 #include "../include/fsm.h"
+#include "../include/fsm_journal.h"
+#include "../include/fsm_binary.h"
+#include "../include/fsm_dsl.h"
+#include "../include/fsm_eventlog.h"
+#include "../include/fsm_pool.h"
+#include "../include/fsm_product.h"
+#include "../include/fsm_parallel.h"
+#include "../include/fsm_reload.h"
+#if defined(__cpp_impl_coroutine)
+#include "../include/fsm_coroutine.h"
+#endif
 #include "sample.h"
 
 TEST_CASE("Test Initialization")
@@ -320,8 +338,2223 @@ TEST_CASE("Test enter and exit states functions")
     }
 }
 
-
 TEST_CASE("SAMPLE")
 {
     REQUIRE(sample() == 0);
-}
\ No newline at end of file
+}
+
+TEST_CASE("Test incremental add_transitions")
+{
+    FSM::Fsm fsm;
+    FSM::State * s1 = new FSM::State();
+    FSM::State * s2 = new FSM::State();
+    FSM::State * s3 = new FSM::State();
+    FSM::Event * e1 = new FSM::Event();
+    FSM::Event * e2 = new FSM::Event();
+    
+    // Batches are added out of order of the states.
+    fsm.add_transitions({
+        {s2, s3, e1, nullptr, nullptr},
+    });
+    fsm.add_transitions({
+        {FSM::Fsm::Fsm_Initial, s1, e1, nullptr, nullptr},
+        {s1, s2, e1, nullptr, nullptr},
+    });
+    fsm.init();
+    REQUIRE(fsm.execute(e1) == FSM::Fsm_Success);
+    REQUIRE(fsm.execute(e1) == FSM::Fsm_Success);
+    REQUIRE(fsm.state() == s2);
+    
+    // Transitions added later come after the existing ones of the same
+    // state.
+    fsm.add_transitions({
+        {s2, s1, e1, nullptr, nullptr},
+        {s3, s1, e2, nullptr, nullptr},
+    });
+    REQUIRE(fsm.execute(e1) == FSM::Fsm_Success);
+    REQUIRE(fsm.state() == s3);
+    REQUIRE(fsm.execute(e2) == FSM::Fsm_Success);
+    REQUIRE(fsm.state() == s1);
+    
+    delete s1;
+    delete s2;
+    delete s3;
+    delete e1;
+    delete e2;
+}
+
+TEST_CASE("Test spread ids")
+{
+    FSM::Fsm fsm;
+    FSM::State * s1 = new FSM::State();
+    FSM::Event * e1 = new FSM::Event();
+    // Many states and events created in between spread the ids apart.
+    std::vector<FSM::State *> states;
+    std::vector<FSM::Event *> events;
+    for(int i = 0; i < 1000; i++)
+    {
+        states.push_back(new FSM::State());
+        events.push_back(new FSM::Event());
+    }
+    FSM::State * s2 = new FSM::State();
+    FSM::Event * e2 = new FSM::Event();
+    
+    fsm.add_transitions({
+        {FSM::Fsm::Fsm_Initial, s1, e1, nullptr, nullptr},
+        {s1, s2, e2, nullptr, nullptr},
+        {s2, s1, e1, nullptr, nullptr},
+        {s2, FSM::Fsm::Fsm_Final, e2, nullptr, nullptr},
+    });
+    
+    SECTION("Test mutable")
+    {
+        fsm.init();
+        REQUIRE(fsm.execute(e1) == FSM::Fsm_Success);
+        REQUIRE(fsm.state() == s1);
+        REQUIRE(fsm.execute(events[0]) == FSM::Fsm_NoMatchingTrigger);
+        REQUIRE(fsm.execute(e2) == FSM::Fsm_Success);
+        REQUIRE(fsm.execute(e1) == FSM::Fsm_Success);
+        REQUIRE(fsm.execute(e2) == FSM::Fsm_Success);
+        REQUIRE(fsm.execute(e2) == FSM::Fsm_Success);
+        REQUIRE(fsm.is_final());
+    }
+    SECTION("Test frozen")
+    {
+        fsm.freeze();
+        const auto def = fsm.definition();
+        REQUIRE(def->state_index(s1->getID()) != FSM::Definition::npos);
+        REQUIRE(def->state_index(s2->getID()) != FSM::Definition::npos);
+        REQUIRE(def->state_index(states[500]->getID()) == FSM::Definition::npos);
+        REQUIRE(def->class_by_id(e1->getID()) != def->class_by_id(e2->getID()));
+        REQUIRE(def->trigger_index(events[500]->getID()) == FSM::Definition::npos);
+        
+        fsm.init();
+        REQUIRE(fsm.execute(e1) == FSM::Fsm_Success);
+        REQUIRE(fsm.state() == s1);
+        REQUIRE(fsm.execute(events[0]) == FSM::Fsm_NoMatchingTrigger);
+        REQUIRE(fsm.execute(e2) == FSM::Fsm_Success);
+        REQUIRE(fsm.execute(e1) == FSM::Fsm_Success);
+        REQUIRE(fsm.execute(e2) == FSM::Fsm_Success);
+        REQUIRE(fsm.execute(e2) == FSM::Fsm_Success);
+        REQUIRE(fsm.is_final());
+    }
+    
+    for(size_t i = 0; i < states.size(); i++)
+    {
+        delete states[i];
+        delete events[i];
+    }
+    delete s1;
+    delete s2;
+    delete e1;
+    delete e2;
+}
+
+TEST_CASE("Test trigger sets")
+{
+    int count = 0;
+    FSM::Fsm fsm;
+    FSM::State * running = new FSM::State();
+    FSM::State * failed = new FSM::State();
+    FSM::Event * start = new FSM::Event();
+    std::vector<FSM::Event *> errors;
+    for(int i = 0; i < 100; i++) errors.push_back(new FSM::Event());
+    FSM::Event * other = new FSM::Event();
+    
+    auto set = std::make_shared<const FSM::TriggerSet>(errors.begin(), errors.end());
+    REQUIRE(set->contains(errors[0]->getID()));
+    REQUIRE(set->contains(errors[99]->getID()));
+    REQUIRE_FALSE(set->contains(other->getID()));
+    REQUIRE_FALSE(set->contains(start->getID()));
+    
+    fsm.add_transitions({
+        {FSM::Fsm::Fsm_Initial, running, start, nullptr, nullptr},
+        {running, failed, nullptr, nullptr, [&count](FSM::Event *){count++;}, set},
+        {failed, running, nullptr, nullptr, nullptr, FSM::TriggerSet::make({ start, other })},
+    });
+    REQUIRE(fsm.find_event(errors[42]->getID()) == errors[42]);
+    
+    SECTION("Test mutable") {
+        fsm.init();
+        REQUIRE(fsm.execute(start) == FSM::Fsm_Success);
+        REQUIRE(fsm.execute(other) == FSM::Fsm_NoMatchingTrigger);
+        REQUIRE(fsm.execute(errors[57]) == FSM::Fsm_Success);
+        REQUIRE(fsm.state() == failed);
+        REQUIRE(fsm.execute(other) == FSM::Fsm_Success);
+        REQUIRE(fsm.state() == running);
+        REQUIRE(count == 1);
+    }
+    
+    SECTION("Test frozen") {
+        fsm.freeze();
+        std::shared_ptr<const FSM::Definition> def = fsm.definition();
+        REQUIRE(def->trigger_count() == 102);
+        // The errors are one class, with one row.
+        REQUIRE(def->class_count() == 3);
+        REQUIRE(def->row_count() == 4);
+        fsm.init();
+        REQUIRE(fsm.execute(start) == FSM::Fsm_Success);
+        REQUIRE(fsm.execute(errors[3]) == FSM::Fsm_Success);
+        REQUIRE(fsm.state() == failed);
+        REQUIRE(count == 1);
+        
+        // Unfreezing turns the classes back into trigger sets.
+        fsm.add_transitions({
+            {running, FSM::Fsm::Fsm_Final, other, nullptr, nullptr},
+        });
+        REQUIRE(fsm.execute(start) == FSM::Fsm_Success);
+        REQUIRE(fsm.execute(errors[99]) == FSM::Fsm_Success);
+        REQUIRE(fsm.state() == failed);
+        REQUIRE(fsm.execute(other) == FSM::Fsm_Success);
+        REQUIRE(fsm.execute(other) == FSM::Fsm_Success);
+        REQUIRE(fsm.is_final());
+        REQUIRE(count == 2);
+    }
+    
+    delete running;
+    delete failed;
+    delete start;
+    delete other;
+    for(auto error : errors) delete error;
+}
+
+TEST_CASE("Test wildcards")
+{
+    bool blocked = false;
+    FSM::Fsm fsm;
+    FSM::State * stateA = new FSM::State();
+    FSM::State * stateB = new FSM::State();
+    FSM::State * error = new FSM::State();
+    FSM::Event * go = new FSM::Event();
+    FSM::Event * shutdown = new FSM::Event();
+    FSM::Event * ping = new FSM::Event();
+    // Not in any transition.
+    FSM::Event * other = new FSM::Event();
+    FSM::State * any = FSM::Fsm::Fsm_AnyState;
+    FSM::Event * any_trigger = FSM::Fsm::Fsm_AnyTrigger;
+    fsm.add_transitions({
+        {any, FSM::Fsm::Fsm_Final, shutdown, nullptr, nullptr},
+        {any, stateB, any_trigger, nullptr, nullptr},
+        {FSM::Fsm::Fsm_Initial, stateA, go, nullptr, nullptr},
+        {stateA, stateB, go, nullptr, nullptr},
+        {stateA, error, any_trigger, nullptr, nullptr},
+        {stateB, stateB, shutdown, [&blocked]{return blocked;}, nullptr},
+        {error, stateA, go, nullptr, nullptr},
+    });
+    
+    auto run = [&]() {
+        fsm.init();
+        // Not from the pseudo states.
+        REQUIRE(fsm.execute(shutdown) == FSM::Fsm_NoMatchingTrigger);
+        REQUIRE(fsm.execute(go) == FSM::Fsm_Success);
+        REQUIRE(fsm.state() == stateA);
+        // The state on any trigger before any state on any trigger.
+        REQUIRE(fsm.execute(ping) == FSM::Fsm_Success);
+        REQUIRE(fsm.state() == error);
+        REQUIRE(fsm.execute(go) == FSM::Fsm_Success);
+        REQUIRE(fsm.execute(other) == FSM::Fsm_Success);
+        REQUIRE(fsm.state() == error);
+        REQUIRE(fsm.execute(go) == FSM::Fsm_Success);
+        REQUIRE(fsm.execute(go) == FSM::Fsm_Success);
+        REQUIRE(fsm.state() == stateB);
+        REQUIRE(fsm.execute(other) == FSM::Fsm_Success);
+        REQUIRE(fsm.state() == stateB);
+        // The state before any state, and any state if the guard is false.
+        blocked = true;
+        REQUIRE(fsm.execute(shutdown) == FSM::Fsm_Success);
+        REQUIRE(fsm.state() == stateB);
+        blocked = false;
+        REQUIRE(fsm.execute(shutdown) == FSM::Fsm_Success);
+        REQUIRE(fsm.is_final());
+        REQUIRE(fsm.execute(other) == FSM::Fsm_NoMatchingTrigger);
+    };
+    
+    SECTION("Test mutable") {
+        run();
+    }
+    
+    SECTION("Test dense") {
+        fsm.freeze(FSM::Definition::Layout_Dense);
+        REQUIRE(fsm.definition()->class_by_id(other->getID()) == fsm.definition()->any_class());
+        // The rows on any trigger are kept once per state: 7 transitions, and
+        // the 2 from any state in each of the 3 states.
+        REQUIRE(fsm.definition()->row_count() == 13);
+        run();
+    }
+    
+    SECTION("Test rows") {
+        fsm.freeze(FSM::Definition::Layout_Rows);
+        run();
+    }
+    
+    SECTION("Test hash") {
+        fsm.freeze(FSM::Definition::Layout_Hash);
+        run();
+    }
+    
+    SECTION("Test unfreeze") {
+        // The wildcards also apply to the states added afterwards.
+        FSM::State * stateC = new FSM::State();
+        fsm.freeze();
+        fsm.add_transitions({
+            {error, stateC, ping, nullptr, nullptr},
+        });
+        fsm.init();
+        fsm.execute(go);
+        fsm.execute(ping);
+        REQUIRE(fsm.execute(ping) == FSM::Fsm_Success);
+        REQUIRE(fsm.state() == stateC);
+        REQUIRE(fsm.execute(other) == FSM::Fsm_Success);
+        REQUIRE(fsm.state() == stateB);
+        fsm.reset();
+        run();
+        delete stateC;
+    }
+    
+    delete stateA;
+    delete stateB;
+    delete error;
+    delete go;
+    delete shutdown;
+    delete ping;
+    delete other;
+}
+
+TEST_CASE("Test deferred triggers")
+{
+    std::vector<FSM::Event *> handled;
+    FSM::Fsm fsm;
+    FSM::State * connecting = new FSM::State();
+    FSM::State * connected = new FSM::State();
+    FSM::Event * start = new FSM::Event();
+    FSM::Event * ready = new FSM::Event();
+    FSM::Event * abort = new FSM::Event();
+    FSM::Event * data1 = new FSM::Event();
+    FSM::Event * data2 = new FSM::Event();
+    FSM::Event * drop = new FSM::Event();
+    auto handle = [&handled](FSM::Event * evt){handled.push_back(evt);};
+    fsm.add_transitions({
+        {FSM::Fsm::Fsm_Initial, connecting, start, nullptr, nullptr},
+        {connecting, connected, ready, nullptr, nullptr},
+        {connecting, FSM::Fsm::Fsm_Final, abort, nullptr, nullptr},
+        {connected, connected, data1, nullptr, handle},
+        {connected, connected, data2, nullptr, handle},
+        {connected, connecting, drop, nullptr, handle},
+    });
+    fsm.add_deferrals(connecting, FSM::TriggerSet::make({ data1, data2, drop, abort }));
+    
+    auto run = [&]() {
+        fsm.init();
+        // Only deferred by the states that defer it.
+        REQUIRE(fsm.execute(data1) == FSM::Fsm_NoMatchingTrigger);
+        fsm.execute(start);
+        REQUIRE(fsm.execute(data1) == FSM::Fsm_Deferred);
+        REQUIRE(fsm.execute(data2) == FSM::Fsm_Deferred);
+        REQUIRE(fsm.execute(data1) == FSM::Fsm_Deferred);
+        REQUIRE(fsm.deferred_count() == 3);
+        REQUIRE(handled.empty());
+        
+        // Executed in order on entering connected.
+        REQUIRE(fsm.execute(ready) == FSM::Fsm_Success);
+        REQUIRE(fsm.deferred_count() == 0);
+        REQUIRE(handled == std::vector<FSM::Event *>({ data1, data2, data1 }));
+        
+        // drop goes back to connecting, which defers data2 again.
+        handled.clear();
+        REQUIRE(fsm.execute(drop) == FSM::Fsm_Success);
+        REQUIRE(fsm.execute(drop) == FSM::Fsm_Deferred);
+        REQUIRE(fsm.execute(data2) == FSM::Fsm_Deferred);
+        REQUIRE(fsm.execute(ready) == FSM::Fsm_Success);
+        REQUIRE(fsm.state() == connecting);
+        REQUIRE(handled == std::vector<FSM::Event *>({ drop, drop }));
+        REQUIRE(fsm.deferred_count() == 1);
+        
+        // The queue is bounded.
+        for(size_t i = 1; i < FSM::Fsm::deferred_capacity; i++) {
+            REQUIRE(fsm.execute(data1) == FSM::Fsm_Deferred);
+        }
+        REQUIRE(fsm.execute(data1) == FSM::Fsm_QueueFull);
+        
+        // A transition takes precedence over the deferral. The deferred
+        // events are dropped in the final state.
+        REQUIRE(fsm.execute(abort) == FSM::Fsm_Success);
+        REQUIRE(fsm.is_final());
+        REQUIRE(fsm.deferred_count() == 0);
+    };
+    
+    SECTION("Test mutable") {
+        run();
+    }
+    
+    SECTION("Test frozen") {
+        fsm.freeze();
+        run();
+    }
+    
+    SECTION("Test reset") {
+        fsm.init();
+        fsm.execute(start);
+        fsm.execute(data1);
+        fsm.reset();
+        REQUIRE(fsm.deferred_count() == 0);
+    }
+    
+    delete connecting;
+    delete connected;
+    delete start;
+    delete ready;
+    delete abort;
+    delete data1;
+    delete data2;
+    delete drop;
+}
+
+TEST_CASE("Test eventless transitions")
+{
+    bool valid = false;
+    int steps = 0;
+    std::vector<FSM::Event *> triggers;
+    FSM::Fsm fsm;
+    FSM::State * idle = new FSM::State();
+    FSM::State * check = new FSM::State();
+    FSM::State * ok = new FSM::State();
+    FSM::State * failed = new FSM::State();
+    FSM::State * loopA = new FSM::State();
+    FSM::State * loopB = new FSM::State();
+    FSM::State * chainA = new FSM::State();
+    FSM::State * chainB = new FSM::State();
+    FSM::State * chainC = new FSM::State();
+    FSM::State * chainD = new FSM::State();
+    FSM::Event * start = new FSM::Event();
+    FSM::Event * go = new FSM::Event();
+    FSM::Event * loop = new FSM::Event();
+    FSM::Event * chain = new FSM::Event();
+    fsm.add_transitions({
+        {FSM::Fsm::Fsm_Initial, idle, start, nullptr, nullptr},
+        {idle, check, go, nullptr, nullptr},
+        {idle, loopA, loop, nullptr, nullptr},
+        {idle, chainA, chain, nullptr, nullptr},
+        {chainA, chainB, nullptr, nullptr, nullptr},
+        {chainB, chainC, nullptr, nullptr, nullptr},
+        {chainC, idle, go, nullptr, nullptr},
+        {chainC, chainD, nullptr, []{return false;}, nullptr},
+        {check, ok, nullptr, [&valid]{return valid;}, nullptr},
+        {check, failed, nullptr, nullptr, nullptr},
+        // Not taken without a trigger.
+        {check, idle, FSM::Fsm::Fsm_AnyTrigger, nullptr, nullptr},
+        {ok, idle, go, nullptr, nullptr},
+        {failed, idle, go, nullptr, nullptr},
+        {loopA, loopB, nullptr, nullptr, [&steps](FSM::Event *){steps++;}},
+        {loopB, loopA, nullptr, nullptr, [&steps](FSM::Event *){steps++;}},
+    });
+    fsm.add_debug_fn([&triggers](FSM::State *, FSM::State *, FSM::Event * trigger){triggers.push_back(trigger);});
+    
+    auto run = [&]() {
+        fsm.init();
+        REQUIRE(fsm.execute(start) == FSM::Fsm_Success);
+        REQUIRE(fsm.execute(go) == FSM::Fsm_Success);
+        REQUIRE(fsm.state() == failed);
+        REQUIRE(triggers == std::vector<FSM::Event *>({ start, go, FSM::Fsm::Fsm_Completion }));
+        REQUIRE(fsm.execute(go) == FSM::Fsm_Success);
+        valid = true;
+        REQUIRE(fsm.execute(go) == FSM::Fsm_Success);
+        REQUIRE(fsm.state() == ok);
+        REQUIRE(fsm.execute(go) == FSM::Fsm_Success);
+        
+        // A chain of the maximum number of steps completes, also when the
+        // last state has eventless transitions with false guards.
+        fsm.set_max_completion_steps(2);
+        REQUIRE(fsm.execute(chain) == FSM::Fsm_Success);
+        REQUIRE(fsm.state() == chainC);
+        REQUIRE(fsm.execute(go) == FSM::Fsm_Success);
+        
+        // A cycle stops once it takes more than the maximum number of steps.
+        fsm.set_max_completion_steps(5);
+        REQUIRE(fsm.execute(loop) == FSM::Fsm_CompletionLimit);
+        REQUIRE(steps == 6);
+        REQUIRE(fsm.state() == loopA);
+    };
+    
+    SECTION("Test mutable") {
+        run();
+    }
+    
+    SECTION("Test frozen") {
+        fsm.freeze();
+        REQUIRE(fsm.definition()->completion_class() != FSM::Definition::npos);
+        run();
+    }
+    
+    delete idle;
+    delete check;
+    delete ok;
+    delete failed;
+    delete loopA;
+    delete loopB;
+    delete chainA;
+    delete chainB;
+    delete chainC;
+    delete chainD;
+    delete start;
+    delete go;
+    delete loop;
+    delete chain;
+}
+
+TEST_CASE("Test history")
+{
+    FSM::Fsm fsm;
+    FSM::State * washing = new FSM::State();
+    FSM::State * rinsing = new FSM::State();
+    FSM::State * spinning = new FSM::State();
+    FSM::State * paused = new FSM::State();
+    FSM::State * resume = new FSM::State();
+    FSM::Event * start = new FSM::Event();
+    FSM::Event * next = new FSM::Event();
+    FSM::Event * pause = new FSM::Event();
+    fsm.add_history(resume, { washing, rinsing, spinning }, washing);
+    fsm.add_transitions({
+        {FSM::Fsm::Fsm_Initial, paused, start, nullptr, nullptr},
+        {washing, rinsing, next, nullptr, nullptr},
+        {rinsing, spinning, next, nullptr, nullptr},
+        {washing, paused, pause, nullptr, nullptr},
+        {rinsing, paused, pause, nullptr, nullptr},
+        {spinning, paused, pause, nullptr, nullptr},
+        {paused, resume, start, nullptr, nullptr},
+    });
+    
+    auto run = [&]() {
+        fsm.init();
+        fsm.execute(start);
+        REQUIRE(fsm.state() == paused);
+        // The default state the first time.
+        REQUIRE(fsm.execute(start) == FSM::Fsm_Success);
+        REQUIRE(fsm.state() == washing);
+        fsm.execute(next);
+        fsm.execute(pause);
+        REQUIRE(fsm.history() == std::vector<unsigned int>({ rinsing->getID() }));
+        REQUIRE(fsm.execute(start) == FSM::Fsm_Success);
+        REQUIRE(fsm.state() == rinsing);
+        fsm.execute(next);
+        fsm.execute(pause);
+        REQUIRE(fsm.execute(start) == FSM::Fsm_Success);
+        REQUIRE(fsm.state() == spinning);
+        
+        fsm.reset();
+        REQUIRE(fsm.history() == std::vector<unsigned int>({ washing->getID() }));
+    };
+    
+    SECTION("Test mutable") {
+        run();
+    }
+    
+    SECTION("Test frozen") {
+        fsm.freeze();
+        run();
+    }
+    
+    SECTION("Test restore") {
+        REQUIRE(fsm.restore_history({ paused->getID() }) == FSM::Fsm_UnknownId);
+        REQUIRE(fsm.restore_history({ washing->getID(), washing->getID() }) == FSM::Fsm_UnknownId);
+        REQUIRE(fsm.restore_history({ spinning->getID() }) == FSM::Fsm_Success);
+        fsm.init();
+        fsm.execute(start);
+        fsm.execute(start);
+        REQUIRE(fsm.state() == spinning);
+    }
+    
+    SECTION("Test journal snapshot") {
+        const char * path = "fsm_test_history.journal";
+        remove(path);
+        FSM::Journal journal;
+        REQUIRE(journal.open(path) == FSM::Fsm_Success);
+        fsm.add_journal_fn(journal.recorder(1));
+        fsm.init();
+        fsm.execute(start);
+        fsm.execute(start);
+        fsm.execute(next);
+        fsm.execute(pause);
+        REQUIRE(journal.snapshot(1, fsm) == FSM::Fsm_Success);
+        REQUIRE(journal.close() == FSM::Fsm_Success);
+        
+        FSM::Fsm other;
+        other.add_history(resume, { washing, rinsing, spinning }, washing);
+        other.add_transitions({
+            {FSM::Fsm::Fsm_Initial, paused, start, nullptr, nullptr},
+            {washing, paused, pause, nullptr, nullptr},
+            {rinsing, paused, pause, nullptr, nullptr},
+            {paused, resume, start, nullptr, nullptr},
+        });
+        FSM::Replayer replayer;
+        replayer.add_instance(1, &other);
+        REQUIRE(replayer.replay(path, false) == FSM::Fsm_Success);
+        REQUIRE(other.state() == paused);
+        REQUIRE(other.execute(start) == FSM::Fsm_Success);
+        REQUIRE(other.state() == rinsing);
+        remove(path);
+    }
+    
+    delete washing;
+    delete rinsing;
+    delete spinning;
+    delete paused;
+    delete resume;
+    delete start;
+    delete next;
+    delete pause;
+}
+
+TEST_CASE("Test async actions")
+{
+    FSM::Fsm fsm;
+    FSM::State * idle = new FSM::State();
+    FSM::State * sending = new FSM::State();
+    FSM::State * sent = new FSM::State();
+    FSM::Event * send = new FSM::Event();
+    FSM::Event * ack = new FSM::Event();
+    FSM::Event * cached = new FSM::Event();
+    std::vector<FSM::AsyncToken> writes;
+    std::vector<std::function<void()> > posted;
+    int entered = 0;
+    int exited = 0;
+    sending->setEnterFunction([&]() { entered++; });
+    idle->setExitFunction([&]() { exited++; });
+    fsm.add_transitions({
+        {FSM::Fsm::Fsm_Initial, idle, send, nullptr, nullptr},
+        {idle, sending, send, nullptr, [&](FSM::Event *) { writes.push_back(FSM::Fsm::begin_async()); }},
+        {idle, sending, cached, nullptr, [&](FSM::Event *) { FSM::Fsm::begin_async().complete(); }},
+        {sending, sent, nullptr, nullptr, nullptr},
+        {sent, idle, ack, nullptr, nullptr},
+    });
+    fsm.set_executor([&](std::function<void()> fn) { posted.push_back(fn); });
+    
+    auto run = [&]() {
+        fsm.init();
+        fsm.execute(send);
+        REQUIRE(fsm.execute(send) == FSM::Fsm_Success);
+        REQUIRE(fsm.is_transitioning());
+        REQUIRE(fsm.state() == idle);
+        REQUIRE(exited == 1);
+        REQUIRE(entered == 0);
+        REQUIRE(fsm.execute(ack) == FSM::Fsm_Transitioning);
+        REQUIRE(fsm.execute(send) == FSM::Fsm_Transitioning);
+        
+        // The rest of the transition runs on the executor.
+        REQUIRE(writes.size() == 1);
+        writes[0].complete();
+        writes[0].complete();
+        REQUIRE(writes[0].done());
+        REQUIRE(fsm.state() == idle);
+        REQUIRE(posted.size() == 1);
+        posted[0]();
+        // sending -> sent, then ack and send are executed.
+        REQUIRE(entered == 1);
+        REQUIRE(fsm.is_transitioning());
+        REQUIRE(writes.size() == 2);
+        writes[1].complete();
+        posted[1]();
+        REQUIRE_FALSE(fsm.is_transitioning());
+        REQUIRE(fsm.state() == sent);
+        
+        // Completed by the action itself.
+        fsm.execute(ack);
+        REQUIRE(fsm.execute(cached) == FSM::Fsm_Success);
+        REQUIRE_FALSE(fsm.is_transitioning());
+        REQUIRE(fsm.state() == sent);
+        REQUIRE(posted.size() == 2);
+        
+        // A reset drops the pending action.
+        fsm.execute(ack);
+        fsm.execute(send);
+        REQUIRE(fsm.is_transitioning());
+        fsm.reset();
+        REQUIRE_FALSE(fsm.is_transitioning());
+        writes.back().complete();
+        REQUIRE(posted.size() == 2);
+    };
+    
+    SECTION("Test mutable") {
+        run();
+    }
+    
+    SECTION("Test frozen") {
+        fsm.freeze();
+        run();
+    }
+    
+    SECTION("Test without executor") {
+        fsm.set_executor(nullptr);
+        fsm.init();
+        fsm.execute(send);
+        fsm.execute(send);
+        fsm.execute(ack);
+        writes[0].complete();
+        REQUIRE(fsm.state() == idle);
+        REQUIRE_FALSE(fsm.is_transitioning());
+    }
+    
+#if defined(__cpp_impl_coroutine)
+    SECTION("Test coroutine action") {
+        struct Write {
+            std::vector<std::coroutine_handle<> > & waiting;
+            bool await_ready() { return false; }
+            void await_suspend(std::coroutine_handle<> handle) { waiting.push_back(handle); }
+            void await_resume() {}
+        };
+        std::vector<std::coroutine_handle<> > waiting;
+        FSM::Fsm machine;
+        machine.add_transitions({
+            {FSM::Fsm::Fsm_Initial, idle, send, nullptr, nullptr},
+            {idle, sent, send, nullptr, FSM::coroutine_action([&](FSM::Event *) -> FSM::AsyncAction {
+                co_await Write{ waiting };
+                co_await Write{ waiting };
+            })},
+        });
+        machine.init();
+        machine.execute(send);
+        machine.execute(send);
+        REQUIRE(machine.is_transitioning());
+        // Frees the action, whose closure the coroutine still uses.
+        for(int i = 0; i < 16; i++) {
+            machine.add_transitions({ {sent, idle, ack, nullptr, nullptr} });
+        }
+        waiting[0].resume();
+        REQUIRE(machine.is_transitioning());
+        waiting[1].resume();
+        REQUIRE(machine.state() == sent);
+    }
+#endif
+    
+    delete idle;
+    delete sending;
+    delete sent;
+    delete send;
+    delete ack;
+    delete cached;
+}
+
+TEST_CASE("Test do-activities")
+{
+    FSM::Fsm fsm;
+    FSM::State * idle = new FSM::State();
+    FSM::State * loading = new FSM::State();
+    FSM::State * ready = new FSM::State();
+    FSM::Event * load = new FSM::Event();
+    FSM::Event * loaded = new FSM::Event();
+    FSM::Event * cancel = new FSM::Event();
+    std::vector<std::function<void()> > pool;
+    std::vector<std::function<void()> > posted;
+    std::vector<FSM::Activity> activities;
+    bool entered = false;
+    loading->setEnterFunction([&]() { entered = true; });
+    loading->setDoActivity([&](const FSM::Activity & activity) {
+        // Started after the enter function.
+        REQUIRE(entered);
+        activities.push_back(activity);
+    });
+    fsm.add_transitions({
+        {FSM::Fsm::Fsm_Initial, idle, load, nullptr, nullptr},
+        {idle, loading, load, nullptr, nullptr},
+        {loading, ready, loaded, nullptr, nullptr},
+        {loading, idle, cancel, nullptr, nullptr},
+    });
+    fsm.set_activity_executor([&](std::function<void()> fn) { pool.push_back(fn); });
+    fsm.set_executor([&](std::function<void()> fn) { posted.push_back(fn); });
+    
+    auto run = [&]() {
+        fsm.init();
+        fsm.execute(load);
+        REQUIRE(pool.empty());
+        fsm.execute(load);
+        REQUIRE(pool.size() == 1);
+        pool[0]();
+        REQUIRE(activities.size() == 1);
+        REQUIRE_FALSE(activities[0].cancelled());
+        
+        // The posted event is executed on the executor of the machine.
+        activities[0].post(loaded);
+        REQUIRE(fsm.state() == loading);
+        REQUIRE(posted.size() == 1);
+        posted[0]();
+        REQUIRE(fsm.state() == ready);
+        REQUIRE(activities[0].cancelled());
+        activities[0].post(loaded);
+        REQUIRE(posted.size() == 1);
+        
+        // Exiting the state cancels the activity and drops its events.
+        fsm.reset();
+        fsm.init();
+        fsm.execute(load);
+        fsm.execute(load);
+        pool[1]();
+        activities[1].post(loaded);
+        fsm.execute(cancel);
+        REQUIRE(activities[1].cancelled());
+        posted[1]();
+        REQUIRE(fsm.state() == idle);
+        
+        // So does a reset.
+        fsm.execute(load);
+        pool[2]();
+        fsm.reset();
+        REQUIRE(activities[2].cancelled());
+    };
+    
+    SECTION("Test mutable") {
+        run();
+    }
+    
+    SECTION("Test frozen") {
+        fsm.freeze();
+        run();
+    }
+    
+    SECTION("Test threads") {
+        std::mutex mutex;
+        std::vector<std::function<void()> > inbox;
+        std::atomic<bool> finished(false);
+        FSM::State * working = new FSM::State();
+        working->setDoActivity([&](const FSM::Activity & activity) {
+            activity.post(loaded);
+            while(not activity.cancelled()) std::this_thread::yield();
+            finished = true;
+        });
+        FSM::Fsm machine;
+        machine.add_transitions({
+            {FSM::Fsm::Fsm_Initial, working, load, nullptr, nullptr},
+            {working, ready, loaded, nullptr, nullptr},
+        });
+        machine.set_executor([&](std::function<void()> fn) {
+            std::lock_guard<std::mutex> lock(mutex);
+            inbox.push_back(fn);
+        });
+        machine.init();
+        machine.execute(load);
+        for(;;) {
+            std::function<void()> fn;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if(not inbox.empty()) fn = inbox[0];
+            }
+            if(fn) {
+                fn();
+                break;
+            }
+            std::this_thread::yield();
+        }
+        REQUIRE(machine.state() == ready);
+        machine.wait_activities();
+        REQUIRE(finished);
+        delete working;
+    }
+    
+    SECTION("Test without executor") {
+        // The posted events wait for the thread of the machine.
+        FSM::State * working = new FSM::State();
+        std::atomic<bool> posted_loaded(false);
+        working->setDoActivity([&](const FSM::Activity & activity) {
+            activity.post(loaded);
+            posted_loaded = true;
+        });
+        FSM::Fsm machine;
+        machine.add_transitions({
+            {FSM::Fsm::Fsm_Initial, working, load, nullptr, nullptr},
+            {working, ready, loaded, nullptr, nullptr},
+        });
+        machine.init();
+        machine.execute(load);
+        while(not posted_loaded) std::this_thread::yield();
+        REQUIRE(machine.state() != ready);
+        REQUIRE(machine.run_posted() == 1);
+        REQUIRE(machine.state() == ready);
+        REQUIRE(machine.run_posted() == 0);
+        machine.wait_activities();
+        delete working;
+    }
+    
+    delete idle;
+    delete loading;
+    delete ready;
+    delete load;
+    delete loaded;
+    delete cancel;
+}
+
+TEST_CASE("Test frozen definition")
+{
+    int count = 0;
+    FSM::Fsm fsm;
+    FSM::Event * a = new FSM::Event();
+    FSM::Event * b = new FSM::Event();
+    FSM::Event * c = new FSM::Event();
+    FSM::Event * d = new FSM::Event();
+    FSM::State * stateA = new FSM::State();
+    fsm.add_transitions({
+        {FSM::Fsm::Fsm_Initial, stateA        , a, nullptr, nullptr},
+        {stateA          , stateA        , b, []{return false;}, [&count](FSM::Event * evt){count++;}},
+        {stateA          , stateA        , b, []{return true;}, [&count](FSM::Event * evt){count += 10;}},
+        {stateA          , FSM::Fsm::Fsm_Final, c, nullptr, nullptr},
+        {stateA          , FSM::Fsm::Fsm_Final, d, nullptr, nullptr},
+    });
+    fsm.freeze();
+    std::shared_ptr<const FSM::Definition> def = fsm.definition();
+    REQUIRE(def);
+    REQUIRE(def->state_count() == 3);
+    REQUIRE(def->trigger_count() == 4);
+    // c and d behave the same in every state.
+    REQUIRE(def->class_count() == 3);
+    REQUIRE(def->class_by_id(c->getID()) == def->class_by_id(d->getID()));
+    
+    SECTION("Test execute") {
+        REQUIRE(fsm.execute(a) == FSM::Fsm_NotInitialized);
+        fsm.init();
+        REQUIRE(fsm.execute(b) == FSM::Fsm_NoMatchingTrigger);
+        REQUIRE(fsm.execute(a) == FSM::Fsm_Success);
+        REQUIRE(fsm.state() == stateA);
+        REQUIRE(fsm.execute(a) == FSM::Fsm_NoMatchingTrigger);
+        REQUIRE(fsm.execute(b) == FSM::Fsm_Success);
+        REQUIRE(count == 10);
+        REQUIRE(fsm.execute(d) == FSM::Fsm_Success);
+        REQUIRE(fsm.is_final());
+    }
+    
+    SECTION("Test shared definition") {
+        FSM::Fsm other(def);
+        other.init();
+        REQUIRE(other.execute(a) == FSM::Fsm_Success);
+        REQUIRE(other.execute(c) == FSM::Fsm_Success);
+        REQUIRE(other.is_final());
+        REQUIRE(fsm.is_initialized() == false);
+    }
+    
+    SECTION("Test add transitions to a frozen machine") {
+        FSM::Fsm other(def);
+        other.init();
+        other.execute(a);
+        other.add_transitions({
+            {FSM::Fsm::Fsm_Final, stateA, a, nullptr, nullptr},
+        });
+        REQUIRE(!other.definition());
+        REQUIRE(other.execute(b) == FSM::Fsm_Success);
+        REQUIRE(other.execute(c) == FSM::Fsm_Success);
+        REQUIRE(other.execute(a) == FSM::Fsm_Success);
+        REQUIRE(other.state() == stateA);
+        other.freeze();
+        REQUIRE(other.execute(d) == FSM::Fsm_Success);
+        REQUIRE(other.is_final());
+    }
+    
+    SECTION("Test action adding transitions") {
+        // The action and the definition it comes from are freed by
+        // add_transitions(), while the action runs.
+        for(bool frozen : { false, true }) {
+            FSM::Fsm other;
+            std::string added;
+            const std::string name(64, 'x');
+            other.add_transitions({
+                {FSM::Fsm::Fsm_Initial, stateA, a, nullptr, [&other, &added, name, stateA, c](FSM::Event *) {
+                    for(int i = 0; i < 16; i++) {
+                        other.add_transitions({ {stateA, FSM::Fsm::Fsm_Final, c, nullptr, nullptr} });
+                    }
+                    added = name;
+                }},
+            });
+            if(frozen) other.freeze();
+            other.init();
+            REQUIRE(other.execute(a) == FSM::Fsm_Success);
+            REQUIRE(other.state() == stateA);
+            REQUIRE(added == name);
+            REQUIRE(!other.definition());
+            REQUIRE(other.execute(c) == FSM::Fsm_Success);
+            REQUIRE(other.is_final());
+        }
+    }
+    
+    SECTION("Test rows layout") {
+        REQUIRE(def->layout() == FSM::Definition::Layout_Dense);
+        FSM::Fsm other;
+        other.add_transitions({
+            {FSM::Fsm::Fsm_Initial, stateA        , a, nullptr, nullptr},
+            {stateA          , stateA        , b, []{return false;}, [&count](FSM::Event * evt){count++;}},
+            {stateA          , stateA        , b, []{return true;}, [&count](FSM::Event * evt){count += 10;}},
+            {stateA          , FSM::Fsm::Fsm_Final, c, nullptr, nullptr},
+        });
+        other.freeze(FSM::Definition::Layout_Rows);
+        REQUIRE(other.definition()->layout() == FSM::Definition::Layout_Rows);
+        REQUIRE(other.definition()->header().runs == 3);
+        other.init();
+        REQUIRE(other.execute(b) == FSM::Fsm_NoMatchingTrigger);
+        REQUIRE(other.execute(a) == FSM::Fsm_Success);
+        REQUIRE(other.execute(a) == FSM::Fsm_NoMatchingTrigger);
+        REQUIRE(other.execute(d) == FSM::Fsm_NoMatchingTrigger);
+        REQUIRE(other.execute(b) == FSM::Fsm_Success);
+        REQUIRE(count == 10);
+        REQUIRE(other.execute(c) == FSM::Fsm_Success);
+        REQUIRE(other.is_final());
+    }
+    
+    SECTION("Test match classes") {
+        FSM::Definition::run_class_t classes[32];
+        for(unsigned int i = 0; i < 32; i++) {
+            classes[i] = static_cast<FSM::Definition::run_class_t>((i * 7) % 5);
+        }
+        for(FSM::Definition::index_t count = 0; count <= 32; count++) {
+            for(FSM::Definition::run_class_t cls = 0; cls < 6; cls++) {
+                uint32_t expected = 0;
+                for(unsigned int i = 0; i < count; i++) {
+                    if(classes[i] == cls) expected |= 1u << i;
+                }
+                REQUIRE(FSM::Definition::match_classes_scalar(classes, count, cls) == expected);
+                REQUIRE(FSM::Definition::match_classes(classes, count, cls) == expected);
+            }
+        }
+    }
+    
+    SECTION("Test layouts with many runs") {
+        // 40 triggers from stateA, each to a different state.
+        std::vector<FSM::Event *> events;
+        std::vector<FSM::State *> states;
+        FSM::Fsm other;
+        other.add_transitions({{FSM::Fsm::Fsm_Initial, stateA, a, nullptr, nullptr}});
+        for(int i = 0; i < 40; i++) {
+            events.push_back(new FSM::Event());
+            states.push_back(new FSM::State());
+            other.add_transitions({{stateA, states.back(), events.back(), nullptr, nullptr}});
+            other.add_transitions({{states.back(), stateA, a, nullptr, nullptr}});
+        }
+        SECTION("Rows") {
+            other.freeze(FSM::Definition::Layout_Rows);
+        }
+        SECTION("Hash") {
+            other.freeze(FSM::Definition::Layout_Hash);
+            REQUIRE(other.definition()->header().slots == other.definition()->header().runs);
+        }
+        SECTION("Auto") {
+            other.freeze();
+        }
+        other.init();
+        other.execute(a);
+        for(int i = 39; i >= 0; i--) {
+            REQUIRE(other.execute(events[i]) == FSM::Fsm_Success);
+            REQUIRE(other.state() == states[i]);
+            REQUIRE(other.execute(a) == FSM::Fsm_Success);
+        }
+        REQUIRE(other.execute(b) == FSM::Fsm_NoMatchingTrigger);
+        for(auto evt : events) delete evt;
+        for(auto state : states) delete state;
+    }
+    
+    delete a;
+    delete b;
+    delete c;
+    delete d;
+    delete stateA;
+}
+
+namespace {
+    int binary_count = 0;
+    bool binary_guard() { return true; }
+    void binary_action(FSM::Event * evt) { binary_count++; }
+}
+
+TEST_CASE("Test binary definition")
+{
+    const char * path = "fsm_test.fsmdef";
+    FSM::Event * a = new FSM::Event();
+    FSM::Event * b = new FSM::Event();
+    FSM::State * stateA = new FSM::State();
+    int count = 0;
+    
+    FSM::Registry registry;
+    registry.add_state("A", stateA);
+    registry.add_event("a", a);
+    registry.add_event("b", b);
+    registry.add_guard("guard", binary_guard);
+    registry.add_action("action", binary_action);
+    FSM::actionFn counter = registry.add_action("counter", [&count](FSM::Event * evt){count++;});
+    
+    FSM::Fsm fsm;
+    fsm.add_transitions({
+        {FSM::Fsm::Fsm_Initial, stateA        , a, binary_guard, binary_action},
+        {stateA          , FSM::Fsm::Fsm_Final, b, binary_guard, counter},
+    });
+    fsm.freeze();
+    REQUIRE(FSM::save_definition(*fsm.definition(), registry, path) == FSM::Fsm_Success);
+    
+    SECTION("Test load") {
+        std::shared_ptr<const FSM::Definition> def;
+        REQUIRE(FSM::load_definition(path, registry, def) == FSM::Fsm_Success);
+        REQUIRE(def->state_count() == 3);
+        REQUIRE(std::string(def->state_name(2)) == "A");
+        REQUIRE(std::string(def->action_name(1)) == "counter");
+        binary_count = 0;
+        FSM::Fsm loaded(def);
+        loaded.init();
+        REQUIRE(loaded.execute(a) == FSM::Fsm_Success);
+        REQUIRE(loaded.state() == stateA);
+        REQUIRE(loaded.execute(b) == FSM::Fsm_Success);
+        REQUIRE(loaded.is_final());
+        REQUIRE(binary_count == 1);
+        REQUIRE(count == 1);
+    }
+    
+    SECTION("Test load rows and hash layouts") {
+        for(auto layout : { FSM::Definition::Layout_Rows, FSM::Definition::Layout_Hash }) {
+            FSM::Fsm other;
+            other.add_transitions({
+                {FSM::Fsm::Fsm_Initial, stateA        , a, binary_guard, binary_action},
+                {stateA          , FSM::Fsm::Fsm_Final, b, binary_guard, counter},
+            });
+            other.freeze(layout);
+            REQUIRE(FSM::save_definition(*other.definition(), registry, path) == FSM::Fsm_Success);
+            std::shared_ptr<const FSM::Definition> def;
+            REQUIRE(FSM::load_definition(path, registry, def) == FSM::Fsm_Success);
+            REQUIRE(def->layout() == layout);
+            FSM::Fsm loaded(def);
+            loaded.init();
+            REQUIRE(loaded.execute(b) == FSM::Fsm_NoMatchingTrigger);
+            REQUIRE(loaded.execute(a) == FSM::Fsm_Success);
+            REQUIRE(loaded.execute(b) == FSM::Fsm_Success);
+            REQUIRE(loaded.is_final());
+        }
+    }
+    
+    SECTION("Test unbound name") {
+        FSM::Registry other;
+        other.add_state("A", stateA);
+        other.add_event("a", a);
+        std::shared_ptr<const FSM::Definition> def;
+        REQUIRE(FSM::load_definition(path, other, def) == FSM::Fsm_UnknownId);
+    }
+    
+    SECTION("Test unnamed action") {
+        FSM::Fsm other;
+        other.add_transitions({
+            {FSM::Fsm::Fsm_Initial, stateA, a, nullptr, [](FSM::Event * evt){}},
+        });
+        other.freeze();
+        REQUIRE(FSM::save_definition(*other.definition(), registry, path) == FSM::Fsm_UnknownId);
+    }
+    
+    SECTION("Test invalid file") {
+        FILE * file = fopen(path, "r+b");
+        fputs("garbage", file);
+        fclose(file);
+        std::shared_ptr<const FSM::Definition> def;
+        REQUIRE(FSM::load_definition(path, registry, def) == FSM::Fsm_IOError);
+    }
+    
+    SECTION("Test corrupted tables") {
+        FSM::Definition::Header header;
+        FILE * file = fopen(path, "rb");
+        REQUIRE(fread(&header, sizeof(header), 1, file) == 1);
+        fclose(file);
+        const uint32_t bad = 1000;
+        // A class, the target of a row and an action out of their tables.
+        for(uint32_t offset : { header.classes_offset,
+                                header.rows_offset + static_cast<uint32_t>(offsetof(FSM::Definition::Row, to)),
+                                header.rows_offset + static_cast<uint32_t>(offsetof(FSM::Definition::Row, action)) }) {
+            REQUIRE(FSM::save_definition(*fsm.definition(), registry, path) == FSM::Fsm_Success);
+            file = fopen(path, "r+b");
+            fseek(file, offset, SEEK_SET);
+            fwrite(&bad, sizeof(bad), 1, file);
+            fclose(file);
+            std::shared_ptr<const FSM::Definition> def;
+            REQUIRE(FSM::load_definition(path, registry, def) == FSM::Fsm_IOError);
+        }
+    }
+    
+    remove(path);
+    delete a;
+    delete b;
+    delete stateA;
+}
+
+TEST_CASE("Test text definition")
+{
+    FSM::Description description;
+    std::string error;
+    
+    SECTION("Test parse and bind") {
+        const char * text =
+            "# comment\n"
+            "machine Door\n"
+            "states Closed Open\n"
+            "events open close\n"
+            "\n"
+            "Fsm_Initial -> Closed on close\n"
+            "Closed -> Open on open [allowed] / log  # comment\n"
+            "Open -> Closed on close/log\n";
+        REQUIRE(FSM::parse_description(text, description, error) == FSM::Fsm_Success);
+        REQUIRE(description.name == "Door");
+        REQUIRE(description.states.size() == 4);
+        REQUIRE(description.transitions.size() == 3);
+        REQUIRE(description.transitions[1].guard == "allowed");
+        REQUIRE(description.transitions[2].action == "log");
+        REQUIRE(description.actions.size() == 1);
+        
+        int count = 0;
+        FSM::State * closed = new FSM::State();
+        FSM::State * open = new FSM::State();
+        FSM::Event * openEvt = new FSM::Event();
+        FSM::Event * closeEvt = new FSM::Event();
+        FSM::Registry registry;
+        registry.add_state("Closed", closed);
+        registry.add_state("Open", open);
+        registry.add_event("open", openEvt);
+        registry.add_event("close", closeEvt);
+        registry.add_guard("allowed", []{return true;});
+        std::vector<FSM::Trans> transitions;
+        REQUIRE(FSM::bind_description(description, registry, transitions, error) == FSM::Fsm_UnknownId);
+        REQUIRE(error == "line 7: 'log' is not registered");
+        registry.add_action("log", [&count](FSM::Event * evt){count++;});
+        REQUIRE(FSM::bind_description(description, registry, transitions, error) == FSM::Fsm_Success);
+        
+        FSM::Fsm fsm;
+        fsm.add_transitions(transitions);
+        fsm.init();
+        fsm.execute(closeEvt);
+        fsm.execute(openEvt);
+        REQUIRE(fsm.state() == open);
+        fsm.execute(closeEvt);
+        REQUIRE(fsm.state() == closed);
+        REQUIRE(count == 2);
+        
+        delete closed;
+        delete open;
+        delete openEvt;
+        delete closeEvt;
+    }
+    
+    SECTION("Test syntax error") {
+        REQUIRE(FSM::parse_description("states A\nevents e\nA -> A e\n", description, error) == FSM::Fsm_ParseError);
+        REQUIRE(error.find("line 3:") == 0);
+    }
+    
+    SECTION("Test undeclared names") {
+        REQUIRE(FSM::parse_description("states A\nevents e\nA -> B on e\n", description, error) == FSM::Fsm_ParseError);
+        REQUIRE(error == "line 3: undeclared state 'B'");
+        REQUIRE(FSM::parse_description("states A\nA -> A on e\n", description, error) == FSM::Fsm_ParseError);
+        REQUIRE(error == "line 2: undeclared event 'e'");
+    }
+}
+
+TEST_CASE("Test definition updates")
+{
+    FSM::State * A = new FSM::State();
+    FSM::State * B = new FSM::State();
+    FSM::State * C = new FSM::State();
+    FSM::Event * a = new FSM::Event();
+    FSM::Event * b = new FSM::Event();
+    FSM::Event * c = new FSM::Event();
+    int actions = 0;
+    FSM::Fsm prototype;
+    prototype.add_transitions({
+        {FSM::Fsm::Fsm_Initial, A, a, nullptr, nullptr},
+        {A, B, b, nullptr, nullptr},
+        {B, A, a, nullptr, nullptr},
+    });
+    prototype.freeze();
+    std::shared_ptr<const FSM::Definition> first = prototype.definition();
+    auto slot = std::make_shared<FSM::DefinitionSlot>(first);
+    REQUIRE(slot->epoch() == 0);
+    
+    FSM::Fsm one;
+    FSM::Fsm two;
+    one.set_definition_slot(slot);
+    two.set_definition_slot(slot);
+    REQUIRE(one.definition() == first);
+    one.init();
+    two.init();
+    REQUIRE(one.execute(a) == FSM::Fsm_Success);
+    REQUIRE(one.execute(b) == FSM::Fsm_Success);
+    REQUIRE(one.state() == B);
+    REQUIRE(one.execute(c) == FSM::Fsm_NoMatchingTrigger);
+    
+    // Copy on write: the machines take the new definition at their next
+    // execute().
+    REQUIRE(slot->add_transitions({ {B, C, c, nullptr, [&](FSM::Event *) { actions++; }} }) == 1);
+    REQUIRE(slot->epoch() == 1);
+    REQUIRE(one.definition() == first);
+    REQUIRE(one.execute(c) == FSM::Fsm_Success);
+    REQUIRE(one.state() == C);
+    REQUIRE(actions == 1);
+    REQUIRE(one.definition() == slot->load());
+    REQUIRE(two.definition() == first);
+    REQUIRE(two.execute(a) == FSM::Fsm_Success);
+    REQUIRE(two.definition() == slot->load());
+    REQUIRE(prototype.definition() == first);
+    
+    // Built on another thread.
+    std::atomic<uint64_t> published(0);
+    slot->add_transitions_async({ {C, A, a, nullptr, nullptr} }, [&](uint64_t epoch) { published = epoch; });
+    while(published.load() == 0) std::this_thread::yield();
+    REQUIRE(published.load() == 2);
+    REQUIRE(one.execute(a) == FSM::Fsm_Success);
+    REQUIRE(one.state() == A);
+    
+    // A state the new definition does not have matches nothing.
+    REQUIRE(one.execute(b) == FSM::Fsm_Success);
+    REQUIRE(slot->publish(first) == 3);
+    REQUIRE(one.execute(a) == FSM::Fsm_Success);
+    REQUIRE(one.execute(b) == FSM::Fsm_Success);
+    REQUIRE(one.execute(c) == FSM::Fsm_NoMatchingTrigger);
+    slot->add_transitions({ {B, C, c, nullptr, nullptr} });
+    REQUIRE(one.execute(c) == FSM::Fsm_Success);
+    slot->publish(first);
+    REQUIRE(one.execute(a) == FSM::Fsm_NoMatchingTrigger);
+    one.reset();
+    one.init();
+    REQUIRE(one.execute(a) == FSM::Fsm_Success);
+    REQUIRE(one.state() == A);
+    
+    // Readers on one thread, writers on another.
+    std::atomic<bool> stop(false);
+    std::thread reader([&]() {
+        FSM::Fsm fsm;
+        fsm.set_definition_slot(slot);
+        fsm.init();
+        while(not stop.load()) {
+            fsm.execute(a);
+            fsm.execute(b);
+            fsm.execute(c);
+        }
+    });
+    for(int i = 0; i < 50; i++) {
+        slot->add_transitions({ {C, B, b, nullptr, nullptr} });
+        slot->publish(first);
+    }
+    stop = true;
+    reader.join();
+    REQUIRE(slot->epoch() == 105);
+    
+    // Adding transitions to the machine itself stops following.
+    two.add_transitions({ {A, C, c, nullptr, nullptr} });
+    slot->publish(first);
+    REQUIRE(two.execute(c) == FSM::Fsm_Success);
+    REQUIRE(two.state() == C);
+    REQUIRE(two.definition() == nullptr);
+    
+    delete A;
+    delete B;
+    delete C;
+    delete a;
+    delete b;
+    delete c;
+}
+
+TEST_CASE("Test hot reload")
+{
+    FSM::State * waiting = new FSM::State();
+    FSM::State * queued = new FSM::State();
+    FSM::State * running = new FSM::State();
+    FSM::Event * start = new FSM::Event();
+    FSM::Event * done = new FSM::Event();
+    FSM::Registry registry;
+    registry.add_state("Waiting", waiting);
+    registry.add_state("Queued", queued);
+    registry.add_state("Running", running);
+    registry.add_event("start", start);
+    registry.add_event("done", done);
+    
+    const char * path = "fsm_test_reload.fsm";
+    auto write = [&](const char * text) {
+        // Replaced as editors do.
+        const std::string temporary = std::string(path) + ".tmp";
+        FILE * file = fopen(temporary.c_str(), "w");
+        fputs(text, file);
+        fclose(file);
+        rename(temporary.c_str(), path);
+    };
+    write("states Waiting Running\n"
+          "events start done\n"
+          "Fsm_Initial -> Waiting on done\n"
+          "Waiting -> Running on start\n"
+          "Running -> Waiting on done\n");
+    
+    FSM::DefinitionLoader loader(path, registry);
+    REQUIRE(loader.slot() == nullptr);
+    std::vector<FSM::Fsm_Errors> reports;
+    std::mutex reports_mutex;
+    loader.set_report_fn([&](FSM::Fsm_Errors err, const std::string &) {
+        std::lock_guard<std::mutex> lock(reports_mutex);
+        reports.push_back(err);
+    });
+    REQUIRE(loader.reload() == FSM::Fsm_Success);
+    REQUIRE(loader.slot() != nullptr);
+    FSM::Fsm fsm;
+    fsm.set_definition_slot(loader.slot());
+    fsm.init();
+    REQUIRE(fsm.execute(done) == FSM::Fsm_Success);
+    REQUIRE(fsm.state() == waiting);
+    
+    // Waits until the watcher published a definition or reported an error.
+    auto wait_reports = [&](size_t count) {
+        for(int i = 0; i < 500; i++) {
+            {
+                std::lock_guard<std::mutex> lock(reports_mutex);
+                if(reports.size() >= count) return true;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        return false;
+    };
+    
+    // Waiting is renamed Queued.
+    loader.map_state("Waiting", "Queued");
+    REQUIRE(loader.start() == FSM::Fsm_Success);
+    write("states Queued Running\n"
+          "events start done\n"
+          "Fsm_Initial -> Queued on done\n"
+          "Queued -> Running on start\n"
+          "Running -> Queued on done\n");
+    REQUIRE(wait_reports(2));
+    REQUIRE(reports[1] == FSM::Fsm_Success);
+    REQUIRE(loader.reloads() == 2);
+    REQUIRE(fsm.execute(start) == FSM::Fsm_Success);
+    REQUIRE(fsm.state() == running);
+    REQUIRE(fsm.execute(done) == FSM::Fsm_Success);
+    REQUIRE(fsm.state() == queued);
+    
+    // Invalid files are not published.
+    const uint64_t epoch = loader.slot()->epoch();
+    write("states Queued\n"
+          "Queued -> Nowhere on start\n");
+    REQUIRE(wait_reports(3));
+    REQUIRE(reports[2] == FSM::Fsm_ParseError);
+    write("states Queued Running Other\n"
+          "events start\n"
+          "Queued -> Other on start\n");
+    REQUIRE(wait_reports(4));
+    REQUIRE(reports[3] == FSM::Fsm_UnknownId);
+    REQUIRE(loader.failures() == 2);
+    REQUIRE(loader.slot()->epoch() == epoch);
+    REQUIRE(fsm.execute(start) == FSM::Fsm_Success);
+    REQUIRE(fsm.state() == running);
+    
+    // Running is removed: the machine goes to the fallback state.
+    loader.set_fallback_state("Queued");
+    write("states Queued\n"
+          "events start done\n"
+          "Fsm_Initial -> Queued on done\n"
+          "Queued -> Queued on start\n");
+    REQUIRE(wait_reports(5));
+    REQUIRE(reports[4] == FSM::Fsm_Success);
+    loader.stop();
+    REQUIRE(fsm.execute(start) == FSM::Fsm_Success);
+    REQUIRE(fsm.state() == queued);
+    
+    // Without watcher.
+    write("states Queued\n"
+          "events start\n"
+          "Queued -> Queued on start\n");
+    REQUIRE(loader.reload() == FSM::Fsm_Unsupported);
+    write("states Queued Fsm_AnyState\n"
+          "events start\n"
+          "Fsm_AnyState -> Queued on start\n");
+    REQUIRE(loader.reload() == FSM::Fsm_Unsupported);
+    write("states Queued\n"
+          "events start\n"
+          "Fsm_Initial -> Queued on start\n");
+    loader.set_fallback_state("Running");
+    REQUIRE(loader.reload() == FSM::Fsm_UnknownId);
+    loader.set_fallback_state("Queued");
+    loader.map_state("Waiting", "Running");
+    REQUIRE(loader.reload() == FSM::Fsm_UnknownId);
+    loader.map_state("Waiting", "Unknown");
+    REQUIRE(loader.reload() == FSM::Fsm_UnknownId);
+    REQUIRE(reports.size() == 10);
+    
+    remove(path);
+    delete waiting;
+    delete queued;
+    delete running;
+    delete start;
+    delete done;
+}
+
+TEST_CASE("Test byte streams")
+{
+    FSM::State * idle = new FSM::State();
+    FSM::State * number = new FSM::State();
+    FSM::State * word = new FSM::State();
+    FSM::Event * digit = new FSM::Event();
+    FSM::Event * letter = new FSM::Event();
+    FSM::Event * end = new FSM::Event();
+    FSM::Event * other = new FSM::Event();
+    std::vector<std::string> tokens;
+    std::string token;
+    auto emit = [&](FSM::Event *) { tokens.push_back(token); token.clear(); };
+    int words = 0;
+    word->setEnterFunction([&]() { words++; });
+    std::vector<FSM::Trans> transitions = {
+        {FSM::Fsm::Fsm_Initial, idle, other, nullptr, nullptr},
+        {idle, number, digit, nullptr, nullptr},
+        {number, number, digit, nullptr, nullptr},
+        {number, idle, end, nullptr, emit},
+        {idle, word, letter, nullptr, nullptr},
+        {word, idle, end, nullptr, nullptr},
+        {word, idle, digit, []() { return false; }, nullptr},
+    };
+    std::vector<FSM::Event *> triggers(256, other);
+    for(int c = '0'; c <= '9'; c++) triggers[c] = digit;
+    for(int c = 'a'; c <= 'z'; c++) triggers[c] = letter;
+    triggers[';'] = end;
+    triggers[' '] = nullptr;
+    
+    FSM::Fsm fsm;
+    fsm.add_transitions(transitions);
+    fsm.init();
+    REQUIRE(fsm.execute_bytes(nullptr, 0) == FSM::Fsm_Unsupported);
+    fsm.set_byte_triggers(triggers);
+    REQUIRE(fsm.execute_bytes(nullptr, 0) == FSM::Fsm_Success);
+    fsm.execute(other);
+    REQUIRE(fsm.definition());
+    
+    const std::string input = "12;ab;7 7;x9;;345";
+    REQUIRE(fsm.execute_bytes(reinterpret_cast<const uint8_t *>(input.data()), input.size()) == FSM::Fsm_Success);
+    REQUIRE(tokens.size() == 2);
+    REQUIRE(words == 2);
+    REQUIRE(fsm.state() == number);
+    
+    // The same states as execute(), with a debug function.
+    FSM::Fsm serial;
+    serial.add_transitions(transitions);
+    serial.init();
+    serial.execute(other);
+    std::vector<FSM::State *> states;
+    serial.add_debug_fn([&](FSM::State *, FSM::State * to, FSM::Event *) { states.push_back(to); });
+    for(char c : input) {
+        if(triggers[static_cast<uint8_t>(c)]) serial.execute(triggers[static_cast<uint8_t>(c)]);
+    }
+    REQUIRE(serial.state() == number);
+    std::vector<FSM::State *> bytes_states;
+    fsm.reset();
+    fsm.init();
+    fsm.execute(other);
+    fsm.add_debug_fn([&](FSM::State *, FSM::State * to, FSM::Event *) { bytes_states.push_back(to); });
+    fsm.execute_bytes(reinterpret_cast<const uint8_t *>(input.data()), input.size());
+    REQUIRE(bytes_states == states);
+    
+    // Adding transitions recompiles the table.
+    fsm.add_debug_fn(nullptr);
+    fsm.add_transitions({ {number, word, letter, nullptr, nullptr} });
+    const std::string more = "a";
+    fsm.execute_bytes(reinterpret_cast<const uint8_t *>(more.data()), more.size());
+    REQUIRE(fsm.state() == word);
+    
+    delete idle;
+    delete number;
+    delete word;
+    delete digit;
+    delete letter;
+    delete end;
+    delete other;
+}
+
+TEST_CASE("Test parallel runs")
+{
+    std::vector<FSM::State *> states;
+    std::vector<FSM::Event *> events;
+    for(int i = 0; i < 24; i++) states.push_back(new FSM::State());
+    for(int i = 0; i < 6; i++) events.push_back(new FSM::Event());
+    FSM::Event * other = new FSM::Event();
+    // Random targets, with a few states that ignore some events and an
+    // eventless chain from the last state.
+    unsigned int seed = 7;
+    auto random = [&](unsigned int n) { seed = seed * 1103515245u + 12345u; return (seed >> 8) % n; };
+    std::vector<FSM::Trans> transitions;
+    transitions.push_back({ FSM::Fsm::Fsm_Initial, states[0], events[0], nullptr, nullptr });
+    for(size_t s = 0; s + 1 < states.size(); s++) {
+        for(auto event : events) {
+            if(random(8) == 0) continue;
+            transitions.push_back({ states[s], states[random(static_cast<unsigned int>(states.size()))], event, nullptr, nullptr });
+        }
+    }
+    transitions.push_back({ states.back(), states[1], nullptr, nullptr, nullptr });
+    FSM::Fsm fsm;
+    fsm.add_transitions(transitions);
+    fsm.freeze();
+    
+    std::vector<FSM::Event *> stream;
+    for(int i = 0; i < 50000; i++) stream.push_back(random(50) == 0 ? other : events[random(6)]);
+    std::vector<FSM::State *> expected;
+    FSM::Fsm serial(fsm.definition());
+    serial.init();
+    for(auto event : stream) {
+        serial.execute(event);
+        expected.push_back(serial.state());
+    }
+    
+    FSM::ParallelRunner runner(fsm.definition(), 4);
+    REQUIRE(runner.supported());
+    runner.set_min_chunk(1000);
+    std::vector<FSM::State *> visited(stream.size());
+    FSM::State * end = nullptr;
+    REQUIRE(runner.run(stream.data(), stream.size(), FSM::Fsm::Fsm_Initial, end, visited.data()) == FSM::Fsm_Success);
+    REQUIRE(end == serial.state());
+    REQUIRE(visited == expected);
+    
+    // On a machine, without recording the states.
+    fsm.init();
+    REQUIRE(runner.run(fsm, stream.data(), stream.size()) == FSM::Fsm_Success);
+    REQUIRE(fsm.state() == serial.state());
+    
+    // Short streams run in a single chunk.
+    runner.set_min_chunk(100000);
+    REQUIRE(runner.run(stream.data(), 10, FSM::Fsm::Fsm_Initial, end) == FSM::Fsm_Success);
+    REQUIRE(end == expected[9]);
+    
+    FSM::State * unknown = new FSM::State();
+    REQUIRE(runner.run(stream.data(), 10, unknown, end) == FSM::Fsm_UnknownId);
+    
+    // Guards cannot be evaluated ahead.
+    transitions.push_back({ states[0], states[1], other, []() { return true; }, nullptr });
+    FSM::Fsm guarded;
+    guarded.add_transitions(transitions);
+    guarded.freeze();
+    FSM::ParallelRunner unsupported(guarded.definition());
+    REQUIRE_FALSE(unsupported.supported());
+    REQUIRE(unsupported.run(stream.data(), 10, FSM::Fsm::Fsm_Initial, end) == FSM::Fsm_Unsupported);
+    
+    for(auto state : states) delete state;
+    for(auto event : events) delete event;
+    delete other;
+    delete unknown;
+}
+
+TEST_CASE("Test product machines")
+{
+    FSM::State * a1 = new FSM::State();
+    FSM::State * b1 = new FSM::State();
+    FSM::State * b2 = new FSM::State();
+    FSM::Event * a = new FSM::Event();
+    FSM::Event * b = new FSM::Event();
+    FSM::Event * c = new FSM::Event();
+    FSM::Event * d = new FSM::Event();
+    std::vector<int> matches(2, 0);
+    int c_count = 0;
+    int eventless = 0;
+    // Detects "a b", and counts the c.
+    std::vector<FSM::Trans> first = {
+        {FSM::Fsm::Fsm_Initial, a1, a, nullptr, nullptr},
+        {a1, a1, a, nullptr, nullptr},
+        {a1, FSM::Fsm::Fsm_Final, b, nullptr, [&](FSM::Event *) { matches[0]++; }},
+        {FSM::Fsm::Fsm_AnyState, a1, c, nullptr, [&](FSM::Event * e) { REQUIRE(e == c); c_count++; }},
+    };
+    // Detects "b b" (with an eventless step), and is reset by any other
+    // trigger.
+    std::vector<FSM::Trans> second = {
+        {FSM::Fsm::Fsm_Initial, b1, b, nullptr, nullptr},
+        {b1, b2, b, nullptr, nullptr},
+        {b2, FSM::Fsm::Fsm_Final, nullptr, nullptr, [&](FSM::Event * e) { REQUIRE(e == FSM::Fsm::Fsm_Completion); eventless++; matches[1]++; }},
+        {b1, FSM::Fsm::Fsm_Initial, FSM::Fsm::Fsm_AnyTrigger, nullptr, nullptr},
+    };
+    FSM::Fsm one;
+    FSM::Fsm two;
+    one.add_transitions(first);
+    two.add_transitions(second);
+    one.freeze();
+    two.freeze();
+    
+    std::shared_ptr<const FSM::Product> product;
+    REQUIRE(FSM::Product::build({ one.definition(), two.definition() }, product) == FSM::Fsm_Success);
+    REQUIRE(product->component_count() == 2);
+    FSM::Fsm fsm(product->definition());
+    fsm.init();
+    one.init();
+    two.init();
+    
+    // The same states and actions as the components run separately.
+    const std::vector<FSM::Event *> stream = { a, d, a, c, b, c, a, b, b, d, b, b };
+    std::vector<int> separate;
+    for(FSM::Event * event : stream) {
+        one.execute(event);
+        two.execute(event);
+    }
+    separate = matches;
+    const int separate_c = c_count;
+    matches.assign(2, 0);
+    c_count = 0;
+    one.reset();
+    two.reset();
+    one.init();
+    two.init();
+    for(FSM::Event * event : stream) {
+        fsm.execute(event);
+        one.execute(event);
+        two.execute(event);
+        REQUIRE(product->component_state(fsm.state(), 0) == one.state());
+        REQUIRE(product->component_state(fsm.state(), 1) == two.state());
+    }
+    REQUIRE(matches[0] == 2 * separate[0]);
+    REQUIRE(matches[1] == 2 * separate[1]);
+    REQUIRE(c_count == 2 * separate_c);
+    REQUIRE(separate[0] == 1);
+    REQUIRE(separate[1] == 1);
+    REQUIRE(fsm.is_final());
+    REQUIRE(product->component_state(a1, 0) == nullptr);
+    
+    // Limits.
+    std::shared_ptr<const FSM::Product> small;
+    REQUIRE(FSM::Product::build({ one.definition(), two.definition() }, small, 2) == FSM::Fsm_StateLimit);
+    FSM::Fsm guarded;
+    guarded.add_transitions({ {FSM::Fsm::Fsm_Initial, a1, a, []() { return true; }, nullptr} });
+    guarded.freeze();
+    REQUIRE(FSM::Product::build({ one.definition(), guarded.definition() }, small) == FSM::Fsm_Unsupported);
+    
+    delete a1;
+    delete b1;
+    delete b2;
+    delete a;
+    delete b;
+    delete c;
+    delete d;
+}
+
+TEST_CASE("Test lazy products")
+{
+    FSM::Event * a = new FSM::Event();
+    FSM::Event * b = new FSM::Event();
+    FSM::Event * c = new FSM::Event();
+    FSM::Event * d = new FSM::Event();
+    std::vector<FSM::State *> states;
+    int actions = 0;
+    // Counters modulo 3, 4 and 5 of a, b and (a or c); any other trigger
+    // resets the last one.
+    std::vector<std::unique_ptr<FSM::Fsm> > machines;
+    const int sizes[] = { 3, 4, 5 };
+    for(int k = 0; k < 3; k++) {
+        std::vector<FSM::State *> ring;
+        for(int i = 0; i < sizes[k]; i++) {
+            ring.push_back(new FSM::State());
+            states.push_back(ring.back());
+        }
+        std::vector<FSM::Trans> transitions;
+        for(int i = -1; i < sizes[k]; i++) {
+            FSM::State * from = i < 0 ? FSM::Fsm::Fsm_Initial : ring[i];
+            FSM::State * next = ring[(i + 1) % sizes[k]];
+            if(k == 2) {
+                transitions.push_back({ from, next, nullptr, nullptr, [&](FSM::Event *) { actions++; }, FSM::TriggerSet::make({ a, c }) });
+                transitions.push_back({ from, ring[0], FSM::Fsm::Fsm_AnyTrigger, nullptr, nullptr });
+            } else {
+                transitions.push_back({ from, next, k == 0 ? a : b, nullptr, [&](FSM::Event *) { actions++; } });
+            }
+        }
+        machines.push_back(std::unique_ptr<FSM::Fsm>(new FSM::Fsm()));
+        machines.back()->add_transitions(transitions);
+        machines.back()->freeze();
+    }
+    std::vector<std::shared_ptr<const FSM::Definition> > components;
+    for(auto& machine : machines) components.push_back(machine->definition());
+
+    std::vector<FSM::Event *> stream;
+    unsigned int seed = 7;
+    for(int i = 0; i < 2000; i++) {
+        seed = seed * 1103515245 + 12345;
+        FSM::Event * events[] = { a, b, c, d };
+        stream.push_back(events[(seed >> 16) % 4]);
+    }
+
+    // The same states and actions as the components run separately, with
+    // a cache that holds all the states or only a few.
+    const size_t capacities[] = { 256, 3, 2 };
+    const FSM::LazyProduct::Policy policies[] = { FSM::LazyProduct::Cache_Flush, FSM::LazyProduct::Cache_Evict };
+    for(size_t capacity : capacities) {
+        for(FSM::LazyProduct::Policy policy : policies) {
+            std::unique_ptr<FSM::LazyProduct> lazy;
+            REQUIRE(FSM::LazyProduct::build(components, lazy, capacity, policy) == FSM::Fsm_Success);
+            REQUIRE(lazy->component_count() == 3);
+            for(auto& machine : machines) {
+                machine->reset();
+                machine->init();
+            }
+            REQUIRE(lazy->component_state(2) == machines[2]->state());
+            for(FSM::Event * event : stream) {
+                actions = 0;
+                for(auto& machine : machines) machine->execute(event);
+                const int separate = actions;
+                actions = 0;
+                REQUIRE(lazy->execute(event) == FSM::Fsm_Success);
+                REQUIRE(actions == separate);
+                for(size_t k = 0; k < 3; k++) {
+                    REQUIRE(lazy->component_state(k) == machines[k]->state());
+                }
+            }
+            REQUIRE(lazy->cached_states() <= capacity);
+            REQUIRE(not lazy->is_final());
+            if(capacity == 256) {
+                REQUIRE(lazy->cached_states() > 50);
+                REQUIRE(lazy->misses() <= lazy->cached_states() * 4);
+                REQUIRE(lazy->flushes() == 0);
+                REQUIRE(lazy->evictions() == 0);
+            } else if(policy == FSM::LazyProduct::Cache_Flush) {
+                REQUIRE(lazy->flushes() > 0);
+            } else {
+                REQUIRE(lazy->evictions() > 0);
+            }
+            lazy->reset();
+            REQUIRE(lazy->component_state(0) == FSM::Fsm::Fsm_Initial);
+        }
+    }
+
+    // Triggers of no component, and limits.
+    std::unique_ptr<FSM::LazyProduct> lazy;
+    REQUIRE(FSM::LazyProduct::build({ components[0], components[1] }, lazy) == FSM::Fsm_Success);
+    REQUIRE(lazy->execute(d) == FSM::Fsm_NoMatchingTrigger);
+    REQUIRE(lazy->execute(b) == FSM::Fsm_Success);
+    REQUIRE(FSM::LazyProduct::build({}, lazy) == FSM::Fsm_Unsupported);
+    REQUIRE(FSM::LazyProduct::build(components, lazy, 1) == FSM::Fsm_Unsupported);
+    FSM::Fsm guarded;
+    guarded.add_transitions({ {FSM::Fsm::Fsm_Initial, states[0], a, []() { return true; }, nullptr} });
+    guarded.freeze();
+    REQUIRE(FSM::LazyProduct::build({ components[0], guarded.definition() }, lazy) == FSM::Fsm_Unsupported);
+
+    for(FSM::State * state : states) delete state;
+    delete a;
+    delete b;
+    delete c;
+    delete d;
+}
+
+TEST_CASE("Test journal and replay")
+{
+    const char * path = "fsm_test.journal";
+    remove(path);
+    
+    struct DataEvent : public FSM::Event {
+        int data;
+    };
+    int count = 0;
+    int received = 0;
+    DataEvent * a = new DataEvent();
+    FSM::Event * b = new FSM::Event();
+    FSM::State * stateA = new FSM::State();
+    std::vector<FSM::Trans> transitions = {
+        {FSM::Fsm::Fsm_Initial, stateA        , a, nullptr, [&count](FSM::Event * evt){count++;}},
+        {stateA          , stateA        , a, nullptr, [&received](FSM::Event * evt){received = static_cast<DataEvent *>(evt)->data;}},
+        {stateA          , FSM::Fsm::Fsm_Final, b, nullptr, [&count](FSM::Event * evt){count++;}},
+    };
+    
+    {
+        FSM::Journal journal;
+        REQUIRE(journal.open(path, FSM::Journal_SyncNever, 4) == FSM::Fsm_Success);
+        journal.setEncoder([](FSM::Event * evt, std::string & bytes) {
+            int data = static_cast<DataEvent *>(evt)->data;
+            bytes.append(reinterpret_cast<const char *>(&data), sizeof(data));
+        });
+        FSM::Fsm fsm;
+        fsm.add_transitions(transitions);
+        fsm.add_journal_fn(journal.recorder(1));
+        fsm.init();
+        a->data = 1;
+        fsm.execute(a);
+        a->data = 42;
+        fsm.execute(a);
+        REQUIRE(journal.close() == FSM::Fsm_Success);
+        REQUIRE(count == 1);
+        REQUIRE(received == 42);
+    }
+    
+    SECTION("Test replay with actions") {
+        count = 0;
+        received = 0;
+        FSM::Fsm fsm;
+        fsm.add_transitions(transitions);
+        FSM::Replayer replayer;
+        replayer.add_instance(1, &fsm);
+        replayer.setDecoder([](FSM::Event * trigger, const char * data, size_t size) {
+            memcpy(&static_cast<DataEvent *>(trigger)->data, data, sizeof(int));
+            return trigger;
+        });
+        REQUIRE(replayer.replay(path) == FSM::Fsm_Success);
+        REQUIRE(replayer.replayed() == 3);
+        REQUIRE(fsm.state() == stateA);
+        REQUIRE(count == 1);
+        REQUIRE(received == 42);
+    }
+    
+    SECTION("Test state only replay from the last snapshot") {
+        {
+            FSM::Journal journal;
+            REQUIRE(journal.open(path) == FSM::Fsm_Success);
+            FSM::Fsm fsm;
+            fsm.add_transitions(transitions);
+            fsm.init();
+            fsm.execute(a);
+            journal.snapshot(1, fsm);
+            fsm.add_journal_fn(journal.recorder(1));
+            fsm.execute(b);
+        }
+        count = 0;
+        FSM::Fsm fsm;
+        fsm.add_transitions(transitions);
+        FSM::Replayer replayer;
+        replayer.add_instance(1, &fsm);
+        REQUIRE(replayer.replay(path, false) == FSM::Fsm_Success);
+        REQUIRE(replayer.replayed() == 2);
+        REQUIRE(fsm.is_final());
+        REQUIRE(count == 0);
+    }
+    
+    SECTION("Test replay of a torn journal") {
+        FILE * file = fopen(path, "ab");
+        fputs("torn", file);
+        fclose(file);
+        FSM::Fsm fsm;
+        fsm.add_transitions(transitions);
+        FSM::Replayer replayer;
+        replayer.add_instance(1, &fsm);
+        REQUIRE(replayer.replay(path, false) == FSM::Fsm_Success);
+        REQUIRE(replayer.replayed() == 3);
+        REQUIRE(fsm.state() == stateA);
+    }
+    
+    SECTION("Test append after a torn record") {
+        FILE * file = fopen(path, "ab");
+        fputs("torn", file);
+        fclose(file);
+        {
+            FSM::Journal journal;
+            REQUIRE(journal.open(path) == FSM::Fsm_Success);
+            FSM::Fsm fsm;
+            fsm.add_transitions(transitions);
+            fsm.init();
+            fsm.execute(a);
+            fsm.execute(b);
+            REQUIRE(journal.snapshot(1, fsm) == FSM::Fsm_Success);
+        }
+        FSM::Fsm fsm;
+        fsm.add_transitions(transitions);
+        FSM::Replayer replayer;
+        replayer.add_instance(1, &fsm);
+        REQUIRE(replayer.replay(path, false) == FSM::Fsm_Success);
+        REQUIRE(replayer.replayed() == 1);
+        REQUIRE(fsm.is_final());
+    }
+    
+    remove(path);
+    delete a;
+    delete b;
+    delete stateA;
+}
+
+TEST_CASE("Test journal of pending triggers")
+{
+    const char * path = "fsm_test_pending.journal";
+    remove(path);
+    
+    FSM::State * waiting = new FSM::State();
+    FSM::State * ready = new FSM::State();
+    FSM::Event * start = new FSM::Event();
+    FSM::Event * go = new FSM::Event();
+    FSM::Event * data = new FSM::Event();
+    std::vector<FSM::AsyncToken> tokens;
+    std::vector<FSM::Trans> transitions = {
+        {FSM::Fsm::Fsm_Initial, waiting, start, nullptr, nullptr},
+        {waiting, ready, go, nullptr, [&tokens](FSM::Event *) { tokens.push_back(FSM::Fsm::begin_async()); }},
+        {ready, waiting, data, nullptr, nullptr},
+    };
+    auto make = [&](FSM::Fsm & fsm) {
+        fsm.add_transitions(transitions);
+        fsm.add_deferrals(waiting, FSM::TriggerSet::make({ data }));
+    };
+    
+    {
+        FSM::Journal journal;
+        REQUIRE(journal.open(path) == FSM::Fsm_Success);
+        FSM::Fsm fsm;
+        make(fsm);
+        fsm.add_journal_fn(journal.recorder(1));
+        fsm.init();
+        fsm.execute(start);
+        REQUIRE(fsm.execute(data) == FSM::Fsm_Deferred);
+        // The deferred and the queued triggers are not recorded.
+        REQUIRE(journal.snapshot(1, fsm) == FSM::Fsm_Deferred);
+        fsm.reset();
+        fsm.init();
+        fsm.execute(start);
+        fsm.execute(go);
+        REQUIRE(fsm.is_transitioning());
+        REQUIRE(journal.snapshot(1, fsm) == FSM::Fsm_Transitioning);
+        tokens[0].complete();
+        REQUIRE(fsm.state() == ready);
+        REQUIRE(journal.snapshot(1, fsm) == FSM::Fsm_Success);
+        fsm.execute(data);
+        fsm.reset();
+        fsm.init();
+        fsm.execute(start);
+    }
+    
+    // The replayed snapshot and reset drop the triggers the machine had
+    // deferred or queued before.
+    FSM::Fsm fsm;
+    make(fsm);
+    fsm.init();
+    fsm.execute(start);
+    REQUIRE(fsm.execute(data) == FSM::Fsm_Deferred);
+    fsm.execute(go);
+    REQUIRE(fsm.is_transitioning());
+    REQUIRE(fsm.execute(data) == FSM::Fsm_Transitioning);
+    FSM::Replayer replayer;
+    replayer.add_instance(1, &fsm);
+    REQUIRE(replayer.replay(path, false) == FSM::Fsm_Success);
+    REQUIRE(replayer.replayed() == 5);
+    REQUIRE_FALSE(fsm.is_transitioning());
+    REQUIRE(fsm.deferred_count() == 0);
+    REQUIRE(fsm.state() == waiting);
+    tokens[1].complete();
+    REQUIRE(fsm.state() == waiting);
+    
+    remove(path);
+    delete waiting;
+    delete ready;
+    delete start;
+    delete go;
+    delete data;
+}
+
+TEST_CASE("Test event log")
+{
+    FSM::State * locked = new FSM::State();
+    FSM::State * unlocked = new FSM::State();
+    FSM::Event * coin = new FSM::Event();
+    FSM::Event * push = new FSM::Event();
+    FSM::Event * unknown = new FSM::Event();
+    std::vector<FSM::Trans> transitions = {
+        {FSM::Fsm::Fsm_Initial, locked, coin, nullptr, nullptr},
+        {FSM::Fsm::Fsm_Initial, locked, push, nullptr, nullptr},
+        {locked, unlocked, coin, nullptr, nullptr},
+        {unlocked, locked, push, nullptr, nullptr},
+    };
+    int coins = 0;
+    locked->setExitFunction([&]() { coins++; });
+    FSM::Fsm first;
+    FSM::Fsm second;
+    first.add_transitions(transitions);
+    second.add_transitions(transitions);
+    second.freeze();
+    first.init();
+    second.init();
+    
+    const char * path = "fsm_test.eventlog";
+    remove(path);
+    FSM::EventLog log;
+    
+    SECTION("Test records with instance numbers") {
+        // { instance, trigger } records, the last one torn.
+        std::vector<uint32_t> records = {
+            0, coin->getID(), 1, coin->getID(), 0, coin->getID(), 1, coin->getID(),
+            1, push->getID(), 2, coin->getID(), 0, unknown->getID(), 1, coin->getID(), 0,
+        };
+        FILE * file = fopen(path, "wb");
+        fwrite(records.data(), sizeof(uint32_t), records.size(), file);
+        fclose(file);
+        
+        REQUIRE(log.open(path, FSM::EventLogFormat(8, 4, 0)) == FSM::Fsm_Success);
+        REQUIRE(log.size() == 8);
+        log.add_instance(0, &first);
+        log.add_instance(1, &second);
+        REQUIRE(log.run() == FSM::Fsm_Success);
+        REQUIRE(log.executed() == 6);
+        REQUIRE(log.skipped() == 2);
+        REQUIRE(first.state() == unlocked);
+        REQUIRE(second.state() == unlocked);
+        REQUIRE(coins == 3);
+        
+        // A range of records.
+        REQUIRE(log.run(4, 5) == FSM::Fsm_Success);
+        REQUIRE(log.executed() == 1);
+        REQUIRE(second.state() == locked);
+    }
+    
+    SECTION("Test trigger records") {
+        // With IDs that no trigger has.
+        std::vector<uint32_t> records = { coin->getID(), 0xFFFFFFFFu, coin->getID(), 0x80000000u, push->getID(), coin->getID(), 0xFFFFFFFFu };
+        FILE * file = fopen(path, "wb");
+        fwrite(records.data(), sizeof(uint32_t), records.size(), file);
+        fclose(file);
+        
+        REQUIRE(log.open(path) == FSM::Fsm_Success);
+        log.add_instance(0, &first);
+        REQUIRE(log.run() == FSM::Fsm_Success);
+        REQUIRE(log.executed() == 4);
+        REQUIRE(log.skipped() == 3);
+        REQUIRE(first.state() == unlocked);
+        REQUIRE(coins == 2);
+    }
+    
+    SECTION("Test invalid logs") {
+        REQUIRE(log.open(path) == FSM::Fsm_IOError);
+        FILE * file = fopen(path, "wb");
+        fclose(file);
+        REQUIRE(log.open(path, FSM::EventLogFormat(4, 2)) == FSM::Fsm_IOError);
+        REQUIRE(log.open(path) == FSM::Fsm_Success);
+        REQUIRE(log.size() == 0);
+        REQUIRE(log.run() == FSM::Fsm_Success);
+    }
+    
+    log.close();
+    remove(path);
+    delete locked;
+    delete unlocked;
+    delete coin;
+    delete push;
+    delete unknown;
+}
+
+namespace {
+    struct PayloadEvent : public FSM::Event {
+        PayloadEvent(unsigned int id, int value) : FSM::Event(id), value(value) {}
+        int value;
+    };
+}
+
+TEST_CASE("Test event pool")
+{
+    FSM::State * s1 = new FSM::State();
+    FSM::State * s2 = new FSM::State();
+    FSM::Event * e1 = new FSM::Event();
+    int received = 0;
+    FSM::Fsm fsm;
+    fsm.add_transitions({
+        { FSM::Fsm::Fsm_Initial, s1, e1, nullptr, nullptr },
+        { s1, s2, e1, nullptr, [&received](FSM::Event * evt){ received = static_cast<PayloadEvent *>(evt)->value; } },
+    });
+    fsm.init();
+    
+    FSM::EventPool<PayloadEvent> pool(4);
+    
+    SECTION("Test events created as a trigger") {
+        PayloadEvent * evt = pool.create_as(e1, 1);
+        REQUIRE(evt->getID() == e1->getID());
+        fsm.execute(evt);
+        pool.release(evt);
+        evt = pool.create_as(e1, 42);
+        fsm.execute(evt);
+        pool.release(evt);
+        REQUIRE(fsm.state() == s2);
+        REQUIRE(received == 42);
+    }
+    
+    SECTION("Test slots and IDs are reused") {
+        PayloadEvent * a = pool.create(1);
+        PayloadEvent * b = pool.create(2);
+        REQUIRE(a->getID() != b->getID());
+        REQUIRE(a->getID() != e1->getID());
+        const unsigned int id = a->getID();
+        pool.release(a);
+        PayloadEvent * c = pool.create(3);
+        REQUIRE(c == a);
+        REQUIRE(c->getID() == id);
+        REQUIRE(c->value == 3);
+        pool.release(b);
+        pool.release(c);
+        
+        // Only one chunk is used.
+        for(int i = 0; i < 100; i++) {
+            pool.release(pool.create(i));
+        }
+        REQUIRE(pool.capacity() == 4);
+    }
+    
+    SECTION("Test release from another thread") {
+        std::vector<PayloadEvent *> events;
+        for(int i = 0; i < 4; i++) {
+            events.push_back(pool.create(i));
+        }
+        std::thread consumer([&pool, &events]{
+            for(auto evt : events) pool.release(evt);
+        });
+        consumer.join();
+        for(int i = 0; i < 4; i++) {
+            events[i] = pool.create(i);
+        }
+        REQUIRE(pool.capacity() == 4);
+        for(auto evt : events) pool.release(evt);
+    }
+    
+    SECTION("Test concurrent releases from other threads") {
+        std::vector<PayloadEvent *> events;
+        for(int i = 0; i < 1024; i++) {
+            events.push_back(pool.create(i));
+        }
+        // The owner takes the remote slots back while the others push.
+        std::atomic<int> running(4);
+        std::vector<std::thread> consumers;
+        for(size_t t = 0; t < 4; t++) {
+            consumers.push_back(std::thread([&pool, &events, &running, t]{
+                for(size_t i = t; i < events.size(); i += 4) pool.release(events[i]);
+                running--;
+            }));
+        }
+        int created = 0;
+        while(running != 0) {
+            pool.release(pool.create(created++));
+        }
+        for(auto& consumer : consumers) consumer.join();
+        
+        // Every slot is available again, once.
+        const size_t capacity = pool.capacity();
+        events.clear();
+        for(size_t i = 0; i < capacity; i++) {
+            events.push_back(pool.create(static_cast<int>(i)));
+        }
+        REQUIRE(pool.capacity() == capacity);
+        std::sort(events.begin(), events.end());
+        REQUIRE(std::adjacent_find(events.begin(), events.end()) == events.end());
+        for(auto evt : events) pool.release(evt);
+    }
+    
+    delete s1;
+    delete s2;
+    delete e1;
+}
+
+TEST_CASE("Test typed events")
+{
+    struct Coin {
+        int cents;
+    };
+    
+    FSM::State * locked = new FSM::State();
+    FSM::State * unlocked = new FSM::State();
+    FSM::TypedEvent<Coin> coin;
+    FSM::Event * push = new FSM::Event();
+    int total = 0;
+    FSM::Fsm fsm;
+    fsm.add_transitions({
+        { FSM::Fsm::Fsm_Initial, locked, push, nullptr, nullptr },
+        { locked, unlocked, &coin, nullptr, FSM::typed_action<Coin>([&total](const Coin & c){ total += c.cents; }) },
+        { unlocked, locked, push, nullptr, nullptr },
+    });
+    
+    SECTION("Test payload by reference") {
+        fsm.init();
+        fsm.execute(push);
+        Coin c = { 50 };
+        REQUIRE(fsm.execute(coin, c) == FSM::Fsm_Success);
+        REQUIRE(fsm.state() == unlocked);
+        REQUIRE(total == 50);
+    }
+    
+    SECTION("Test events from a receive buffer") {
+        fsm.freeze();
+        fsm.init();
+        fsm.execute(push);
+        const Coin buffer[] = { { 10 }, { 20 } };
+        for(auto& c : buffer) {
+            FSM::TypedEvent<Coin> evt(coin, c);
+            REQUIRE(evt.getID() == coin.getID());
+            REQUIRE(&evt.payload() == &c);
+            fsm.execute(&evt);
+            fsm.execute(push);
+        }
+        REQUIRE(total == 30);
+        REQUIRE_FALSE(coin.hasPayload());
+    }
+    
+    delete locked;
+    delete unlocked;
+    delete push;
+}
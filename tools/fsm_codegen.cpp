@@ -0,0 +1,234 @@
+/**
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2015 Eric Halère
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * \file fsm_codegen.cpp
+ *
+ * Code generator
+ * ==============
+ *
+ * Reads a text definition (see fsm_dsl.h) and writes a C++ header that
+ * implements the machine with `switch` statements.
+ *
+ * ~~~
+ * fsm_codegen turnstile.fsm turnstile_fsm.h
+ * ~~~
+ *
+ * The header declares, in a namespace named after the machine:
+ *
+ * - `enum class State` with the pseudo states and the declared states,
+ * - `enum class Event` with the declared events,
+ * - `template<typename Hooks> class Fsm`, with the same interface as
+ *   `FSM::Fsm` (`init()`, `reset()`, `execute()`, `state()`, `is_initial()`,
+ *   `is_final()`), except that states and events are enum values.
+ *
+ * Guards and actions are member functions of `Hooks`, which the user
+ * implements: `bool guard()` and `void action(Event trigger)`. They are called
+ * directly and can be inlined.
+ */
+
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include "../include/fsm_dsl.h"
+
+namespace {
+
+    std::string upper(const std::string & name) {
+        std::string result;
+        for(char c : name) result.push_back(static_cast<char>(toupper(static_cast<unsigned char>(c))));
+        return result;
+    }
+
+    // Returns the file name without directory and extension.
+    std::string stem(const std::string & path) {
+        std::string name = path.substr(path.find_last_of('/') + 1);
+        return name.substr(0, name.find('.'));
+    }
+
+    void generate(const FSM::Description & description, const std::string & source, std::ostream & out) {
+        const std::string & name = description.name;
+        const std::string guard = upper(name) + "_FSM_H";
+
+        // Transitions per state, then per event, in the order of the file.
+        std::map<std::string, std::map<std::string, std::vector<const FSM::Description::Transition *> > > table;
+        for(auto& transition : description.transitions) {
+            table[transition.from_state][transition.trigger].push_back(&transition);
+        }
+
+        out << "// Generated by fsm_codegen from " << source << ". Do not edit.\n"
+            << "\n"
+            << "#ifndef " << guard << "\n"
+            << "#define " << guard << "\n"
+            << "\n"
+            << "#include \"fsm.h\"\n"
+            << "\n"
+            << "namespace " << name << " {\n"
+            << "\n"
+            << "    enum class State {\n";
+        for(auto& state : description.states) {
+            out << "        " << state << ",\n";
+        }
+        out << "    };\n"
+            << "\n"
+            << "    enum class Event {\n";
+        for(auto& event : description.events) {
+            out << "        " << event << ",\n";
+        }
+        out << "    };\n"
+            << "\n"
+            << "    /**\n"
+            << "     * Specialized implementation of the " << name << " state machine.\n";
+        if(not description.guards.empty() || not description.actions.empty()) {
+            out << "     *\n"
+                << "     * `Hooks` must implement the following functions.\n"
+                << "     *\n";
+            for(auto& guard_name : description.guards) {
+                out << "     * - bool " << guard_name << "()\n";
+            }
+            for(auto& action_name : description.actions) {
+                out << "     * - void " << action_name << "(Event trigger)\n";
+            }
+        }
+        out << "     */\n"
+            << "    template<typename Hooks>\n"
+            << "    class Fsm {\n"
+            << "        Hooks & m_hooks;\n"
+            << "        // Current state.\n"
+            << "        State m_cs;\n"
+            << "        bool m_initialized;\n"
+            << "\n"
+            << "    public:\n"
+            << "        explicit Fsm(Hooks & hooks) : m_hooks(hooks), m_cs(State::Fsm_Initial), m_initialized(false) {}\n"
+            << "\n"
+            << "        void init()\n"
+            << "        {\n"
+            << "            if(!m_initialized) {\n"
+            << "                m_cs = State::Fsm_Initial;\n"
+            << "                m_initialized = true;\n"
+            << "            }\n"
+            << "        }\n"
+            << "\n"
+            << "        void reset()\n"
+            << "        {\n"
+            << "            m_cs = State::Fsm_Initial;\n"
+            << "            m_initialized = false;\n"
+            << "        }\n"
+            << "\n"
+            << "        FSM::Fsm_Errors execute(Event trigger)\n"
+            << "        {\n"
+            << "            if(not m_initialized) {\n"
+            << "                return FSM::Fsm_NotInitialized;\n"
+            << "            }\n"
+            << "\n"
+            << "            switch(m_cs) {\n";
+        for(auto& state : description.states) {
+            auto row = table.find(state);
+            if(row == table.end()) continue;
+            out << "            case State::" << state << ":\n"
+                << "                switch(trigger) {\n";
+            for(auto& cell : row->second) {
+                out << "                case Event::" << cell.first << ":\n";
+                bool unguarded = false;
+                for(auto transition : cell.second) {
+                    std::string indent = "                    ";
+                    if(not transition->guard.empty()) {
+                        out << indent << "if(m_hooks." << transition->guard << "()) {\n";
+                        indent += "    ";
+                    }
+                    if(not transition->action.empty()) {
+                        out << indent << "m_hooks." << transition->action << "(trigger);\n";
+                    }
+                    out << indent << "m_cs = State::" << transition->to_state << ";\n"
+                        << indent << "return FSM::Fsm_Success;\n";
+                    if(transition->guard.empty()) {
+                        // The following transitions can never be taken.
+                        unguarded = true;
+                        break;
+                    }
+                    out << "                    }\n";
+                }
+                if(not unguarded) {
+                    out << "                    return FSM::Fsm_Success;\n";
+                }
+            }
+            out << "                default:\n"
+                << "                    break;\n"
+                << "                }\n"
+                << "                break;\n";
+        }
+        out << "            default:\n"
+            << "                break;\n"
+            << "            }\n"
+            << "            return FSM::Fsm_NoMatchingTrigger;\n"
+            << "        }\n"
+            << "\n"
+            << "        State state() const { return m_cs; }\n"
+            << "        bool is_initial() const { return m_cs == State::Fsm_Initial; }\n"
+            << "        bool is_final() const { return m_cs == State::Fsm_Final; }\n"
+            << "    };\n"
+            << "\n"
+            << "} // end namespace " << name << "\n"
+            << "\n"
+            << "#endif // " << guard << "\n";
+    }
+
+} // end anonymous namespace
+
+int main(int argc, char ** argv) {
+    if(argc < 2 || argc > 3) {
+        std::cerr << "usage: " << argv[0] << " <definition.fsm> [<output.h>]\n";
+        return 2;
+    }
+
+    FSM::Description description;
+    std::string error;
+    if(FSM::load_description(argv[1], description, error) != FSM::Fsm_Success) {
+        std::cerr << argv[1] << ": " << error << "\n";
+        return 1;
+    }
+    if(description.name.empty()) {
+        description.name = stem(argv[1]);
+    }
+    FSM::Description check;
+    if(FSM::parse_description("machine " + description.name, check, error) != FSM::Fsm_Success) {
+        std::cerr << argv[1] << ": invalid machine name '" << description.name << "'\n";
+        return 1;
+    }
+
+    std::ostringstream code;
+    const std::string source = argv[1];
+    generate(description, source.substr(source.find_last_of('/') + 1), code);
+    if(argc == 2) {
+        std::cout << code.str();
+        return 0;
+    }
+    std::ofstream out(argv[2]);
+    out << code.str();
+    out.close();
+    if(not out) {
+        std::cerr << argv[2] << ": cannot write\n";
+        return 1;
+    }
+    return 0;
+}